@@ -12,11 +12,37 @@ include_directories(
 )
 
 ## Declare a C++ library
-add_library(${PROJECT_NAME}
+set(${PROJECT_NAME}_SOURCES
   lib/${PROJECT_NAME}/ndtcell.cpp
   lib/${PROJECT_NAME}/core.cpp
   lib/${PROJECT_NAME}/ndtframe.cpp
+  lib/${PROJECT_NAME}/scanlog.cpp
+  lib/${PROJECT_NAME}/beamtable.cpp
+  lib/${PROJECT_NAME}/tiledmap.cpp
+  lib/${PROJECT_NAME}/ndtquadtree.cpp
+  lib/${PROJECT_NAME}/sharedmap.cpp
+  lib/${PROJECT_NAME}/scanring.cpp
+  lib/${PROJECT_NAME}/matcher.cpp
+  lib/${PROJECT_NAME}/evaluation.cpp
+  lib/${PROJECT_NAME}/shadowmatcher.cpp
+  lib/${PROJECT_NAME}/realtime.cpp
 )
+add_library(${PROJECT_NAME} ${${PROJECT_NAME}_SOURCES})
+## Forgetting model of the map cells (NDT_DECAY_FORGETTING): decayed
+## statistics, or the window of NDT_WINDOW_SIZE batches of points when off
+option(NDTPSO_DECAY_FORGETTING "Decayed statistics of the map cells" ON)
+if(NDTPSO_DECAY_FORGETTING)
+  set(NDTPSO_DECAY true)
+  set(NDTPSO_OTHER_FORGETTING window)
+  set(NDTPSO_OTHER_DECAY false)
+else()
+  set(NDTPSO_DECAY false)
+  set(NDTPSO_OTHER_FORGETTING decay)
+  set(NDTPSO_OTHER_DECAY true)
+endif()
+target_compile_definitions(${PROJECT_NAME}
+  PUBLIC NDT_DECAY_FORGETTING=${NDTPSO_DECAY})
+target_link_libraries(${PROJECT_NAME} pthread rt)
 
 ## Add cmake target dependencies of the library
 ## as an example, code may need to be generated before libraries
@@ -26,7 +52,7 @@ add_library(${PROJECT_NAME}
 ## Declare a C++ executable
 ## With catkin_make all packages are built within a single CMake context
 ## The recommended prefix ensures that target names across packages don't collide
-add_executable(${PROJECT_NAME}_standalone_test src/ndtpso_slam_test.cpp)
+add_executable(${PROJECT_NAME}_standalone_test src/test/ndtpso_slam_test.cpp)
 
 ## Rename C++ executable without prefix
 ## The above recommended prefix causes long target names, the following renames the
@@ -46,3 +72,79 @@ target_link_libraries(${PROJECT_NAME}_standalone_test
   pthread
   X11
 )
+
+add_executable(${PROJECT_NAME}_optimizer_benchmark src/test/ndtpso_optimizer_benchmark.cpp)
+target_link_libraries(${PROJECT_NAME}_optimizer_benchmark
+  ${OpenCV_LIBRARIES}
+  ${PROJECT_NAME}
+)
+
+add_executable(${PROJECT_NAME}_map_benchmark src/test/ndtpso_map_benchmark.cpp)
+target_link_libraries(${PROJECT_NAME}_map_benchmark
+  ${OpenCV_LIBRARIES}
+  ${PROJECT_NAME}
+)
+
+add_executable(${PROJECT_NAME}_parallel_benchmark src/test/ndtpso_parallel_benchmark.cpp)
+target_link_libraries(${PROJECT_NAME}_parallel_benchmark
+  ${OpenCV_LIBRARIES}
+  ${PROJECT_NAME}
+)
+
+add_executable(${PROJECT_NAME}_batch src/test/ndtpso_batch.cpp)
+target_link_libraries(${PROJECT_NAME}_batch
+  ${OpenCV_LIBRARIES}
+  ${PROJECT_NAME}
+)
+
+add_executable(${PROJECT_NAME}_autotune src/test/ndtpso_autotune.cpp)
+target_link_libraries(${PROJECT_NAME}_autotune
+  ${OpenCV_LIBRARIES}
+  ${PROJECT_NAME}
+)
+
+add_executable(${PROJECT_NAME}_landscape src/test/ndtpso_landscape.cpp)
+target_link_libraries(${PROJECT_NAME}_landscape
+  ${OpenCV_LIBRARIES}
+  ${PROJECT_NAME}
+)
+
+add_executable(${PROJECT_NAME}_kernels_test src/test/ndtpso_kernels_test.cpp)
+target_link_libraries(${PROJECT_NAME}_kernels_test
+  ${PROJECT_NAME}
+)
+
+add_executable(${PROJECT_NAME}_tiledmap_test
+  src/test/ndtpso_tiledmap_test.cpp)
+target_link_libraries(${PROJECT_NAME}_tiledmap_test
+  ${PROJECT_NAME}
+)
+
+## The kernels test with the other forgetting model (see
+## NDTPSO_DECAY_FORGETTING), the library is built again as the cells layout
+## changes
+set(NDTPSO_OTHER ${PROJECT_NAME}_${NDTPSO_OTHER_FORGETTING})
+add_library(${NDTPSO_OTHER} STATIC ${${PROJECT_NAME}_SOURCES})
+target_compile_definitions(${NDTPSO_OTHER}
+  PUBLIC NDT_DECAY_FORGETTING=${NDTPSO_OTHER_DECAY})
+target_link_libraries(${NDTPSO_OTHER} pthread rt)
+add_executable(${NDTPSO_OTHER}_kernels_test
+  src/test/ndtpso_kernels_test.cpp)
+target_link_libraries(${NDTPSO_OTHER}_kernels_test
+  ${NDTPSO_OTHER}
+)
+
+## Differential tests of the optimized kernels, run by ctest in the build
+## directory, NDTPSO_TEST_SCANS (a scan_export log) adds the recorded inputs
+enable_testing()
+add_test(NAME ${PROJECT_NAME}_kernels COMMAND ${PROJECT_NAME}_kernels_test)
+set(NDTPSO_TEST_SCANS "" CACHE FILEPATH "Scan log for the kernels test")
+if(NDTPSO_TEST_SCANS)
+  add_test(NAME ${PROJECT_NAME}_kernels_recorded
+    COMMAND ${PROJECT_NAME}_kernels_test ${NDTPSO_TEST_SCANS})
+endif()
+## Same with the other forgetting model
+add_test(NAME ${PROJECT_NAME}_kernels_${NDTPSO_OTHER_FORGETTING}
+  COMMAND ${NDTPSO_OTHER}_kernels_test)
+## Drive across the tiles of a simulated corridor (see TiledMap)
+add_test(NAME ${PROJECT_NAME}_tiledmap COMMAND ${PROJECT_NAME}_tiledmap_test)
@@ -0,0 +1,27 @@
+#ifndef BEAMTABLE_H
+#define BEAMTABLE_H
+
+#include <eigen3/Eigen/Core>
+
+using Eigen::ArrayXd;
+
+// Cosines and sines of the beams' angles of a laser scanner, they depend only
+// on the scan geometry, so they are computed once per sensor
+class BeamTable {
+private:
+  unsigned int s_size{0};
+  float s_min_angle{0.f}, s_angle_increment{0.f};
+
+public:
+  ArrayXd cosines, sines;
+  bool matches(unsigned int size, float min_angle,
+               float angle_increment) const;
+  void reset(unsigned int size, float min_angle, float angle_increment);
+
+  // The table of the given geometry, from a small per-thread cache (one
+  // entry per sensor), it is recomputed only when the geometry changes
+  static const BeamTable &get(unsigned int size, float min_angle,
+                              float angle_increment);
+};
+
+#endif // BEAMTABLE_H
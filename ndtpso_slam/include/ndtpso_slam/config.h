@@ -1,14 +1,116 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <cstddef>
+#include <string>
+
 // Default values
 #define NDT_MAX_POINTS_PER_CELL 50
 #define LASER_IGNORE_EPSILON 0.1f // Ignore points around the origin with 10cm
 
 #define NDT_WINDOW_SIZE 100
+// Scans with less points are inserted in the map by a single thread
+#define NDT_PARALLEL_UPDATE_MIN_POINTS 4096
+// Builds with less modified cells are done by a single thread
+#define NDT_PARALLEL_BUILD_MIN_CELLS 256
+
+// Forgetting model of the NDT cells: exponentially decayed sufficient
+// statistics (default, O(1) memory per cell, no window buffers) with a
+// configurable half-life, or a sliding window of NDT_WINDOW_SIZE batches of
+// points, set by the build (CMake option NDTPSO_DECAY_FORGETTING)
+#ifndef NDT_DECAY_FORGETTING
+#define NDT_DECAY_FORGETTING true
+#endif
+#define NDT_DECAY_HALF_LIFE 100. // In the map time unit, see NDTPSOConfig
+
+#if NDT_DECAY_FORGETTING
+#define NDT_POINTS_BUFFERS 1 // Only the points since the last build are kept
+#else
+#define NDT_POINTS_BUFFERS NDT_WINDOW_SIZE
+#endif
+
+// Stale cells eviction, cells not updated since NDT_EVICTION_MAX_AGE or
+// farther than NDT_EVICTION_MAX_DISTANCE from the robot are released
+#define NDT_EVICTION_MAX_AGE 0.      // In the map time unit, 0 to disable
+#define NDT_EVICTION_MAX_DISTANCE 0. // In meters, 0 to disable
+#define NDT_EVICTION_PERIOD 10       // Updates between two eviction passes
+// The spill file is compacted when over half of it is outdated records
+#define NDT_SPILL_COMPACT_MIN_SIZE (1 << 20) // Bytes
+
+// Adaptive resolution (see NDTQuadTree), the cells of the frame are split
+// down to NDT_QUADTREE_MIN_CELL_SIDE where a Gaussian fits their points poorly
+#define NDT_QUADTREE false
+#define NDT_QUADTREE_MIN_CELL_SIDE .25
+#define NDT_QUADTREE_MAX_POINTS 400
+#define NDT_QUADTREE_MAX_THICKNESS .05 // Spread across the main axis, meters
+
+// Disk-backed tiled map (see TiledMap)
+#define TILED_MAP_TILE_SIZE 25. // In meters, rounded to a number of cells
+#define TILED_MAP_CACHE_SIZE 64 // Tiles kept in memory (view and prefetch)
+
+// Map shared between processes (see SharedMap), number of snapshots kept: a
+// reader can match on a snapshot until the owner published SLOTS-1 newer ones
+#define SHARED_MAP_SLOTS 4
+// Scans kept by the shared memory scan transport (see ScanRing)
+#define SCAN_RING_SLOTS 8
+
+// Scan matching pipeline (see Matcher)
+#define MATCHER_FRAME_SIZE 100
+#define MATCHER_CELL_SIDE .5
+#define MATCHER_QUALITY_BLEND 0.
+// Stationary scan detection: a scan whose ranges differ from the last matched
+// scan's by less than MAX_DIFFERENCE on average (meters, each beam's
+// difference is clipped to MAX_BEAM_DIFFERENCE so a few flickering beams
+// don't count) isn't matched, at most for MAX_INTERVAL seconds in a row
+#define STATIONARY_MAX_DIFFERENCE .03
+#define STATIONARY_MAX_BEAM_DIFFERENCE 1.
+#define STATIONARY_MAX_INTERVAL_S 1.
+
+// Shadow matcher (A/B test of an alternate configuration on the live scans,
+// see ShadowMatcher): nice value of its thread (19 is the lowest priority) and
+// number of threads of its optimizers
+#define SHADOW_NICE 10
+#define SHADOW_NUM_THREADS 1
+
+// Real-time scheduling of the matching threads (see realtime.h): default
+// priority of the "fifo" and "rr" policies (1 to 99, above the usual IRQ
+// threads at 50)
+#define RT_PRIORITY 40
+
 #define TRANSFORM_POINTS_AT_LOAD false
 #define TRANSFORM_POSE_AFTER_ALIGN (!TRANSFORM_POINTS_AT_LOAD)
 #define PREFER_FRONTAL_POINTS false // Disabled
+#define NDT_COVARIANCE_SCALE 1. // Scale of the pose covariance (see align)
+
+// Match quality thresholds, a match is considered bad when any of the
+// following is below its threshold
+#define NDT_QUALITY_MIN_SCORE .15 // Normalized score (-cost / nb. of points)
+#define NDT_QUALITY_MIN_INLIERS .4 // Ratio of points matched to a cell
+#define NDT_QUALITY_MIN_DEGENERACY .05 // Hessian eigenvalues ratio (x, y)
+#define NDT_INLIER_MAHALANOBIS2 5.991 // Chi-square, 2 DoF, 95%
+
+// Robust NDT cost parameters (see the loss functors in core.h)
+#define NDT_HUBER_K 1.
+#define NDT_CAUCHY_C 1.
+#define NDT_GATE_MAHALANOBIS2 13.816 // Chi-square, 2 DoF, 99.9%
+#define NDT_NO_CELL_PENALTY .1 // Cost of a point without a built cell (gated)
+
+// Culling of the low-information cells from the matching, the cells (or the
+// quadtree leaves) with few points or too flat (eigenvalues ratio) are
+// ignored, and the others may be weighted by their number of points (full
+// weight from NDT_CULL_FULL_POINTS)
+#define NDT_CULL_MIN_POINTS 0
+#define NDT_CULL_MIN_CONDITION 0.
+#define NDT_CULL_FULL_POINTS 0 // 0 to disable the weighting
+
+// Dynamic objects filtering, points falling in cells which were mostly seen
+// as free space (crossed by laser beams) are not integrated into the map
+#define NDT_DYNAMIC_FILTER false
+#define NDT_DYNAMIC_MIN_MISSES 5 // Min. times the cell has been seen free
+#define NDT_DYNAMIC_FREE_RATIO 2. // Min. ratio of free over occupied
+// Observations counted per cell (free + occupied), both counts are halved
+// when reached so they follow the recent ones (above NDT_DYNAMIC_MIN_MISSES)
+#define NDT_DYNAMIC_WINDOW 32
 #define BUILD_OCCUPANCY_GRID false
 
 #define USE_LOGGER false
@@ -25,6 +127,20 @@
 #define PSO_C1 2.
 #define PSO_C2 2.
 
+// CMA-ES parameters
+#define CMAES_ITERATIONS 50
+#define CMAES_POPULATION_SIZE 12
+#define CMAES_SIGMA 1. // Initial step size, relative to the search deviation
+
+// Differential Evolution parameters (DE/rand/1/bin)
+#define DE_ITERATIONS 50
+#define DE_POPULATION_SIZE 30
+#define DE_F .5
+#define DE_CR .9
+
+enum class Optimizer { PSO, CMAES, DE };
+enum class NDTLoss { Gaussian, Huber, Cauchy };
+
 struct PSOConfig {
   int iterations{PSO_ITERATIONS};
   int populationSize{PSO_POPULATION_SIZE};
@@ -37,11 +153,134 @@ struct PSOConfig {
   } coeff;
 };
 
+struct CMAESConfig {
+  int iterations{CMAES_ITERATIONS};
+  int populationSize{CMAES_POPULATION_SIZE};
+  int num_threads{-1};
+  double sigma{CMAES_SIGMA};
+};
+
+struct DEConfig {
+  int iterations{DE_ITERATIONS};
+  int populationSize{DE_POPULATION_SIZE};
+  int num_threads{-1};
+  struct {
+    double f{DE_F};
+    double cr{DE_CR};
+  } coeff;
+};
+
+struct MatchQualityConfig {
+  double min_score{NDT_QUALITY_MIN_SCORE};
+  double min_inlier_ratio{NDT_QUALITY_MIN_INLIERS};
+  double min_degeneracy{NDT_QUALITY_MIN_DEGENERACY};
+};
+
+struct CullingConfig {
+  double min_points{NDT_CULL_MIN_POINTS};
+  double min_condition{NDT_CULL_MIN_CONDITION};
+  double full_points{NDT_CULL_FULL_POINTS};
+};
+
+struct DynamicFilterConfig {
+  bool enabled{NDT_DYNAMIC_FILTER};
+  unsigned int min_misses{NDT_DYNAMIC_MIN_MISSES};
+  double free_ratio{NDT_DYNAMIC_FREE_RATIO};
+  unsigned int window{NDT_DYNAMIC_WINDOW};
+};
+
+struct DecayConfig {
+  double half_life{NDT_DECAY_HALF_LIFE}; // No forgetting if <= 0
+};
+
+struct EvictionConfig {
+  double max_age{NDT_EVICTION_MAX_AGE};
+  double max_distance{NDT_EVICTION_MAX_DISTANCE};
+  unsigned int period{NDT_EVICTION_PERIOD};
+  // Persistent map, when set, the evicted cells are spilled to this file and
+  // the ones evicted by distance are loaded back when the robot comes back
+  // (also in the next runs, the file is kept)
+  std::string spill_file;
+};
+
+struct QuadTreeConfig {
+  bool enabled{NDT_QUADTREE};
+  double min_cell_side{NDT_QUADTREE_MIN_CELL_SIDE};
+  unsigned int max_points{NDT_QUADTREE_MAX_POINTS};
+  double max_thickness{NDT_QUADTREE_MAX_THICKNESS};
+};
+
 struct NDTPSOConfig {
+  Optimizer optimizer{Optimizer::PSO};
+  NDTLoss loss{NDTLoss::Gaussian};
+  bool outlierGating{false};
   PSOConfig psoConfig;
+  CMAESConfig cmaesConfig;
+  DEConfig deConfig;
   // unsigned int ndtWindowSize{ NDT_WINDOW_SIZE };
   // unsigned int maxPointsPerCell{ NDT_MAX_POINTS_PER_CELL };
   float laserIgnoreEpsilon{LASER_IGNORE_EPSILON};
+  double covarianceScale{NDT_COVARIANCE_SCALE};
+  MatchQualityConfig qualityConfig;
+  DynamicFilterConfig dynamicFilter;
+  DecayConfig decay; // Used only with NDT_DECAY_FORGETTING
+  EvictionConfig eviction;
+  QuadTreeConfig quadTree;
+  CullingConfig culling;
+  // Unit of the map time (decay and eviction ages), seconds given with
+  // NDTFrame::setTime, or else the number of map updates (scans)
+  bool timeInSeconds{false};
+};
+
+// Skip of the scans taken while the robot is stationary (see Matcher::match)
+struct StationaryConfig {
+  bool enabled{false};
+  double max_difference{STATIONARY_MAX_DIFFERENCE};
+  double max_beam_difference{STATIONARY_MAX_BEAM_DIFFERENCE};
+  double max_interval{STATIONARY_MAX_INTERVAL_S};
+};
+
+// Scan matching pipeline (see Matcher)
+struct MatcherConfig {
+  unsigned short frame_size{MATCHER_FRAME_SIZE}; // Reference frame, meters
+  double cell_side{MATCHER_CELL_SIDE};
+#if BUILD_OCCUPANCY_GRID
+  double occupancy_grid_cell_side{0.};
+#endif
+  // Weight of the bad matches against the motion prediction
+  double quality_blend{MATCHER_QUALITY_BLEND};
+  bool deskew{false}; // Motion distortion compensation of the scans
+  StationaryConfig stationary;
+  // Tiled world map stored in this directory, if set (see TiledMap)
+  std::string tile_store;
+  double tile_size{TILED_MAP_TILE_SIZE};
+  size_t tile_cache_size{TILED_MAP_CACHE_SIZE};
+  // Map shared with other processes, if set (see SharedMap): published by
+  // this matcher, or only read if 'shared_map_reader'
+  std::string shared_map;
+  bool shared_map_reader{false};
+  NDTPSOConfig ndt;
+};
+
+// Shadow matching (see ShadowMatcher)
+struct ShadowConfig {
+  // The alternate configuration, the map (and so its geometry) is the
+  // production one
+  MatcherConfig matcher;
+  int nice{SHADOW_NICE};
+  std::string log_file; // CSV log of the comparisons, if set
+};
+
+// Scheduling of the ingestion thread (the one calling Matcher::match) and of
+// the OpenMP workers of its matches (see apply_realtime)
+struct RealTimeConfig {
+  std::string policy{"other"}; // "other", "fifo" or "rr"
+  int priority{RT_PRIORITY};
+  // CPU lists (e.g. "2,4-5"), unchanged if empty: the ingestion thread may
+  // run on any of its CPUs, each worker is pinned to one CPU of its list
+  // (round robin)
+  std::string ingestion_cpus, worker_cpus;
+  bool lock_memory{false}; // mlockall of the current and future pages
 };
 
 #endif // CONFIG_H
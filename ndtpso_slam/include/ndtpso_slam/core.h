@@ -9,19 +9,100 @@
 using Eigen::Array2d;
 using Eigen::Array3d;
 using Eigen::Matrix2d;
+using Eigen::Matrix3d;
 using Eigen::Vector2d;
 using Eigen::Vector3d;
 using std::vector;
 
+// Loss functors, giving the cost of a point from its squared Mahalanobis
+// distance to the mean of its cell. They are template parameters of the cost
+// function and the optimizers, so the choice costs nothing per point.
+// The robust losses replace the squared distance 'd2' in the Gaussian by a
+// function growing slower, every point adds at most -1 to the cost.
+struct GaussianLoss {
+  static constexpr bool penalize_no_cell = false;
+  inline double operator()(double d2) const { return -exp(-d2 / 2.); }
+  inline double noCell() const { return 0.; }
+};
+
+struct HuberLoss {
+  static constexpr bool penalize_no_cell = false;
+  inline double operator()(double d2) const {
+    // Quadratic up to NDT_HUBER_K, linear beyond
+    return d2 <= NDT_HUBER_K * NDT_HUBER_K
+               ? -exp(-d2 / 2.)
+               : -exp(-NDT_HUBER_K * sqrt(d2) + NDT_HUBER_K * NDT_HUBER_K / 2.);
+  }
+  inline double noCell() const { return 0.; }
+};
+
+struct CauchyLoss {
+  static constexpr bool penalize_no_cell = false;
+  inline double operator()(double d2) const {
+    return -pow(1. + d2 / (NDT_CAUCHY_C * NDT_CAUCHY_C),
+                -NDT_CAUCHY_C * NDT_CAUCHY_C / 2.);
+  }
+  inline double noCell() const { return 0.; }
+};
+
+// Outlier gating: points beyond NDT_GATE_MAHALANOBIS2 are ignored, and points
+// falling out of the map or in a cell which isn't built are penalized
+template <typename Loss> struct GatedLoss {
+  static constexpr bool penalize_no_cell = true;
+  inline double operator()(double d2) const {
+    return d2 > NDT_GATE_MAHALANOBIS2 ? 0. : Loss()(d2);
+  }
+  inline double noCell() const { return NDT_NO_CELL_PENALTY; }
+};
+
+// Optional report filled by the optimizers (best cost and number of cost
+// function evaluations), used to compare the optimizers
+struct OptimizationInfo {
+  double cost{0.};
+  unsigned int evaluations{0};
+  Matrix3d spread{Matrix3d::Zero()}; // Covariance of the final population
+  // If set, the positions evaluated by the optimizer are appended, one
+  // vector per iteration (the initial population first), e.g. to plot the
+  // swarm on the cost landscape
+  vector<vector<Vector3d>> *trace{nullptr};
+};
+
+// Cost, gradient and Hessian of the NDT score w.r.t. (x, y and theta)
+struct ScoreDerivatives {
+  double cost{0.};
+  Vector3d gradient{Vector3d::Zero()};
+  Matrix3d hessian{Matrix3d::Zero()};
+  unsigned int points{0}, inliers{0}; // Inliers w.r.t. NDT_INLIER_MAHALANOBIS2
+};
+
+template <typename Loss = GaussianLoss>
 Vector3d pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
                           const NDTFrame *const new_frame,
                           const Array3d &deviation = {0, 0, 0},
-                          const PSOConfig &pso_conf = PSOConfig());
+                          const PSOConfig &pso_conf = PSOConfig(),
+                          OptimizationInfo *info = nullptr);
+
+template <typename Loss = GaussianLoss>
+Vector3d cmaes_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
+                            const NDTFrame *const new_frame,
+                            const Array3d &deviation = {0, 0, 0},
+                            const CMAESConfig &cmaes_conf = CMAESConfig(),
+                            OptimizationInfo *info = nullptr);
+
+template <typename Loss = GaussianLoss>
+Vector3d de_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
+                         const NDTFrame *const new_frame,
+                         const Array3d &deviation = {0, 0, 0},
+                         const DEConfig &de_conf = DEConfig(),
+                         OptimizationInfo *info = nullptr);
 
 Vector3d glir_pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
                                NDTFrame *new_frame, unsigned int iters_num = 50,
                                const Array3d &deviation = {0, 0, 0});
 
+// Number of threads to use, (num_threads <= 0) means all the available threads
+int threads_count(int num_threads);
+
 // Spatial mapping T between two robot coordinate frames
 // given point (the old frame origin), and trans (x, y and theta), return the
 // new frame origin
@@ -46,7 +127,14 @@ inline Vector2d laser_to_point(float r, float theta) {
   return {double(r) * cos(double(theta)), double(r) * sin(double(theta))};
 }
 
+template <typename Loss = GaussianLoss>
 double cost_function(Vector3d trans, NDTFrame *const ref_frame,
                      const NDTFrame *const new_frame);
 
+// Same as cost_function (Gaussian loss), with the analytic derivatives (one
+// pass over points)
+ScoreDerivatives score_derivatives(const Vector3d &trans,
+                                   NDTFrame *const ref_frame,
+                                   const NDTFrame *const new_frame);
+
 #endif // NDTPSO_BASE_H
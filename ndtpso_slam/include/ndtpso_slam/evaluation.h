@@ -0,0 +1,56 @@
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include "ndtpso_slam/config.h"
+#include "ndtpso_slam/scanlog.h"
+#include <cmath>
+#include <string>
+
+// Offline evaluation of the matching pipeline (see Matcher) on recorded
+// sessions, used by the batch and autotuning tools
+
+// A recorded session, and the configuration to replay it with
+struct Session {
+  std::string name, scans, reference;
+  std::string error; // Set if the session's line is invalid
+  MatcherConfig config;
+};
+
+// Set the parameter 'name' (named as the node's parameter) of 'config',
+// returns false if the name or the value is unknown
+bool set_matcher_parameter(MatcherConfig &config, const std::string &name,
+                           const std::string &value);
+
+// Load a sessions file, one session per line:
+// name scans.csv [reference.csv] [parameter=value ...]
+// Returns false if the file cannot be opened or contains no session
+bool load_sessions(const char *filename, vector<Session> &sessions);
+
+struct SessionResult {
+  unsigned int scans{0}, bad{0};
+  // Scans having a reference pose, and their squared errors (the reference is
+  // expressed in the frame of its pose at the first scan)
+  unsigned int evaluated{0};
+  double trans_sq{0.}, rot_sq{0.}, final_trans{0.}, final_rot{0.};
+  double cpu{0.}; // Seconds, of the calling thread (see 'replay_session')
+  vector<double> latencies; // Milliseconds, of each scan
+
+  // Accumulate the scans and errors of 'other', the final errors are the
+  // worst ones
+  void merge(const SessionResult &other);
+  inline double transRMSE() const {
+    return this->evaluated ? sqrt(this->trans_sq / this->evaluated) : 0.;
+  }
+  inline double rotRMSE() const {
+    return this->evaluated ? sqrt(this->rot_sq / this->evaluated) : 0.;
+  }
+};
+
+// Match the scans with a new matcher, against the 'reference' trajectory
+// (sorted by time) if not empty. The CPU time only accounts for the calling
+// thread, it is the matching cost if the optimizers use a single thread
+void replay_session(const vector<ScanRecord> &scans,
+                    const vector<PoseRecord> &reference,
+                    const MatcherConfig &config, SessionResult &result);
+
+#endif // EVALUATION_H
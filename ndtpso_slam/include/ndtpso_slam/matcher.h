@@ -0,0 +1,128 @@
+#ifndef MATCHER_H
+#define MATCHER_H
+
+#include "ndtpso_slam/config.h"
+#include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/sharedmap.h"
+#include "ndtpso_slam/tiledmap.h"
+#include <eigen3/Eigen/Core>
+#include <mutex>
+
+using namespace Eigen;
+
+// A laser scan, its ranges are read in place ('stride' floats apart)
+struct ScanView {
+  double timestamp{0.};
+  const float *ranges{nullptr};
+  size_t count{0}, stride{1};
+  float angle_min{0.f}, angle_increment{0.f}, range_max{0.f},
+      time_increment{0.f};
+};
+
+struct MatchResult {
+  Vector3d pose{Vector3d::Zero()};
+  Matrix3d covariance{Matrix3d::Zero()};
+  MatchQuality quality;
+  bool first{false}; // First scan, not matched (the initial pose)
+  // Same as the last matched scan (see StationaryConfig): not matched, the
+  // last pose, covariance and quality are repeated
+  bool stationary{false};
+};
+
+// A copy of the map a scan is matched on (its matching view, see
+// NDTFrame::matchCell) and of the tracking state, to match the same scan
+// elsewhere while the map is updated (see ShadowMatcher)
+struct MapSnapshot {
+  uint16_t width{0}, height{0};
+  double cell_side{0.};
+  Vector2d origin{Vector2d::Zero()}; // Center of the map in the world frame
+  vector<int32_t> match_index;
+  vector<MatchCell> match_cells;
+  // The pose the match starts from, and the sensor velocity to deskew the
+  // scan (in its own frame)
+  Vector3d pose{Vector3d::Zero()}, velocity{Vector3d::Zero()};
+  // The search of the match (see NDTFrame::setSearch)
+  int align_count{0};
+  Vector3d last_motion{Vector3d::Zero()};
+};
+
+// Scan to map matching of a sequence of scans (a robot's laser): the scan
+// frame, the map (own, tiled or shared) and the tracking state (last pose and
+// motion) belong to the matcher, so independent matchers can run in the same
+// process (each one uses its 'num_threads' for the optimization). The calls
+// to a matcher are serialized by its own lock.
+class Matcher {
+public:
+  Matcher(MatcherConfig config = MatcherConfig());
+  ~Matcher(); // Writes back the tiled map, if any
+
+  // False if the configured shared map can't be created/attached
+  bool isReady() const;
+
+  // Load the scan to match (its ranges can be released on return), the
+  // previous motion is used to remove its distortion if enabled. Only its
+  // ranges are kept if it is stationary (see StationaryConfig)
+  void loadScan(const ScanView &scan);
+  // Discard the loaded scan (e.g. if its ranges were overwritten meanwhile)
+  void dropScan();
+  // Match the loaded scan on the map, predict the pose from the motion (or
+  // the odometry 'odom', if given) when the match is bad, and update the map
+  // with the good ones. A stationary scan is neither matched nor inserted
+  // (the odometry is ignored). Returns false if there is no map to match on
+  // yet (a shared map not published), the scan is dropped
+  bool match(MatchResult &result, const Vector3d *odom = nullptr);
+  // Same as loadScan and match
+  bool process(const ScanView &scan, MatchResult &result,
+               const Vector3d *odom = nullptr);
+  // Copy the map the loaded scan will be matched on by 'match' (the tiled
+  // view is moved and the map built beforehand, as 'match' would do). Returns
+  // false if no scan is loaded, if it is the first one (not matched) or if
+  // there is no map to match on
+  bool snapshot(MapSnapshot &snapshot);
+
+  // Initial pose, before the first scan
+  void setPose(const Vector3d &pose);
+  // Pose of the laser in the robot frame, the scans are matched in the robot
+  // frame (see NDTFrame::setTrans)
+  void setSensorTransform(const Vector3d &trans);
+  inline const Vector3d &pose() const { return this->s_pose; }
+  // The reference frame (the view of a tiled map, the shared map's frame for
+  // a reader), centered on the map origin
+  inline const NDTFrame *map() const { return this->s_map; }
+  // The last matched scan, in the robot frame (e.g. to build another map)
+  inline NDTFrame *scan() { return this->s_scan; }
+
+private:
+  MatcherConfig s_config;
+  std::mutex s_mutex;
+  NDTFrame *s_scan{nullptr}, *s_map{nullptr};
+  TiledMap *s_tiled_map{nullptr};
+  SharedMap *s_shared_map{nullptr};
+  bool s_first{true}, s_loaded{false};
+  double s_stamp{0.}, s_previous_stamp{0.};
+  Vector3d s_pose{Vector3d::Zero()}, s_motion{Vector3d::Zero()},
+      s_odom{Vector3d::Zero()};
+  MatchResult s_last;
+  // Origin of the map when its frame last aligned a scan (see
+  // NDTFrame::shiftOrigin)
+  Vector2d s_map_origin{Vector2d::Zero()};
+
+  // Ranges (clamped to [0, range_max]) and beams of the loaded scan and of
+  // the last matched one (and its time), for the stationary scans
+  vector<float> s_ranges, s_reference;
+  float s_angle_min{0.f}, s_angle_increment{0.f},
+      s_reference_angle_min{0.f}, s_reference_angle_increment{0.f};
+  double s_reference_stamp{0.};
+  bool s_stationary{false}; // The loaded scan is a stationary one
+
+  // Sensor velocity (in its own frame) from the last motion, for a scan
+  // taken at 'timestamp'
+  Vector3d s_velocity(double timestamp) const;
+  // The map origin moved (recentered tiled view, another shared snapshot),
+  // moves the search state of its frame
+  void s_moveOrigin(const Vector2d &origin);
+  // Whether 'scan' (its ranges in 's_ranges') is stationary
+  bool s_isStationary(const ScanView &scan) const;
+};
+
+#endif // MATCHER_H
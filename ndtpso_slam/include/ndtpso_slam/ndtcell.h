@@ -2,6 +2,8 @@
 #define NDTCELL_H
 
 #include "config.h"
+#include <cmath>
+#include <cstdio>
 #include <eigen3/Eigen/Core>
 #include <vector>
 
@@ -22,22 +24,62 @@ using std::vector;
 
 class NDTCell {
 private:
+#if NDT_DECAY_FORGETTING
+  // Decayed sums of the points (relative to the cell's first point, for
+  // numerical accuracy) and of their outer products, and the decayed weight
+  Vector2d s_origin, s_current_partial_sum, s_decayed_sum;
+  Matrix2d s_current_partial_sq_sum, s_decayed_sq_sum, s_inv_covar;
+  int s_current_count{0};
+  double s_decayed_weight{0.}, s_last_time{0.};
+  size_t s_current_window_id{0}; // Always 0, only one points buffer
+#else
   Vector2d s_partial_sums[NDT_WINDOW_SIZE], s_current_partial_sum, s_global_sum;
   Matrix2d s_partial_covars[NDT_WINDOW_SIZE], s_global_covar_sum, s_inv_covar;
   int s_partial_counts[NDT_WINDOW_SIZE], s_current_count{0}, s_global_count{0};
   size_t s_current_window_id{0};
-  inline void s_calc_covar_inverse();
+#endif
+  double s_condition{0.}; // Ratio of the covariance eigenvalues (small/large)
+  inline void s_calc_covar_inverse(const Matrix2d &covar);
 
 public:
-  std::vector<Vector2d> points[NDT_WINDOW_SIZE];
+  std::vector<Vector2d> points[NDT_POINTS_BUFFERS];
   Vector2d mean;
   NDTCell(bool calculate_params = true);
   void addPoint(const Vector2d &point);
   bool built{false};
   bool created{false};
+#if NDT_DECAY_FORGETTING
+  // The old statistics are decayed with the time elapsed since the last build
+  // (in the half-life unit), untouched cells don't need to be rebuilt
+  bool build(double time, double half_life);
+#else
   bool build();
+#endif
   double normalDistribution(const Vector2d &point);
+  inline const Matrix2d &inverseCovariance() const { return this->s_inv_covar; }
+  // Before the regularization of the flat distributions
+  inline double condition() const { return this->s_condition; }
+#if NDT_DECAY_FORGETTING
+  // Number of points of the distribution, decayed to 'time': lazily, so the
+  // cells not observed anymore fade without being rebuilt
+  inline double numOfPoints(double time, double half_life) const {
+    return (half_life > 0.) ? this->s_decayed_weight *
+                                  exp2(-(time - this->s_last_time) / half_life)
+                            : this->s_decayed_weight;
+  }
+#else
+  // Number of points of the distribution
+  inline double numOfPoints() const { return this->s_global_count; }
+#endif
   void reset();
+  // Reset the cell and free its points buffers
+  void release();
+  // Move the cell's points and distribution (used to change the map origin)
+  void translate(const Vector2d &offset);
+  // Raw (native binary) dump of the cell's state, used to spill the cells of
+  // a map to disk and to load them back
+  bool save(FILE *file) const;
+  bool load(FILE *file);
 };
 
 #endif // NDTCELL_H
@@ -2,13 +2,32 @@
 #define NDTFRAME_H
 
 #include "ndtpso_slam/ndtcell.h"
+#include "ndtpso_slam/ndtquadtree.h"
+#include <cstdio>
 #include <eigen3/Eigen/Core>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 using namespace Eigen;
 using std::vector;
 
+// Quality of a scan match, see MatchQualityConfig for the thresholds
+struct MatchQuality {
+  double score{0.};        // Normalized score, in [0, 1]
+  double inlier_ratio{0.}; // Ratio of points close to their cell's mean
+  double degeneracy{0.};   // Ratio of the translation Hessian eigenvalues
+  bool good{false};
+};
+
+// Distribution of a cell as used by the matching (see NDTFrame::matchCell)
+struct MatchCell {
+  Vector2d mean;
+  Matrix2d inv_covar;
+  double weight;
+};
+
 class NDTFrame {
 private:
   Vector3d s_trans{Vector3d::Zero()}, s_prev_pose{Vector3d::Zero()},
@@ -18,6 +37,38 @@ private:
   double s_x_min, s_x_max, s_y_min, s_y_max;
   NDTPSOConfig s_config;
   int s_iter{0};
+  double s_time{0.}; // Map clock (cells decay and age), see setTime
+
+  // Free space consistency, per cell counters of the laser beams crossing the
+  // cell (misses) or ending in it (hits), used by the dynamic objects filter
+  vector<uint16_t> s_hits, s_misses;
+  void s_trace_free_space(const Vector2d &origin, const Vector2d &end);
+
+  // Stale cells eviction, last update time of each cell, and the persistent
+  // map file: its live records (the last one of each spilled cell), the cells
+  // to load back (evicted by distance), and the end of the log
+  struct SpillRecord {
+    long offset, size;
+  };
+  // First bytes of the file, its records are only valid for the same cells
+  // layout (build) and map geometry
+  struct SpillFileHeader {
+    uint32_t magic, version, decay, buffers;
+    uint16_t width, height;
+    double cell_side;
+  };
+  vector<double> s_last_seen;
+  unsigned int s_updates{0};
+  FILE *s_spill_file{nullptr};
+  std::unordered_map<unsigned int, SpillRecord> s_spill_records;
+  std::unordered_set<unsigned int> s_spilled;
+  long s_spill_end{0}, s_spill_live_size{0};
+  Vector2d s_cell_center(unsigned int index) const;
+  SpillFileHeader s_spill_file_header() const;
+  bool s_open_spill_file();
+  bool s_spill_cell(unsigned int index, bool restorable);
+  bool s_restore_cell(unsigned int index);
+  bool s_compact_spill_file();
 
 #if BUILD_OCCUPANCY_GRID
   struct {
@@ -28,9 +79,33 @@ private:
   } s_occupancy_grid;
 #endif
 
+  NDTQuadTree s_quadtree; // Used only if enabled in the config
+
+  // Cells modified since the last build (new points, restored), only these
+  // are rebuilt
+  vector<uint32_t> s_dirty;
+  vector<uint8_t> s_dirty_flags;
+
+  // Index of each cell in 'matchCells' (-1 if not built or culled), and the
+  // cell of each of them. Only the dirty cells are patched, all of them are
+  // rebuilt after a reset of the cells, or when all the weights decay
+  vector<int32_t> s_match_index;
+  vector<uint32_t> s_match_cell_index;
+  bool s_rebuild_match_cells{true};
+  bool s_match_cell(unsigned int index, MatchCell &match) const;
+  void s_build_match_cells();
+  void s_update_match_cell(unsigned int index);
+  // The matching view in use: this frame's own, or an attached one (see the
+  // read-only constructor)
+  const int32_t *s_match_index_view{nullptr};
+  const MatchCell *s_match_cells_view{nullptr};
+  bool s_read_only{false};
+
 public:
   uint16_t width, height, widthNumOfCells, heightNumOfCells;
   vector<NDTCell> cells;
+  // The built cells not culled (see CullingConfig), compact for the matching
+  vector<MatchCell> matchCells;
   bool built;
   unsigned int numOfCells;
   double cell_side;
@@ -43,12 +118,56 @@ public:
            double occupancy_grid_cell_size = .0
 #endif
   );
+  // Read-only frame without cells, matching on the view of another map (e.g.
+  // a SharedMap snapshot) set by 'attach'
+  NDTFrame(unsigned short width, unsigned short height, double cell_side,
+           NDTPSOConfig config = NDTPSOConfig());
+  ~NDTFrame();
+  // Owns its spill file
+  NDTFrame(const NDTFrame &) = delete;
+  NDTFrame &operator=(const NDTFrame &) = delete;
+  // 'match_index' has an entry per cell, indexing 'match_cells' (or -1), as
+  // in 'matchIndex', both must outlive their use by this frame
+  void attach(const int32_t *match_index, const MatchCell *match_cells);
   void transform(Vector3d trans);
   void loadLaser(const vector<float> &laser_data, const float &min_angle,
-                 const float &angle_increment, const float &max_range);
+                 const float &angle_increment, const float &max_range,
+                 float time_increment = 0.f,
+                 const Vector3d &velocity = Vector3d::Zero());
+  // Same as above, reading the ranges from a non-owning buffer (e.g. a ROS
+  // message, a memory-mapped log or a shared memory segment), 'stride' is the
+  // distance between two ranges (in number of floats)
+  void loadLaser(const float *ranges, size_t count, size_t stride,
+                 float min_angle, float angle_increment, float max_range,
+                 float time_increment = 0.f,
+                 const Vector3d &velocity = Vector3d::Zero());
   void update(Vector3d trans, NDTFrame *new_frame);
+  bool isDynamic(int cell_index) const;
   void addPoint(Vector2d &point);
   inline void setTrans(Vector3d trans) { this->s_trans = std::move(trans); }
+  // Rebuild the cell 'index' by the next build (for cells modified directly)
+  inline void markDirty(unsigned int index) {
+    if (!this->s_dirty_flags[index]) {
+      this->s_dirty_flags[index] = 1;
+      this->s_dirty.push_back(index);
+    }
+  }
+  // Timestamp of the next update, when the map time is in seconds (else,
+  // each update advances the map clock by one)
+  inline void setTime(double time) { this->s_time = time; }
+  // Number of points of the cell 'index' weighting and culling it (see
+  // CullingConfig), decayed to the map time with NDT_DECAY_FORGETTING
+  inline double numOfPoints(unsigned int index) const {
+#if NDT_DECAY_FORGETTING
+    return this->cells[index].numOfPoints(this->s_time,
+                                          this->s_config.decay.half_life);
+#else
+    return this->cells[index].numOfPoints();
+#endif
+  }
+  // Release the stale cells (see EvictionConfig), done by 'update' each
+  // 'period' updates, returns the number of evicted cells
+  unsigned int evictStale(const Vector2d &position);
 #if defined(DEBUG) && DEBUG
   void print();
 #endif
@@ -56,8 +175,43 @@ public:
     void transform(Vector3d trans);
 #endif
   void build();
+  // The matching distribution of the cell 'cell_index' (the frame must be
+  // built), nullptr if the cell is outside, not built or culled
+  inline const MatchCell *matchCell(int cell_index) const {
+    if (-1 == cell_index)
+      return nullptr;
+
+    int32_t index = this->s_match_index_view[static_cast<size_t>(cell_index)];
+
+    return (-1 == index)
+               ? nullptr
+               : &this->s_match_cells_view[static_cast<size_t>(index)];
+  }
+  // Index of each cell in the matching view (the frame must be built)
+  inline const int32_t *matchIndex() const { return this->s_match_index_view; }
+  // The adaptive resolution view of the cells, nullptr if disabled
+  inline const NDTQuadTree *quadTree() const {
+    return this->s_config.quadTree.enabled ? &this->s_quadtree : nullptr;
+  }
   int getCellIndex(Vector2d point, int grid_width, double cell_side);
-  Vector3d align(Vector3d initial_guess, const NDTFrame *const new_frame);
+  // The search of the next 'align' depends on the previous ones: their number
+  // and the last motion (the initial particles are spread over twice its
+  // size), set to search as another frame would (e.g. a copy of this map)
+  inline int alignCount() const { return this->s_iter; }
+  inline const Vector3d &lastMotion() const { return this->s_pose_diff; }
+  inline void setSearch(int align_count, const Vector3d &last_motion) {
+    this->s_iter = align_count;
+    this->s_pose_diff = last_motion;
+  }
+  // The origin of the frame moved by 'delta' (e.g. a recentered tiled view),
+  // the last aligned pose is moved with it, so the next motion doesn't
+  // include the shift
+  inline void shiftOrigin(const Vector2d &delta) {
+    this->s_prev_pose.head<2>() -= delta;
+  }
+  Vector3d align(Vector3d initial_guess, const NDTFrame *const new_frame,
+                 Matrix3d *covariance = nullptr,
+                 MatchQuality *quality = nullptr);
   void dumpMap(const char *filename, bool save_poses = true,
                bool save_points = true, bool save_image = true,
                short density = 50
@@ -0,0 +1,90 @@
+#ifndef NDTQUADTREE_H
+#define NDTQUADTREE_H
+
+#include "ndtpso_slam/config.h"
+#include "ndtpso_slam/ndtcell.h"
+#include <cstdint>
+#include <eigen3/Eigen/Core>
+#include <vector>
+
+using namespace Eigen;
+using std::vector;
+
+// Adaptive resolution NDT over the cells of a frame: each cell of the grid is
+// the root of a quadtree, a node is split in four when a single Gaussian fits
+// its points poorly (thick distribution, e.g. a corner) or when it has too
+// many points, and its children are merged back when they don't fit better.
+// The nodes are stored in a single array (no pointers), the four children of
+// a node are contiguous, and the subtree of a root too.
+class NDTQuadTree {
+public:
+  struct Node {
+    Vector2d mean;
+    Matrix2d inv_covar;
+    double weight{1.};       // Culling weight, 0 if culled (see CullingConfig)
+    int32_t first_child{-1}; // Index of the 4 children, -1 for the leaves
+    bool built{false};
+  };
+
+  NDTQuadTree(QuadTreeConfig config = QuadTreeConfig(),
+              CullingConfig culling = CullingConfig());
+
+  // Rebuild the subtrees of the cells changed since the last call
+  void update(const vector<NDTCell> &cells, unsigned int grid_width,
+              double cell_side, double x_min, double y_min);
+
+  // The leaf containing 'point', in the subtree of the cell 'cell_index'
+  // (nullptr if there is no distribution there, or if it's culled)
+  inline const Node *find(int cell_index, const Vector2d &point) const {
+    if (-1 == cell_index)
+      return nullptr;
+
+    int32_t node = this->s_roots[static_cast<size_t>(cell_index)];
+
+    if (-1 == node)
+      return nullptr;
+
+    // Position in the cell, in [0, 1)
+    double x = (point.x() - this->s_x_min) / this->s_cell_side -
+               cell_index % int(this->s_grid_width),
+           y = (point.y() - this->s_y_min) / this->s_cell_side -
+               cell_index / int(this->s_grid_width);
+
+    while (-1 != this->s_nodes[static_cast<size_t>(node)].first_child) {
+      x *= 2.;
+      y *= 2.;
+      int child = (x >= 1.) + 2 * (y >= 1.);
+      x -= (x >= 1.);
+      y -= (y >= 1.);
+      node = this->s_nodes[static_cast<size_t>(node)].first_child + child;
+    }
+
+    auto &leaf = this->s_nodes[static_cast<size_t>(node)];
+
+    return (leaf.built && leaf.weight > 0.) ? &leaf : nullptr;
+  }
+
+  size_t numOfLeaves() const;
+  size_t memoryUsage() const; // In bytes
+
+private:
+  QuadTreeConfig s_config;
+  CullingConfig s_culling;
+  unsigned int s_grid_width{0};
+  double s_cell_side{1.}, s_x_min{0.}, s_y_min{0.};
+  vector<Node> s_nodes;
+  // Per cell of the grid: its root node (-1 if none), its subtree size, and
+  // what the subtree was built from (number of points and mean)
+  vector<int32_t> s_roots, s_sizes;
+  vector<size_t> s_counts;
+  vector<Vector2d> s_means;
+  size_t s_garbage{0}; // Nodes of the replaced subtrees
+
+  // Fit the node to its points (in the square of side 'size' starting at
+  // 'corner'), and split it if needed, returns the thickness of the fit
+  double s_build_node(size_t node, vector<Vector2d> &points,
+                      const Vector2d &corner, double size);
+  void s_compact();
+};
+
+#endif // NDTQUADTREE_H
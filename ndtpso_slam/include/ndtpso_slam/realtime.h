@@ -0,0 +1,34 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include "ndtpso_slam/config.h"
+#include <string>
+#include <vector>
+
+using std::vector;
+
+// Real-time scheduling of the matching threads, so the matcher doesn't
+// compete with the driver and the controller on the same cores. Each setting
+// that isn't permitted (no CAP_SYS_NICE/CAP_IPC_LOCK, RLIMIT_RTPRIO or
+// RLIMIT_MEMLOCK too low, offline CPU, ...) is skipped and reported, the
+// others still apply.
+
+// Parse a CPU list (e.g. "0,2-3"), returns false if it is malformed
+bool parse_cpu_list(const std::string &text, vector<int> &cpus);
+
+// Scheduling policy ("other", "fifo" or "rr") and priority (ignored by
+// "other") of the calling thread, false (errno set) if not permitted
+bool set_thread_scheduling(const std::string &policy, int priority);
+// Run the calling thread on 'cpus' only, false (errno set) if not permitted
+bool set_thread_affinity(const vector<int> &cpus);
+
+// Apply 'config' to the calling thread, which must be the ingestion thread
+// (the one calling Matcher::match, so the master of its OpenMP teams), and to
+// the 'n_threads' - 1 OpenMP workers of its teams (see threads_count). Must be
+// called before its first match, with no OpenMP team of more threads running.
+// The threads created later inherit the settings of the calling thread (e.g.
+// if the team size grows). Returns a message per setting not applied
+vector<std::string> apply_realtime(const RealTimeConfig &config,
+                                   int n_threads);
+
+#endif // REALTIME_H
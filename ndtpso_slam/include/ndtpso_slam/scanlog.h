@@ -0,0 +1,33 @@
+#ifndef SCANLOG_H
+#define SCANLOG_H
+
+#include <vector>
+
+using std::vector;
+
+// A laser scan recorded by `src/test/scan_export`, used by the offline tools
+// (benchmarks) to replay recorded data without ROS
+struct ScanRecord {
+  double timestamp{0.};
+  float angle_min{0.f}, angle_increment{0.f}, range_max{0.f},
+      time_increment{0.f};
+  vector<float> ranges;
+};
+
+// Load a scan log, a text file with one scan per line:
+// timestamp, angle_min, angle_increment, range_max, time_increment, r0, r1, ...
+// Returns false if the file cannot be opened or contains no scan
+bool load_scan_log(const char *filename, vector<ScanRecord> &records);
+
+// A pose of a reference trajectory (e.g. recorded by `src/test/odom_export`
+// with `_stamped:=true`)
+struct PoseRecord {
+  double timestamp{0.}, x{0.}, y{0.}, theta{0.};
+};
+
+// Load a trajectory, a text file with one pose per line:
+// timestamp, x, y, theta. Returns false if the file cannot be opened or
+// contains no pose
+bool load_pose_log(const char *filename, vector<PoseRecord> &records);
+
+#endif // SCANLOG_H
@@ -0,0 +1,96 @@
+#ifndef SCANRING_H
+#define SCANRING_H
+
+#include "ndtpso_slam/config.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+// Laser scans transport between processes of the same host, through a POSIX
+// shared memory segment: a single producer (the driver, or an adapter fed by
+// the ROS messages) copies each scan in a ring of slots, and any number of
+// consumers read the ranges in place (e.g. with the strided loadLaser), no
+// serialization and no copy. The consumers sleep on a futex until the next
+// scan. As for SharedMap, the producer never waits for the consumers: it
+// announces the scan it is writing before reusing a slot, and a consumer
+// checks after reading a scan that its slot wasn't reused meanwhile. A
+// restarted producer creates a new ring under the same name, the consumers
+// switch to it with 'reopen' (e.g. when no scan came for a while).
+class ScanRing {
+public:
+  struct Scan {
+    double timestamp;
+    float angle_min, angle_max, angle_increment, range_min, range_max,
+        time_increment;
+    uint32_t count; // Number of ranges
+  };
+
+  // Producer, creates (or replaces) the ring 'name' (e.g. "/ndtpso_scans") of
+  // 'slots' scans of up to 'max_ranges' ranges
+  ScanRing(const std::string &name, size_t max_ranges,
+           size_t slots = SCAN_RING_SLOTS);
+  // Consumer, attaches to the ring 'name'
+  explicit ScanRing(const std::string &name);
+  ~ScanRing();
+
+  // False if the ring can't be created/attached
+  inline bool isOpen() const { return nullptr != this->s_header; }
+  inline size_t maxRanges() const {
+    return this->s_header ? this->s_header->max_ranges : 0;
+  }
+
+  // Producer: copy the scan (its first 'max_ranges' ranges) in the next slot
+  // and wake up the consumers, returns its sequence number
+  uint64_t publish(const Scan &scan, const float *ranges);
+
+  // Consumer: wait up to 'timeout_ms' for a scan newer than the last one
+  // returned, returns its sequence number (0 on timeout) and points 'scan'
+  // and 'ranges' to the slot. A late consumer gets the latest scan (the older
+  // ones are skipped)
+  uint64_t wait(int timeout_ms, const Scan *&scan, const float *&ranges);
+  // Consumer: true while the slot of the scan 'sequence' is unchanged, to be
+  // checked after reading it
+  bool valid(uint64_t sequence) const;
+  // Consumer: switch to a new ring of the same name (restarted producer),
+  // false if the name is still the mapped ring or the new one can't be used
+  bool reopen();
+
+private:
+  struct Header {
+    uint32_t magic, version, slots, max_ranges;
+    uint64_t slot_size;
+    // Last published scan, and scan being written (>= head)
+    std::atomic<uint64_t> head, writing;
+    // Futex word (bumped by each scan), and number of sleeping consumers
+    std::atomic<uint32_t> notify, waiters;
+  };
+
+  std::string s_name;
+  bool s_producer;
+  Header *s_header{nullptr};
+  size_t s_size{0};
+  uint64_t s_last{0}; // Last scan returned by 'wait'
+  // The mapped segment (a consumer detects a new one, a producer only
+  // unlinks its own)
+  dev_t s_device{0};
+  ino_t s_inode{0};
+
+  // Consumer: map the ring 'name' if it isn't the mapped one
+  bool s_attach();
+  // The segment 'name' is the mapped one
+  bool s_isMapped() const;
+
+  // The slot of the scan 'sequence': the Scan followed by the ranges
+  inline char *s_slot(uint64_t sequence) const {
+    return reinterpret_cast<char *>(this->s_header) +
+           ScanRing::s_align(sizeof(Header)) +
+           (sequence % this->s_header->slots) * this->s_header->slot_size;
+  }
+  static inline size_t s_align(size_t size) {
+    return (size + 63) & ~size_t(63); // Cache lines
+  }
+};
+
+#endif // SCANRING_H
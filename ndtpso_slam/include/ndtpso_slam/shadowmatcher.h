@@ -0,0 +1,95 @@
+#ifndef SHADOWMATCHER_H
+#define SHADOWMATCHER_H
+
+#include "ndtpso_slam/config.h"
+#include "ndtpso_slam/matcher.h"
+#include "ndtpso_slam/ndtframe.h"
+#include <condition_variable>
+#include <cstdio>
+#include <eigen3/Eigen/Core>
+#include <mutex>
+#include <thread>
+
+using namespace Eigen;
+
+// Shadow (A/B) matching of an alternate configuration against a production
+// matcher: each scan is matched again, from the same pose and on a copy of
+// the same map, by a lower priority thread, and the differences with the
+// production match are reported. The production matcher and its results are
+// never changed. While the shadow is busy, the new scans are skipped (load
+// shedding), so it can't fall behind.
+class ShadowMatcher {
+public:
+  // A shadow match against the production one, the costs are the Gaussian
+  // NDT score of both poses on the same map and scan
+  struct Comparison {
+    double timestamp{0.};
+    Vector3d production_pose{Vector3d::Zero()}, shadow_pose{Vector3d::Zero()};
+    double translation{0.}, rotation{0.}; // Difference of the poses
+    double production_cost{0.}, shadow_cost{0.};
+    double production_ms{0.}, shadow_ms{0.};
+    bool production_good{false}, shadow_good{false};
+  };
+
+  // All the comparisons so far
+  struct Stats {
+    unsigned long matched{0}, skipped{0};
+    unsigned long production_bad{0}, shadow_bad{0};
+    double translation_sum{0.}, rotation_sum{0.}, max_translation{0.},
+        max_rotation{0.};
+    double cost_gain_sum{0.}; // Production cost minus the shadow's
+    double production_ms_sum{0.}, shadow_ms_sum{0.};
+  };
+
+  explicit ShadowMatcher(ShadowConfig config);
+  ~ShadowMatcher(); // Waits for the current shadow match
+
+  // False for the parameters (named as the node's ones) without effect on a
+  // shadow: it matches on the production map (its geometry, quadtree,
+  // culling and dynamic filter), with the production tracking (pose blending
+  // of the bad matches, stationary scans skipping)
+  static bool canChange(const std::string &parameter);
+
+  // Take the scan loaded by 'production' (ranges copied) and the map it will
+  // be matched on, before the production 'match'. Returns false if the scan
+  // is skipped: the shadow is still busy, or 'production' has nothing to
+  // match it on
+  bool capture(Matcher &production, const ScanView &scan);
+  // The production result of the captured scan (and its matching time),
+  // starts the shadow match
+  void submit(const MatchResult &production, double production_ms);
+  // The production matcher dropped the captured scan
+  void cancel();
+
+  // Pose of the laser in the robot frame, as the production one (before the
+  // first scan)
+  void setSensorTransform(const Vector3d &trans);
+  Stats stats();
+
+private:
+  enum class State { Idle, Captured, Pending };
+
+  ShadowConfig s_config;
+  NDTFrame *s_scan{nullptr}, *s_map{nullptr};
+  FILE *s_log{nullptr};
+
+  std::mutex s_mutex;
+  std::condition_variable s_wake;
+  std::thread s_thread;
+  State s_state{State::Idle};
+  bool s_stop{false};
+  Stats s_stats;
+
+  // The inputs of the next shadow match, owned by the caller while Idle or
+  // Captured, and by the shadow thread while Pending
+  ScanView s_view;
+  vector<float> s_ranges;
+  MapSnapshot s_snapshot;
+  MatchResult s_production;
+  double s_production_ms{0.};
+
+  void s_run();
+  void s_match(Comparison &comparison);
+};
+
+#endif // SHADOWMATCHER_H
@@ -0,0 +1,102 @@
+#ifndef SHAREDMAP_H
+#define SHAREDMAP_H
+
+#include "ndtpso_slam/ndtframe.h"
+#include <atomic>
+#include <cstdint>
+#include <eigen3/Eigen/Core>
+#include <string>
+#include <sys/types.h>
+
+// Map shared between processes through a POSIX shared memory segment: one
+// process (the owner) updates its map and publishes snapshots of its matching
+// view (the MatchCell's and their per cell index), the others attach
+// read-only and match directly on the shared memory, without copying it.
+// The snapshots are numbered by epoch, and written in a ring of
+// SHARED_MAP_SLOTS slots. The readers never lock (seqlock-like protocol):
+// the owner announces the epoch it is writing before reusing a slot, so a
+// reader checks after matching that its slot wasn't reused meanwhile, and
+// else matches again on a newer snapshot. The segment is only valid between
+// processes of the same build (native binary layout, checked on attach).
+// A restarted owner creates a new segment under the same name (the readers
+// keep the old one mapped), the readers switch to it once the snapshots of
+// the old one stop.
+class SharedMap {
+public:
+  // Owner, creates (or replaces) the segment 'name' (e.g. "/ndtpso_map") for
+  // maps of the geometry of 'map'
+  SharedMap(const std::string &name, const NDTFrame *map);
+  // Reader, attaches to the segment 'name', matching with 'config'
+  SharedMap(const std::string &name, NDTPSOConfig config);
+  ~SharedMap();
+
+  // False if the segment can't be created/attached
+  inline bool isOpen() const { return nullptr != this->s_header; }
+  inline bool isOwner() const { return this->s_owner; }
+
+  // Owner: publish the current state of 'map' (built if needed), 'origin' is
+  // the position of its center in the world frame (see TiledMap::origin).
+  // Returns the epoch of the new snapshot
+  uint64_t publish(NDTFrame *map, const Vector2d &origin = Vector2d::Zero());
+
+  // Reader: attach 'frame' to the latest snapshot, returns its epoch (0 if
+  // nothing is published yet). If the epoch didn't change since the last
+  // call, first switches to a new segment of the same name if any (restarted
+  // owner)
+  uint64_t acquire();
+  // Reader: true while the snapshot 'epoch' is unchanged, to be checked after
+  // using it (the results of a match on a reused slot are meaningless)
+  bool valid(uint64_t epoch) const;
+  // Reader: read-only frame matching on the acquired snapshot
+  inline NDTFrame *frame() { return this->s_frame; }
+  // Reader: center of the acquired snapshot in the world frame
+  inline const Vector2d &origin() const { return this->s_origin; }
+
+private:
+  struct Header {
+    uint32_t magic, version, match_cell_size, slots;
+    uint16_t width, height;
+    uint32_t num_cells;
+    double cell_side;
+    uint64_t slot_size, cells_offset;
+    // Last published epoch, and epoch being written (>= epoch)
+    std::atomic<uint64_t> epoch, writing;
+  };
+
+  struct Slot {
+    double origin_x, origin_y;
+    uint32_t num_match_cells;
+  };
+
+  std::string s_name;
+  bool s_owner;
+  Header *s_header{nullptr};
+  size_t s_size{0};
+  NDTFrame *s_frame{nullptr};
+  Vector2d s_origin{Vector2d::Zero()};
+  // The mapped segment (a reader detects a new one, an owner only unlinks
+  // its own), and the last acquired epoch of a reader
+  dev_t s_device{0};
+  ino_t s_inode{0};
+  uint64_t s_epoch{0};
+
+  // The segment 'name' is the mapped one
+  bool s_isMapped() const;
+
+  // Reader: map the segment 'name' if it isn't the mapped one, and its
+  // geometry matches 'frame' (if any). False if it's the same segment or
+  // can't be used
+  bool s_attach();
+
+  // The slot of 'epoch', followed by the per cell index then the MatchCell's
+  inline char *s_slot(uint64_t epoch) const {
+    return reinterpret_cast<char *>(this->s_header) +
+           SharedMap::s_align(sizeof(Header)) +
+           (epoch % this->s_header->slots) * this->s_header->slot_size;
+  }
+  static inline size_t s_align(size_t size) {
+    return (size + 63) & ~size_t(63); // Cache lines
+  }
+};
+
+#endif // SHAREDMAP_H
@@ -0,0 +1,121 @@
+#ifndef TILEDMAP_H
+#define TILEDMAP_H
+
+#include "ndtpso_slam/ndtframe.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <eigen3/Eigen/Core>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// World map made of square tiles of NDT cells stored on disk (one file per
+// tile in a directory), only the tiles around the robot are kept in memory.
+// The matcher works on a local NDTFrame (the "view"), centered on the map's
+// origin, which follows the robot by whole tiles; the cells leaving the view
+// go back to the tiles and the new ones are filled from the tiles once they
+// are loaded. All the file accesses are done by a background thread, the
+// matching thread only copies cells from/to the in-memory tiles.
+class TiledMap {
+public:
+  struct TileKey {
+    int32_t x, y;
+    bool operator==(const TileKey &other) const {
+      return (x == other.x) && (y == other.y);
+    }
+  };
+
+  TiledMap(std::string directory, double tile_size = TILED_MAP_TILE_SIZE,
+           size_t cache_size = TILED_MAP_CACHE_SIZE);
+  ~TiledMap();
+
+  // Moves the view to the tile of 'pose' (world frame) when the robot gets
+  // too far from its center, requests the tiles of the view, and the ones
+  // ahead along 'motion' (prefetch), then fills the view from the loaded
+  // tiles (see sync). Returns true when the origin changed
+  bool follow(NDTFrame *view, const Vector3d &pose, const Vector3d &motion);
+  // Fill the view's cells from the tiles loaded since the last call, never
+  // waits for the disk (the missing tiles are filled by the next calls)
+  void sync(NDTFrame *view);
+  // Write back the view and all the modified tiles, waits for the disk
+  void flush(const NDTFrame *view);
+  // Position of the view's center in the world frame
+  inline const Vector2d &origin() const { return this->s_origin; }
+
+private:
+  struct TileKeyHash {
+    size_t operator()(const TileKey &key) const {
+      return std::hash<int64_t>()((int64_t(key.x) << 32) ^ uint32_t(key.y));
+    }
+  };
+
+  // The created cells of a tile (index in the tile, cell in world frame)
+  typedef vector<std::pair<uint32_t, NDTCell>> Tile;
+  typedef std::shared_ptr<Tile> TilePtr;
+
+  struct CacheEntry {
+    TilePtr tile;
+    // Modified since loaded, and made only of the cells of the view (not
+    // merged yet with the tile on disk)
+    bool dirty, partial;
+    std::list<TileKey>::iterator lru;
+  };
+
+  // Loading a tile also completes its partial version in the cache (if any),
+  // writing a partial tile merges it with the one on disk first
+  enum class JobType { Load, Write };
+  struct Job {
+    JobType type;
+    TileKey key;
+    TilePtr tile; // Tile to write
+    bool partial;
+  };
+
+  std::string s_directory;
+  double s_tile_size;
+  int s_tile_cells{0}; // Tile side, in number of cells of the view
+  size_t s_cache_size;
+  Vector2d s_origin{Vector2d::Zero()};
+  bool s_initialized{false};
+  std::unordered_set<TileKey, TileKeyHash> s_imported; // Tiles in the view
+
+  // Shared with the I/O thread
+  std::mutex s_mutex;
+  std::condition_variable s_jobs_cond, s_idle_cond;
+  std::deque<Job> s_jobs;
+  bool s_busy{false}, s_stop{false};
+  std::unordered_map<TileKey, CacheEntry, TileKeyHash> s_cache;
+  std::unordered_set<TileKey, TileKeyHash> s_pending; // Queued loads
+  std::list<TileKey> s_lru; // Most recently used first
+  std::thread s_io_thread;
+
+  void s_io_loop();
+  std::string s_tile_path(const TileKey &key) const;
+  bool s_read_tile(const TileKey &key, Tile &tile) const;
+  bool s_write_tile(const TileKey &key, const Tile &tile) const;
+  static void s_merge_tiles(Tile &tile, Tile &&old_tile);
+
+  // Must be called with the mutex held
+  void s_request(const TileKey &key);
+  void s_insert(const TileKey &key, TilePtr tile, bool dirty, bool partial);
+  void s_touch(CacheEntry &entry);
+  // A write of the tile is queued, its file is stale until then
+  bool s_queuedWrite(const TileKey &key) const;
+
+  // Indices in the world grid of the first cell of the view centered on
+  // 'origin', the tiles covered by this view, and the tile of a world cell
+  Vector2i s_view_base(const NDTFrame *view, const Vector2d &origin) const;
+  vector<TileKey> s_view_tiles(const NDTFrame *view,
+                               const Vector2d &origin) const;
+  TileKey s_tile_of(const Vector2i &world_cell, uint32_t &index_in_tile) const;
+  void s_export(const NDTFrame *view);
+};
+
+#endif // TILEDMAP_H
@@ -0,0 +1,45 @@
+#include "ndtpso_slam/beamtable.h"
+#include "ndtpso_slam/core.h"
+
+#define BEAM_TABLE_CACHE_SIZE 4 // Number of sensors handled by each thread
+
+bool BeamTable::matches(unsigned int size, float min_angle,
+                        float angle_increment) const {
+  return (this->s_size == size) && (this->s_min_angle == min_angle) &&
+         (this->s_angle_increment == angle_increment);
+}
+
+void BeamTable::reset(unsigned int size, float min_angle,
+                      float angle_increment) {
+  this->s_size = size;
+  this->s_min_angle = min_angle;
+  this->s_angle_increment = angle_increment;
+  this->cosines.resize(size);
+  this->sines.resize(size);
+
+  // Same angles as index_to_angle/laser_to_point, so the points are the same
+  for (unsigned int i = 0; i < size; ++i) {
+    auto theta = double(index_to_angle(i, angle_increment, min_angle));
+    this->cosines[i] = cos(theta);
+    this->sines[i] = sin(theta);
+  }
+}
+
+const BeamTable &BeamTable::get(unsigned int size, float min_angle,
+                                float angle_increment) {
+  static thread_local BeamTable cache[BEAM_TABLE_CACHE_SIZE];
+  static thread_local unsigned int used = 0, next_slot = 0;
+
+  for (unsigned int i = 0; i < used; ++i) {
+    if (cache[i].matches(size, min_angle, angle_increment))
+      return cache[i];
+  }
+
+  // Not found, use a free entry or replace the oldest one
+  BeamTable &table = cache[next_slot];
+  next_slot = (next_slot + 1) % BEAM_TABLE_CACHE_SIZE;
+  used = used < BEAM_TABLE_CACHE_SIZE ? used + 1 : used;
+  table.reset(size, min_angle, angle_increment);
+
+  return table;
+}
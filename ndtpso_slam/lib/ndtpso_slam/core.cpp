@@ -1,8 +1,18 @@
 #include "ndtpso_slam/core.h"
 #include "ndtpso_slam/ndtframe.h"
+#include <algorithm>
 #include <cstdio>
+#include <eigen3/Eigen/Eigenvalues>
 #include <iostream>
+#include <numeric>
 #include <omp.h>
+#include <random>
+
+using Eigen::Matrix3d;
+using Eigen::SelfAdjointEigenSolver;
+
+typedef double (*CostFunction)(Vector3d, NDTFrame *const,
+                               const NDTFrame *const);
 
 struct Particle {
   Vector3d position, velocity, best_position;
@@ -11,7 +21,8 @@ struct Particle {
   double pbest_average;
 
   Particle(const Array3d &mean, const Array3d &deviation,
-           NDTFrame *const ref_frame, const NDTFrame *const new_frame)
+           NDTFrame *const ref_frame, const NDTFrame *const new_frame,
+           CostFunction cost_func = &cost_function<GaussianLoss>)
       : position(
             mean +
             (Array3d::Random() *
@@ -19,7 +30,7 @@ struct Particle {
                             according to the mean and the deviation */
         ,
         velocity(Vector3d(0., 0., 0.)) {
-    cost = cost_function(position, ref_frame, new_frame);
+    cost = cost_func(position, ref_frame, new_frame);
 
     best_position = position;
     best_cost = cost;
@@ -27,12 +38,52 @@ struct Particle {
   }
 };
 
+// The distribution of the reference frame matching 'point': the leaf of its
+// quadtree if it has one, or else its grid cell (false if none is built or
+// if the cell is culled)
+static inline bool find_distribution(NDTFrame *const ref_frame,
+                                     const NDTQuadTree *quadtree,
+                                     const Vector2d &point,
+                                     const Vector2d *&mean,
+                                     const Matrix2d *&inv_covar,
+                                     double &weight) {
+  int index_in_ref_frame = ref_frame->getCellIndex(
+      point, ref_frame->widthNumOfCells, ref_frame->cell_side);
+
+  if (quadtree) {
+    auto leaf = quadtree->find(index_in_ref_frame, point);
+
+    if (!leaf)
+      return false;
+
+    mean = &leaf->mean;
+    inv_covar = &leaf->inv_covar;
+    weight = leaf->weight;
+    return true;
+  }
+
+  auto cell = ref_frame->matchCell(index_in_ref_frame);
+
+  if (!cell)
+    return false;
+
+  mean = &cell->mean;
+  inv_covar = &cell->inv_covar;
+  weight = cell->weight;
+  return true;
+}
+
+template <typename Loss>
 double cost_function(Vector3d trans, NDTFrame *const ref_frame,
                      const NDTFrame *const new_frame) {
   if (!ref_frame->built)
     ref_frame->build();
 
-  double trans_cost = 0.;
+  const Loss loss;
+  const NDTQuadTree *quadtree = ref_frame->quadTree();
+  const Vector2d *mean;
+  const Matrix2d *inv_covar;
+  double weight, trans_cost = 0.;
 
   // For all cells in the new frame
   for (auto &new_frame_cell : new_frame->cells) {
@@ -40,16 +91,13 @@ double cost_function(Vector3d trans, NDTFrame *const ref_frame,
     // thiers probabilities
     for (auto &new_point : new_frame_cell.points[0]) {
       Vector2d point = transform_point(new_point, trans);
-      int index_in_ref_frame = ref_frame->getCellIndex(
-          point, ref_frame->widthNumOfCells, ref_frame->cell_side);
-
-      if ((-1 != index_in_ref_frame) &&
-          ref_frame->cells[static_cast<unsigned int>(index_in_ref_frame)]
-              .built) {
-        double point_probability =
-            ref_frame->cells[static_cast<unsigned int>(index_in_ref_frame)]
-                .normalDistribution(point);
-        trans_cost -= static_cast<double>(point_probability);
+
+      if (find_distribution(ref_frame, quadtree, point, mean, inv_covar,
+                            weight)) {
+        Vector2d diff = point - *mean;
+        trans_cost += weight * loss(diff.dot(*inv_covar * diff));
+      } else if (Loss::penalize_no_cell) {
+        trans_cost += loss.noCell();
       }
     }
   }
@@ -57,9 +105,85 @@ double cost_function(Vector3d trans, NDTFrame *const ref_frame,
   return trans_cost;
 }
 
+ScoreDerivatives score_derivatives(const Vector3d &trans,
+                                   NDTFrame *const ref_frame,
+                                   const NDTFrame *const new_frame) {
+  if (!ref_frame->built)
+    ref_frame->build();
+
+  ScoreDerivatives derivatives;
+  const NDTQuadTree *quadtree = ref_frame->quadTree();
+  const Vector2d *mean;
+  const Matrix2d *inv_covar_ptr;
+  double weight;
+  double sin_th = sin(trans.z()), cos_th = cos(trans.z());
+
+  for (auto &new_frame_cell : new_frame->cells) {
+    for (auto &new_point : new_frame_cell.points[0]) {
+      Vector2d point = transform_point(new_point, trans);
+
+      ++derivatives.points;
+
+      if (!find_distribution(ref_frame, quadtree, point, mean, inv_covar_ptr,
+                             weight))
+        continue;
+
+      const Matrix2d &inv_covar = *inv_covar_ptr;
+      Vector2d diff = point - *mean;
+      Vector2d a_diff = inv_covar * diff;
+      double mahalanobis2 = diff.dot(a_diff);
+      double score = weight * exp(-mahalanobis2 / 2.);
+
+      if (mahalanobis2 < NDT_INLIER_MAHALANOBIS2)
+        ++derivatives.inliers;
+
+      // Jacobian of the transformed point w.r.t. (x, y, theta), the only non
+      // null second derivative is w.r.t. theta
+      Eigen::Matrix<double, 2, 3> jacobian;
+      jacobian << 1., 0., -new_point.x() * sin_th - new_point.y() * cos_th, 0.,
+          1., new_point.x() * cos_th - new_point.y() * sin_th;
+      Vector2d d2_theta(-new_point.x() * cos_th + new_point.y() * sin_th,
+                        -new_point.x() * sin_th - new_point.y() * cos_th);
+
+      Vector3d q_a_j = jacobian.transpose() * a_diff;
+
+      derivatives.cost -= score;
+      derivatives.gradient += score * q_a_j;
+      derivatives.hessian += score * (jacobian.transpose() * inv_covar *
+                                          jacobian -
+                                      q_a_j * q_a_j.transpose());
+      derivatives.hessian(2, 2) += score * a_diff.dot(d2_theta);
+    }
+  }
+
+  return derivatives;
+}
+
+// Covariance of a set of poses
+static Matrix3d population_spread(const vector<Vector3d> &positions) {
+  Vector3d mean = Vector3d::Zero();
+  for (auto &position : positions)
+    mean += position;
+  mean /= positions.size();
+
+  Matrix3d spread = Matrix3d::Zero();
+  for (auto &position : positions)
+    spread += (position - mean) * (position - mean).transpose();
+
+  return spread / positions.size();
+}
+
+int threads_count(int num_threads) {
+  int n_threads = omp_get_max_threads();
+  return (num_threads > 0) && (num_threads < n_threads) ? num_threads
+                                                        : n_threads;
+}
+
+template <typename Loss>
 Vector3d pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
                           const NDTFrame *const new_frame,
-                          const Array3d &deviation, const PSOConfig &pso_conf) {
+                          const Array3d &deviation, const PSOConfig &pso_conf,
+                          OptimizationInfo *info) {
   double w = pso_conf.coeff.w;
   Array3d zero_devi = {
       1E-4, 1E-4,
@@ -68,12 +192,13 @@ Vector3d pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
   vector<Particle> particles;
 
   // Use the initial guess as an initial global best, using a zero deviation
-  Particle global_best(initial_guess.array(), zero_devi, ref_frame, new_frame);
+  Particle global_best(initial_guess.array(), zero_devi, ref_frame, new_frame,
+                       &cost_function<Loss>);
 
   for (unsigned i = 0; i < static_cast<unsigned>(pso_conf.populationSize);
        ++i) {
     particles.emplace_back(initial_guess.array(), deviation, ref_frame,
-                           new_frame);
+                           new_frame, &cost_function<Loss>);
 
     if (particles[i].cost < global_best.best_cost) {
       // TODO: see if the global best need to stay fixed (like in this case) or
@@ -87,10 +212,18 @@ Vector3d pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
   unsigned int iter_n = 0;
 #endif
 
-  int n_threads = omp_get_max_threads();
-  n_threads = (pso_conf.num_threads > 0) && (pso_conf.num_threads < n_threads)
-                  ? pso_conf.num_threads
-                  : n_threads;
+  // The positions of the particles (no cost to pay if not traced)
+  auto trace_swarm = [&]() {
+    if (info && info->trace) {
+      info->trace->emplace_back();
+      for (auto &particle : particles)
+        info->trace->back().push_back(particle.position);
+    }
+  };
+
+  trace_swarm();
+
+  int n_threads = threads_count(pso_conf.num_threads);
 
   for (unsigned i = 0; i < static_cast<unsigned>(pso_conf.iterations); ++i) {
     omp_set_num_threads(n_threads);
@@ -112,7 +245,7 @@ Vector3d pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
       }
 
       particles[j].cost =
-          cost_function(particles[j].position, ref_frame, new_frame);
+          cost_function<Loss>(particles[j].position, ref_frame, new_frame);
 
       if (particles[j].cost < particles[j].best_cost) {
         particles[j].best_cost = particles[j].cost;
@@ -129,6 +262,7 @@ Vector3d pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
     }
 
     w *= pso_conf.coeff.w_dumping;
+    trace_swarm();
   }
 
 #if defined(DEBUG) && DEBUG
@@ -136,9 +270,292 @@ Vector3d pso_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
          global_best.best_cost, global_best.best_position.x(),
          global_best.best_position.y(), global_best.best_position.z());
 #endif
+
+  if (info) {
+    vector<Vector3d> best_positions;
+    for (auto &particle : particles)
+      best_positions.push_back(particle.best_position);
+
+    info->cost = global_best.best_cost;
+    info->evaluations = static_cast<unsigned int>(
+        1 + pso_conf.populationSize * (1 + pso_conf.iterations));
+    info->spread = population_spread(best_positions);
+  }
+
   return global_best.best_position;
 }
 
+// CMA-ES, (mu/mu_w, lambda) variant as described in Hansen's tutorial
+// (arXiv:1604.00772). The initial covariance is the diagonal of the squared
+// deviation, so the search starts with the same extent as PSO's swarm
+template <typename Loss>
+Vector3d cmaes_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
+                            const NDTFrame *const new_frame,
+                            const Array3d &deviation,
+                            const CMAESConfig &cmaes_conf,
+                            OptimizationInfo *info) {
+  const double n = 3.;
+  const auto lambda =
+      static_cast<unsigned int>(std::max(4, cmaes_conf.populationSize));
+  const unsigned int mu = lambda / 2;
+
+  // Recombination weights
+  vector<double> weights(mu);
+  for (unsigned int i = 0; i < mu; ++i)
+    weights[i] = log(mu + .5) - log(i + 1.);
+  double weights_sum = std::accumulate(weights.begin(), weights.end(), 0.);
+  double weights_sq_sum = 0.;
+  for (auto &weight : weights) {
+    weight /= weights_sum;
+    weights_sq_sum += weight * weight;
+  }
+  const double mueff = 1. / weights_sq_sum;
+
+  // Adaptation constants
+  const double cc = (4. + mueff / n) / (n + 4. + 2. * mueff / n),
+               cs = (mueff + 2.) / (n + mueff + 5.),
+               c1 = 2. / ((n + 1.3) * (n + 1.3) + mueff),
+               cmu = std::min(1. - c1, 2. * (mueff - 2. + 1. / mueff) /
+                                           ((n + 2.) * (n + 2.) + mueff)),
+               damps =
+                   1. + 2. * std::max(0., sqrt((mueff - 1.) / (n + 1.)) - 1.) +
+                   cs,
+               chi_n = sqrt(n) * (1. - 1. / (4. * n) + 1. / (21. * n * n));
+
+  // A null deviation (e.g. when the robot was stopped) gives a singular
+  // covariance, so keep a minimal one
+  Array3d min_devi = {1E-4, 1E-4, 1E-5};
+  Vector3d scale = deviation.abs().max(min_devi).matrix();
+
+  Vector3d mean = std::move(initial_guess), pc = Vector3d::Zero(),
+           ps = Vector3d::Zero();
+  Matrix3d covar = scale.cwiseAbs2().asDiagonal(), basis = Matrix3d::Identity(),
+           inv_sqrt_covar;
+  Vector3d axes = scale;
+  double sigma = cmaes_conf.sigma;
+
+  Vector3d best_position = mean;
+  double best_cost = cost_function<Loss>(mean, ref_frame, new_frame);
+  unsigned int evaluations = 1;
+
+  std::mt19937 generator(static_cast<unsigned int>(rand()));
+  std::normal_distribution<double> normal(0., 1.);
+
+  vector<Vector3d> samples(lambda), steps(lambda);
+  vector<double> costs(lambda);
+  vector<unsigned int> order(lambda);
+
+  int n_threads = threads_count(cmaes_conf.num_threads);
+
+  for (unsigned int i = 0; i < static_cast<unsigned>(cmaes_conf.iterations);
+       ++i) {
+    // Sampling is kept sequential, only the evaluation is parallel
+    for (unsigned int j = 0; j < lambda; ++j) {
+      Vector3d z(normal(generator), normal(generator), normal(generator));
+      steps[j] = basis * axes.cwiseProduct(z);
+      samples[j] = mean + sigma * steps[j];
+    }
+
+    omp_set_num_threads(n_threads);
+
+#pragma omp parallel for schedule(auto)
+    for (unsigned int j = 0; j < lambda; ++j)
+      costs[j] = cost_function<Loss>(samples[j], ref_frame, new_frame);
+
+    evaluations += lambda;
+
+    if (info && info->trace)
+      info->trace->push_back(samples);
+
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [&costs](unsigned int a, unsigned int b) {
+                return costs[a] < costs[b];
+              });
+
+    if (costs[order[0]] < best_cost) {
+      best_cost = costs[order[0]];
+      best_position = samples[order[0]];
+    }
+
+    // Move the mean toward the best mu samples
+    Vector3d step_w = Vector3d::Zero();
+    for (unsigned int j = 0; j < mu; ++j)
+      step_w += weights[j] * steps[order[j]];
+    mean += sigma * step_w;
+
+    // Evolution paths
+    inv_sqrt_covar =
+        basis * axes.cwiseInverse().asDiagonal() * basis.transpose();
+    ps = (1. - cs) * ps +
+         sqrt(cs * (2. - cs) * mueff) * inv_sqrt_covar * step_w;
+    bool hsig = ps.norm() / sqrt(1. - pow(1. - cs, 2. * (i + 1))) / chi_n <
+                1.4 + 2. / (n + 1.);
+    pc = (1. - cc) * pc + (hsig ? sqrt(cc * (2. - cc) * mueff) : 0.) * step_w;
+
+    // Covariance matrix adaptation (rank-one and rank-mu updates)
+    Matrix3d rank_mu = Matrix3d::Zero();
+    for (unsigned int j = 0; j < mu; ++j)
+      rank_mu += weights[j] * steps[order[j]] * steps[order[j]].transpose();
+
+    covar = (1. - c1 - cmu) * covar +
+            c1 * (pc * pc.transpose() +
+                  (hsig ? 0. : cc * (2. - cc)) * covar) +
+            cmu * rank_mu;
+
+    sigma *= exp((cs / damps) * (ps.norm() / chi_n - 1.));
+
+    // Eigen decomposition, C = B * D^2 * B^T
+    SelfAdjointEigenSolver<Matrix3d> solver(covar);
+    basis = solver.eigenvectors();
+    axes = solver.eigenvalues().cwiseMax(1E-20).cwiseSqrt();
+  }
+
+#if defined(DEBUG) && DEBUG
+  printf("cmaes cost:%04.5f, %04.5f, %04.5f, %04.5f, sigma:%04.5f\n",
+         best_cost, best_position.x(), best_position.y(), best_position.z(),
+         sigma);
+#endif
+
+  if (info) {
+    info->cost = best_cost;
+    info->evaluations = evaluations;
+    info->spread = sigma * sigma * covar;
+  }
+
+  return best_position;
+}
+
+// Differential Evolution, DE/rand/1/bin. The initial population is spread
+// uniformly around the initial guess like the PSO particles
+template <typename Loss>
+Vector3d de_optimization(Vector3d initial_guess, NDTFrame *ref_frame,
+                         const NDTFrame *const new_frame,
+                         const Array3d &deviation, const DEConfig &de_conf,
+                         OptimizationInfo *info) {
+  const auto pop_size =
+      static_cast<unsigned int>(std::max(4, de_conf.populationSize));
+
+  vector<Vector3d> population(pop_size), trials(pop_size);
+  vector<double> costs(pop_size), trial_costs(pop_size);
+
+  // A null deviation on an axis (e.g. an exact motion prediction) would put
+  // the whole population on the same value, and the difference vectors could
+  // never leave it, so keep the minimal one of CMA-ES
+  Array3d min_devi = {1E-4, 1E-4, 1E-5};
+  Array3d spread = deviation.abs().max(min_devi);
+
+  // Keep the initial guess as a member of the population
+  population[0] = initial_guess;
+  for (unsigned int j = 1; j < pop_size; ++j)
+    population[j] = initial_guess.array() + Array3d::Random() * spread;
+
+  std::mt19937 generator(static_cast<unsigned int>(rand()));
+  std::uniform_int_distribution<unsigned int> pick(0, pop_size - 1),
+      pick_dim(0, 2);
+  std::uniform_real_distribution<double> uniform(0., 1.);
+
+  int n_threads = threads_count(de_conf.num_threads);
+
+  // The first evaluation builds the reference frame if needed, so do it
+  // before entering the parallel region
+  costs[0] = cost_function<Loss>(population[0], ref_frame, new_frame);
+
+  omp_set_num_threads(n_threads);
+
+#pragma omp parallel for schedule(auto)
+  for (unsigned int j = 1; j < pop_size; ++j)
+    costs[j] = cost_function<Loss>(population[j], ref_frame, new_frame);
+
+  unsigned int evaluations = pop_size;
+
+  if (info && info->trace)
+    info->trace->push_back(population);
+
+  for (unsigned int i = 0; i < static_cast<unsigned>(de_conf.iterations); ++i) {
+    // Mutation and crossover
+    for (unsigned int j = 0; j < pop_size; ++j) {
+      unsigned int a, b, c;
+      do {
+        a = pick(generator);
+      } while (a == j);
+      do {
+        b = pick(generator);
+      } while (b == j || b == a);
+      do {
+        c = pick(generator);
+      } while (c == j || c == a || c == b);
+
+      Vector3d mutant =
+          population[a] + de_conf.coeff.f * (population[b] - population[c]);
+      unsigned int forced_dim = pick_dim(generator);
+
+      for (unsigned int k = 0; k < 3; ++k)
+        trials[j][k] =
+            (k == forced_dim || uniform(generator) < de_conf.coeff.cr)
+                ? mutant[k]
+                : population[j][k];
+    }
+
+    omp_set_num_threads(n_threads);
+
+#pragma omp parallel for schedule(auto)
+    for (unsigned int j = 0; j < pop_size; ++j)
+      trial_costs[j] = cost_function<Loss>(trials[j], ref_frame, new_frame);
+
+    evaluations += pop_size;
+
+    if (info && info->trace)
+      info->trace->push_back(trials);
+
+    // Selection
+    for (unsigned int j = 0; j < pop_size; ++j) {
+      if (trial_costs[j] <= costs[j]) {
+        costs[j] = trial_costs[j];
+        population[j] = trials[j];
+      }
+    }
+  }
+
+  auto best = static_cast<unsigned int>(
+      std::min_element(costs.begin(), costs.end()) - costs.begin());
+
+#if defined(DEBUG) && DEBUG
+  printf("de cost:%04.5f, %04.5f, %04.5f, %04.5f\n", costs[best],
+         population[best].x(), population[best].y(), population[best].z());
+#endif
+
+  if (info) {
+    info->cost = costs[best];
+    info->evaluations = evaluations;
+    info->spread = population_spread(population);
+  }
+
+  return population[best];
+}
+
+// Explicit instantiations for the available losses
+#define INSTANTIATE_FOR_LOSS(Loss)                                             \
+  template double cost_function<Loss>(Vector3d, NDTFrame *const,               \
+                                      const NDTFrame *const);                  \
+  template Vector3d pso_optimization<Loss>(                                    \
+      Vector3d, NDTFrame *, const NDTFrame *const, const Array3d &,            \
+      const PSOConfig &, OptimizationInfo *);                                  \
+  template Vector3d cmaes_optimization<Loss>(                                  \
+      Vector3d, NDTFrame *, const NDTFrame *const, const Array3d &,            \
+      const CMAESConfig &, OptimizationInfo *);                                \
+  template Vector3d de_optimization<Loss>(Vector3d, NDTFrame *,                \
+                                          const NDTFrame *const,               \
+                                          const Array3d &, const DEConfig &,   \
+                                          OptimizationInfo *)
+
+INSTANTIATE_FOR_LOSS(GaussianLoss);
+INSTANTIATE_FOR_LOSS(HuberLoss);
+INSTANTIATE_FOR_LOSS(CauchyLoss);
+INSTANTIATE_FOR_LOSS(GatedLoss<GaussianLoss>);
+INSTANTIATE_FOR_LOSS(GatedLoss<HuberLoss>);
+INSTANTIATE_FOR_LOSS(GatedLoss<CauchyLoss>);
+
 // UNTESTED implementation of GLIR-PSO [ref.]
 Vector3d glir_pso_optimization(Vector3d initial_guess,
                                NDTFrame *const ref_frame,
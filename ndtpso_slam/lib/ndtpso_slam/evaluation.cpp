@@ -0,0 +1,232 @@
+#include "ndtpso_slam/evaluation.h"
+#include "ndtpso_slam/matcher.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+// Scans without a reference pose this close in time are not evaluated
+#define EVALUATION_MAX_REFERENCE_GAP_S .1
+
+static bool parse_bool(const std::string &value) {
+  return "true" == value || "1" == value;
+}
+
+bool set_matcher_parameter(MatcherConfig &config, const std::string &name,
+                           const std::string &value) {
+  auto &ndt = config.ndt;
+  double number = atof(value.c_str());
+
+  if ("cell_side" == name) {
+    config.cell_side = number;
+  } else if ("frame_size" == name) {
+    config.frame_size = static_cast<unsigned short>(number);
+  } else if ("deskew" == name) {
+    config.deskew = parse_bool(value);
+  } else if ("quality_blend" == name) {
+    config.quality_blend = number;
+  } else if ("stationary_skip" == name) {
+    config.stationary.enabled = parse_bool(value);
+  } else if ("stationary_max_difference" == name) {
+    config.stationary.max_difference = number;
+  } else if ("stationary_max_interval" == name) {
+    config.stationary.max_interval = number;
+  } else if ("iterations" == name) {
+    ndt.psoConfig.iterations = static_cast<int>(number);
+  } else if ("population" == name) {
+    ndt.psoConfig.populationSize = static_cast<int>(number);
+  } else if ("pso_w" == name) {
+    ndt.psoConfig.coeff.w = number;
+  } else if ("pso_c1" == name) {
+    ndt.psoConfig.coeff.c1 = number;
+  } else if ("pso_c2" == name) {
+    ndt.psoConfig.coeff.c2 = number;
+  } else if ("pso_w_dumping" == name) {
+    ndt.psoConfig.coeff.w_dumping = number;
+  } else if ("cmaes_iterations" == name) {
+    ndt.cmaesConfig.iterations = static_cast<int>(number);
+  } else if ("cmaes_population" == name) {
+    ndt.cmaesConfig.populationSize = static_cast<int>(number);
+  } else if ("de_iterations" == name) {
+    ndt.deConfig.iterations = static_cast<int>(number);
+  } else if ("de_population" == name) {
+    ndt.deConfig.populationSize = static_cast<int>(number);
+  } else if ("optimizer" == name) {
+    if ("pso" == value)
+      ndt.optimizer = Optimizer::PSO;
+    else if ("cmaes" == value)
+      ndt.optimizer = Optimizer::CMAES;
+    else if ("de" == value)
+      ndt.optimizer = Optimizer::DE;
+    else
+      return false;
+  } else if ("loss" == name) {
+    if ("gaussian" == value)
+      ndt.loss = NDTLoss::Gaussian;
+    else if ("huber" == value)
+      ndt.loss = NDTLoss::Huber;
+    else if ("cauchy" == value)
+      ndt.loss = NDTLoss::Cauchy;
+    else
+      return false;
+  } else if ("outlier_gating" == name) {
+    ndt.outlierGating = parse_bool(value);
+  } else if ("dynamic_filter" == name) {
+    ndt.dynamicFilter.enabled = parse_bool(value);
+  } else if ("quadtree" == name) {
+    ndt.quadTree.enabled = parse_bool(value);
+  } else if ("quality_min_score" == name) {
+    ndt.qualityConfig.min_score = number;
+  } else if ("quality_min_inliers" == name) {
+    ndt.qualityConfig.min_inlier_ratio = number;
+  } else if ("quality_min_degeneracy" == name) {
+    ndt.qualityConfig.min_degeneracy = number;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+bool load_sessions(const char *filename, vector<Session> &sessions) {
+  std::ifstream sessions_file(filename);
+
+  if (!sessions_file) {
+    printf("%s: Cannot open file \"%s\"\n", __func__, filename);
+    return false;
+  }
+
+  std::string line;
+
+  while (std::getline(sessions_file, line)) {
+    std::istringstream fields(line);
+    Session session;
+
+    if (!(fields >> session.name) || '#' == session.name[0])
+      continue;
+
+    if (!(fields >> session.scans))
+      session.error = "no scans file";
+
+    std::string field;
+
+    while (fields >> field) {
+      auto separator = field.find('=');
+
+      if (std::string::npos == separator)
+        session.reference = field;
+      else if (!set_matcher_parameter(session.config,
+                                      field.substr(0, separator),
+                                      field.substr(separator + 1)))
+        session.error = "bad parameter \"" + field + "\"";
+    }
+
+    sessions.push_back(std::move(session));
+  }
+
+  return !sessions.empty();
+}
+
+void SessionResult::merge(const SessionResult &other) {
+  this->scans += other.scans;
+  this->bad += other.bad;
+  this->evaluated += other.evaluated;
+  this->trans_sq += other.trans_sq;
+  this->rot_sq += other.rot_sq;
+  this->final_trans = std::max(this->final_trans, other.final_trans);
+  this->final_rot = std::max(this->final_rot, other.final_rot);
+  this->cpu += other.cpu;
+  this->latencies.insert(this->latencies.end(), other.latencies.begin(),
+                         other.latencies.end());
+}
+
+// The reference pose the closest in time to 'timestamp', nullptr if none is
+// close enough
+static const PoseRecord *reference_pose(const vector<PoseRecord> &poses,
+                                        double timestamp) {
+  auto next = std::lower_bound(
+      poses.begin(), poses.end(), timestamp,
+      [](const PoseRecord &pose, double t) { return pose.timestamp < t; });
+  const PoseRecord *closest = nullptr;
+
+  if (next != poses.end())
+    closest = &*next;
+  if (next != poses.begin() &&
+      (!closest ||
+       timestamp - (next - 1)->timestamp < closest->timestamp - timestamp))
+    closest = &*(next - 1);
+
+  if (closest &&
+      fabs(closest->timestamp - timestamp) > EVALUATION_MAX_REFERENCE_GAP_S)
+    return nullptr;
+
+  return closest;
+}
+
+static inline double thread_cpu_time() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+  return now.tv_sec + 1E-9 * now.tv_nsec;
+}
+
+void replay_session(const vector<ScanRecord> &scans,
+                    const vector<PoseRecord> &reference,
+                    const MatcherConfig &config, SessionResult &result) {
+  Matcher matcher(config);
+  MatchResult match;
+  // The matcher starts from the origin, at the reference pose of the first
+  // scan
+  const PoseRecord *origin = nullptr;
+
+  result.latencies.reserve(result.latencies.size() + scans.size());
+
+  for (auto &record : scans) {
+    ScanView scan;
+    scan.timestamp = record.timestamp;
+    scan.ranges = record.ranges.data();
+    scan.count = record.ranges.size();
+    scan.angle_min = record.angle_min;
+    scan.angle_increment = record.angle_increment;
+    scan.range_max = record.range_max;
+    scan.time_increment = record.time_increment;
+
+    double cpu_start = thread_cpu_time();
+    auto start = std::chrono::high_resolution_clock::now();
+    matcher.process(scan, match);
+    result.latencies.push_back(std::chrono::duration<double, std::milli>(
+                                   std::chrono::high_resolution_clock::now() -
+                                   start)
+                                   .count());
+    result.cpu += thread_cpu_time() - cpu_start;
+
+    ++result.scans;
+    if (!match.quality.good)
+      ++result.bad;
+
+    auto pose = reference.empty() ? nullptr
+                                  : reference_pose(reference, record.timestamp);
+
+    if (match.first)
+      origin = pose;
+
+    if (!pose || !origin)
+      continue;
+
+    double c = cos(origin->theta), s = sin(origin->theta),
+           dx = pose->x - origin->x, dy = pose->y - origin->y;
+    Vector3d error(match.pose.x() - (c * dx + s * dy),
+                   match.pose.y() - (-s * dx + c * dy),
+                   match.pose.z() - (pose->theta - origin->theta));
+    error.z() = atan2(sin(error.z()), cos(error.z()));
+
+    result.trans_sq += error.head<2>().squaredNorm();
+    result.rot_sq += error.z() * error.z();
+    result.final_trans = error.head<2>().norm();
+    result.final_rot = fabs(error.z());
+    ++result.evaluated;
+  }
+}
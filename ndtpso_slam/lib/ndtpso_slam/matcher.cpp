@@ -0,0 +1,349 @@
+#include "ndtpso_slam/matcher.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// Mean of the differences of two range arrays, each one clipped to
+// 'max_difference' (a vectorized loop)
+static float mean_range_difference(const float *ranges,
+                                   const float *reference, size_t count,
+                                   float max_difference) {
+  float sum = 0.f;
+
+#pragma omp simd reduction(+ : sum)
+  for (size_t i = 0; i < count; ++i)
+    sum += std::min(std::fabs(ranges[i] - reference[i]), max_difference);
+
+  return sum / static_cast<float>(count);
+}
+
+Matcher::Matcher(MatcherConfig config) : s_config(std::move(config)) {
+  auto &conf = this->s_config;
+
+  // The points of the scan frame are only used for matching, so a single
+  // cell is enough
+  this->s_scan = new NDTFrame(Vector3d::Zero(), conf.frame_size,
+                              conf.frame_size, conf.frame_size, false);
+
+  // A reader uses the geometry of the shared map
+  if (!conf.shared_map.empty() && conf.shared_map_reader) {
+    this->s_shared_map = new SharedMap(conf.shared_map, conf.ndt);
+    this->s_map = this->s_shared_map->frame();
+    return;
+  }
+
+  this->s_map = new NDTFrame(Vector3d::Zero(), conf.frame_size,
+                             conf.frame_size, conf.cell_side, true, conf.ndt
+#if BUILD_OCCUPANCY_GRID
+                             ,
+                             conf.occupancy_grid_cell_side
+#endif
+  );
+
+  if (!conf.tile_store.empty())
+    this->s_tiled_map =
+        new TiledMap(conf.tile_store, conf.tile_size, conf.tile_cache_size);
+
+  if (!conf.shared_map.empty())
+    this->s_shared_map = new SharedMap(conf.shared_map, this->s_map);
+}
+
+Matcher::~Matcher() {
+  if (this->s_tiled_map) {
+    this->s_tiled_map->flush(this->s_map);
+    delete this->s_tiled_map;
+  }
+
+  // The frame of a reader belongs to the shared map
+  if (!this->s_config.shared_map_reader || !this->s_shared_map)
+    delete this->s_map;
+
+  delete this->s_shared_map;
+  delete this->s_scan;
+}
+
+bool Matcher::isReady() const {
+  return !this->s_shared_map || this->s_shared_map->isOpen();
+}
+
+void Matcher::loadScan(const ScanView &scan) {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  this->s_stamp = scan.timestamp;
+  this->s_loaded = true;
+
+  if (this->s_config.stationary.enabled) {
+    // The missing returns (NaN, infinite or beyond the maximum range) are
+    // the same in both scans: the order of the operands of max maps NaN to 0
+    this->s_ranges.resize(scan.count);
+    for (size_t i = 0; i < scan.count; ++i)
+      this->s_ranges[i] = std::min(
+          scan.range_max, std::max(0.f, scan.ranges[i * scan.stride]));
+    this->s_angle_min = scan.angle_min;
+    this->s_angle_increment = scan.angle_increment;
+
+    // Not loaded in the scan frame, which keeps the last matched scan
+    this->s_stationary = this->s_isStationary(scan);
+    if (this->s_stationary)
+      return;
+  }
+
+  // Used to remove the motion distortion of the scan
+  Vector3d velocity = this->s_config.deskew ? this->s_velocity(scan.timestamp)
+                                            : Vector3d::Zero();
+
+  // The scan frame has a single cell, resetting it keeps the storage of its
+  // points (no reallocation)
+  this->s_scan->resetCells();
+  this->s_scan->loadLaser(scan.ranges, scan.count, scan.stride,
+                          scan.angle_min, scan.angle_increment,
+                          scan.range_max, scan.time_increment, velocity);
+}
+
+void Matcher::s_moveOrigin(const Vector2d &origin) {
+  if (origin != this->s_map_origin) {
+    this->s_map->shiftOrigin(origin - this->s_map_origin);
+    this->s_map_origin = origin;
+  }
+}
+
+bool Matcher::s_isStationary(const ScanView &scan) const {
+  auto &conf = this->s_config.stationary;
+
+  // Compared to the last matched scan (not the previous one), so a slow
+  // motion is matched once it adds up
+  if (this->s_first || this->s_ranges.empty() ||
+      this->s_ranges.size() != this->s_reference.size() ||
+      scan.angle_min != this->s_reference_angle_min ||
+      scan.angle_increment != this->s_reference_angle_increment ||
+      scan.timestamp - this->s_reference_stamp > conf.max_interval)
+    return false;
+
+  return mean_range_difference(
+             this->s_ranges.data(), this->s_reference.data(),
+             this->s_ranges.size(),
+             static_cast<float>(conf.max_beam_difference)) <=
+         conf.max_difference;
+}
+
+Vector3d Matcher::s_velocity(double timestamp) const {
+  Vector3d velocity = Vector3d::Zero();
+  double scan_period = timestamp - this->s_previous_stamp;
+
+  if (!this->s_first && scan_period > 0.) {
+    double c = cos(this->s_pose.z()), s = sin(this->s_pose.z());
+    velocity << c * this->s_motion.x() + s * this->s_motion.y(),
+        -s * this->s_motion.x() + c * this->s_motion.y(),
+        atan2(sin(this->s_motion.z()), cos(this->s_motion.z()));
+    velocity /= scan_period;
+  }
+
+  return velocity;
+}
+
+void Matcher::dropScan() {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  this->s_scan->resetCells();
+  this->s_loaded = false;
+  this->s_stationary = false;
+}
+
+bool Matcher::match(MatchResult &result, const Vector3d *odom) {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  if (!this->s_loaded || !this->isReady())
+    return false;
+
+  // The robot didn't move since the last matched scan
+  if (this->s_stationary) {
+    result = this->s_last;
+    result.stationary = true;
+
+    this->s_motion = Vector3d::Zero();
+    this->s_previous_stamp = this->s_stamp;
+    this->s_loaded = this->s_stationary = false;
+
+    return true;
+  }
+
+  bool reader = this->s_config.shared_map_reader;
+  Vector3d map_origin = Vector3d::Zero();
+  uint64_t map_epoch = 0;
+
+  if (this->s_tiled_map) {
+    if (this->s_tiled_map->follow(this->s_map, this->s_pose, this->s_motion))
+      this->s_moveOrigin(this->s_tiled_map->origin());
+    map_origin.head<2>() = this->s_tiled_map->origin();
+  }
+
+  if (reader) {
+    map_epoch = this->s_shared_map->acquire();
+
+    if (0 == map_epoch) {
+      this->s_scan->resetCells();
+      this->s_loaded = false;
+      return false;
+    }
+
+    map_origin.head<2>() = this->s_shared_map->origin();
+    this->s_moveOrigin(map_origin.head<2>());
+  }
+
+  this->s_previous_stamp = this->s_stamp;
+
+  MatchResult current;
+  current.quality.good = true;
+  current.first = this->s_first;
+
+  if (this->s_first) {
+    if (odom)
+      this->s_pose = *odom;
+
+    current.pose = this->s_pose;
+  } else {
+    current.pose = this->s_map->align(this->s_pose - map_origin, this->s_scan,
+                                      &current.covariance, &current.quality) +
+                   map_origin;
+
+    // The owner reused the slot of the snapshot meanwhile, match again on the
+    // latest one
+    while (reader && !this->s_shared_map->valid(map_epoch)) {
+      map_epoch = this->s_shared_map->acquire();
+      map_origin.head<2>() = this->s_shared_map->origin();
+      this->s_moveOrigin(map_origin.head<2>());
+      current.pose =
+          this->s_map->align(this->s_pose - map_origin, this->s_scan,
+                             &current.covariance, &current.quality) +
+          map_origin;
+    }
+
+    if (!current.quality.good) {
+      // Predict the pose from the odometry if available, or assume a constant
+      // velocity, then blend it with the (bad) match
+      if (odom) {
+        Vector3d odom_motion = *odom - this->s_odom;
+        double rotation = this->s_pose.z() - this->s_odom.z();
+        this->s_motion << cos(rotation) * odom_motion.x() -
+                              sin(rotation) * odom_motion.y(),
+            sin(rotation) * odom_motion.x() + cos(rotation) * odom_motion.y(),
+            odom_motion.z();
+      }
+
+      Vector3d prediction = this->s_pose + this->s_motion,
+               correction = current.pose - prediction;
+      correction.z() = atan2(sin(correction.z()), cos(correction.z()));
+      current.pose = prediction + this->s_config.quality_blend * correction;
+    }
+  }
+
+  this->s_motion = current.pose - this->s_pose;
+  this->s_pose = current.pose;
+  if (odom)
+    this->s_odom = *odom;
+
+  // Bad poses would corrupt the map
+  if (current.quality.good && !reader) {
+    if (this->s_config.ndt.timeInSeconds)
+      this->s_map->setTime(this->s_stamp);
+    this->s_map->update(current.pose - map_origin, this->s_scan);
+
+    if (this->s_shared_map)
+      this->s_shared_map->publish(this->s_map, map_origin.head<2>());
+  }
+
+  // The reference of the next stationary scans
+  if (this->s_config.stationary.enabled) {
+    std::swap(this->s_reference, this->s_ranges);
+    this->s_reference_angle_min = this->s_angle_min;
+    this->s_reference_angle_increment = this->s_angle_increment;
+    this->s_reference_stamp = this->s_stamp;
+  }
+
+  // The points stay in the scan frame until the next scan (see 'scan')
+  this->s_loaded = false;
+  this->s_first = false;
+
+  this->s_last = current;
+  this->s_last.first = false;
+  result = current;
+
+  return true;
+}
+
+bool Matcher::process(const ScanView &scan, MatchResult &result,
+                      const Vector3d *odom) {
+  this->loadScan(scan);
+
+  return this->match(result, odom);
+}
+
+bool Matcher::snapshot(MapSnapshot &snapshot) {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  if (!this->s_loaded || this->s_first || this->s_stationary ||
+      !this->isReady())
+    return false;
+
+  bool reader = this->s_config.shared_map_reader;
+  uint64_t map_epoch = 0;
+  snapshot.origin = Vector2d::Zero();
+
+  if (this->s_tiled_map) {
+    if (this->s_tiled_map->follow(this->s_map, this->s_pose, this->s_motion))
+      this->s_moveOrigin(this->s_tiled_map->origin());
+    snapshot.origin = this->s_tiled_map->origin();
+  }
+
+  if (reader) {
+    map_epoch = this->s_shared_map->acquire();
+
+    if (0 == map_epoch)
+      return false;
+
+    snapshot.origin = this->s_shared_map->origin();
+  } else if (!this->s_map->built) {
+    this->s_map->build();
+  }
+
+  const NDTFrame *map = this->s_map;
+  const int32_t *match_index = map->matchIndex();
+  int32_t num_match_cells = 0;
+
+  snapshot.width = map->width;
+  snapshot.height = map->height;
+  snapshot.cell_side = map->cell_side;
+  snapshot.match_index.assign(match_index, match_index + map->numOfCells);
+  for (auto index : snapshot.match_index)
+    num_match_cells = std::max(num_match_cells, index + 1);
+
+  snapshot.match_cells.resize(static_cast<size_t>(num_match_cells));
+  for (unsigned int i = 0; i < map->numOfCells; ++i) {
+    if (-1 != match_index[i])
+      snapshot.match_cells[static_cast<size_t>(match_index[i])] =
+          *map->matchCell(static_cast<int>(i));
+  }
+
+  // The owner reused the slot while it was copied
+  if (reader && !this->s_shared_map->valid(map_epoch))
+    return false;
+
+  snapshot.pose = this->s_pose;
+  snapshot.velocity = this->s_velocity(this->s_stamp);
+  snapshot.align_count = map->alignCount();
+  snapshot.last_motion = map->lastMotion();
+
+  return true;
+}
+
+void Matcher::setPose(const Vector3d &pose) {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  this->s_pose = pose;
+}
+
+void Matcher::setSensorTransform(const Vector3d &trans) {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  this->s_scan->setTrans(trans);
+}
@@ -2,6 +2,70 @@
 #include <cstdio>
 #include <eigen3/Eigen/Eigen>
 
+#if NDT_DECAY_FORGETTING
+NDTCell::NDTCell(bool calculate_params) {
+  (void)calculate_params; // The decayed statistics are cheap to initialize
+  this->s_origin = Vector2d::Zero();
+  this->s_current_partial_sum = Vector2d::Zero();
+  this->s_decayed_sum = Vector2d::Zero();
+  this->s_current_partial_sq_sum = Matrix2d::Zero();
+  this->s_decayed_sq_sum = Matrix2d::Zero();
+}
+
+void NDTCell::addPoint(const Vector2d &point) {
+  if (0 == this->s_current_count) {
+    // First point since the last build, the previous ones are already in the
+    // decayed statistics
+    this->points[0].clear();
+
+    if (!this->created)
+      this->s_origin = point;
+  }
+
+  Vector2d local_point = point - this->s_origin;
+
+  this->s_current_count++;
+  this->s_current_partial_sum += local_point;
+  this->s_current_partial_sq_sum += local_point * local_point.transpose();
+  this->points[0].push_back(point);
+  this->created = true;
+  this->built = false;
+}
+
+bool NDTCell::build(double time, double half_life) {
+  // Nothing new since the last build, the distribution is unchanged (decaying
+  // all the statistics by the same factor doesn't change it)
+  if (0 == this->s_current_count)
+    return this->built;
+
+  double decay = (half_life > 0.)
+                     ? exp2(-(time - this->s_last_time) / half_life)
+                     : 1.;
+
+  this->s_decayed_weight =
+      decay * this->s_decayed_weight + this->s_current_count;
+  this->s_decayed_sum =
+      decay * this->s_decayed_sum + this->s_current_partial_sum;
+  this->s_decayed_sq_sum =
+      decay * this->s_decayed_sq_sum + this->s_current_partial_sq_sum;
+  this->s_last_time = time;
+
+  this->s_current_count = 0;
+  this->s_current_partial_sum = Vector2d::Zero();
+  this->s_current_partial_sq_sum = Matrix2d::Zero();
+
+  if (this->s_decayed_weight > 2.) {
+    Vector2d local_mean = this->s_decayed_sum / this->s_decayed_weight;
+    this->mean = this->s_origin + local_mean;
+
+    this->s_calc_covar_inverse(this->s_decayed_sq_sum / this->s_decayed_weight -
+                               local_mean * local_mean.transpose());
+    this->built = true;
+  }
+
+  return this->built;
+}
+#else
 NDTCell::NDTCell(bool calculate_params) {
   if (calculate_params) {
     for (unsigned int i = 0; i < NDT_WINDOW_SIZE; ++i) {
@@ -22,8 +86,8 @@ void NDTCell::addPoint(const Vector2d &point) {
   if (0 == this->s_current_count) {
     // For the first call after building the cell (so the first call after the
     // previous iteration) we reset all the points of the corresponding
-    // iteration in the points buffer
-    this->points[this->s_current_window_id] = vector<Vector2d>();
+    // iteration in the points buffer (keeping its storage)
+    this->points[this->s_current_window_id].clear();
   }
 
   this->s_current_count++;
@@ -54,7 +118,7 @@ bool NDTCell::build() {
     WINDOW_ADD(this->s_global_covar_sum, cov, this->s_partial_covars,
                this->s_current_window_id);
 
-    this->s_calc_covar_inverse();
+    this->s_calc_covar_inverse(this->s_global_covar_sum / this->s_global_count);
     this->built = true;
   }
 
@@ -66,6 +130,7 @@ bool NDTCell::build() {
 
   return this->built;
 }
+#endif
 
 double NDTCell::normalDistribution(const Vector2d &point) {
   if (this->built) {
@@ -79,26 +144,174 @@ double NDTCell::normalDistribution(const Vector2d &point) {
 
 void NDTCell::reset() {
   this->s_current_partial_sum = Vector2d::Zero();
-  this->s_global_sum = Vector2d::Zero();
   this->s_current_count = 0;
+#if NDT_DECAY_FORGETTING
+  this->s_current_partial_sq_sum = Matrix2d::Zero();
+  this->s_decayed_sum = Vector2d::Zero();
+  this->s_decayed_sq_sum = Matrix2d::Zero();
+  this->s_decayed_weight = 0.;
+  this->s_last_time = 0.;
+#else
+  // The window too, the next builds subtract its old partial sums (e.g. a
+  // cell of a recentered tiled view)
+  for (unsigned int i = 0; i < NDT_WINDOW_SIZE; ++i) {
+    this->s_partial_sums[i] = Vector2d::Zero();
+    this->s_partial_counts[i] = 0;
+    this->s_partial_covars[i] = Matrix2d::Zero();
+  }
+
+  this->s_global_sum = Vector2d::Zero();
   this->s_global_count = 0;
   this->s_global_covar_sum = Matrix2d::Zero();
+#endif
   this->s_current_window_id = 0;
 
   for (auto &point : this->points) {
     point.clear();
   }
+
+  this->created = false;
+  this->built = false;
+}
+
+void NDTCell::release() {
+  this->reset();
+  this->mean = Vector2d::Zero();
+  this->s_inv_covar = Matrix2d::Zero();
+  this->s_condition = 0.;
+#if NDT_DECAY_FORGETTING
+  this->s_origin = Vector2d::Zero();
+#endif
+
+  // 'reset' keeps the storage of the points
+  for (auto &points : this->points)
+    vector<Vector2d>().swap(points);
+}
+
+// The covariances are translation invariant, only the sums are moved (by
+// their number of points times the offset)
+void NDTCell::translate(const Vector2d &offset) {
+  this->mean += offset;
+#if NDT_DECAY_FORGETTING
+  // All the sums are relative to the cell's origin
+  this->s_origin += offset;
+#else
+  this->s_current_partial_sum += this->s_current_count * offset;
+  this->s_global_sum += this->s_global_count * offset;
+
+  for (unsigned int i = 0; i < NDT_WINDOW_SIZE; ++i)
+    this->s_partial_sums[i] += this->s_partial_counts[i] * offset;
+#endif
+
+  for (auto &points : this->points) {
+    for (auto &point : points)
+      point += offset;
+  }
+}
+
+template <typename T> static inline bool write_raw(FILE *file, const T &value) {
+  return 1 == fwrite(&value, sizeof(T), 1, file);
+}
+
+template <typename T> static inline bool read_raw(FILE *file, T &value) {
+  return 1 == fread(&value, sizeof(T), 1, file);
+}
+
+bool NDTCell::save(FILE *file) const {
+  bool ok = write_raw(file, this->mean) && write_raw(file, this->built) &&
+            write_raw(file, this->created) &&
+            write_raw(file, this->s_inv_covar) &&
+            write_raw(file, this->s_condition) &&
+            write_raw(file, this->s_current_partial_sum) &&
+            write_raw(file, this->s_current_count) &&
+            write_raw(file, this->s_current_window_id) &&
+#if NDT_DECAY_FORGETTING
+            write_raw(file, this->s_origin) &&
+            write_raw(file, this->s_decayed_sum) &&
+            write_raw(file, this->s_current_partial_sq_sum) &&
+            write_raw(file, this->s_decayed_sq_sum) &&
+            write_raw(file, this->s_decayed_weight) &&
+            write_raw(file, this->s_last_time);
+#else
+            write_raw(file, this->s_partial_sums) &&
+            write_raw(file, this->s_partial_covars) &&
+            write_raw(file, this->s_partial_counts) &&
+            write_raw(file, this->s_global_sum) &&
+            write_raw(file, this->s_global_covar_sum) &&
+            write_raw(file, this->s_global_count);
+#endif
+
+  for (auto &points : this->points) {
+    auto size = static_cast<uint32_t>(points.size());
+
+    ok = ok && write_raw(file, size) &&
+         (size == fwrite(points.data(), sizeof(Vector2d), size, file));
+  }
+
+  return ok;
 }
 
-void NDTCell::s_calc_covar_inverse() {
-  Matrix2d covar = this->s_global_covar_sum / this->s_global_count;
+bool NDTCell::load(FILE *file) {
+  bool ok = read_raw(file, this->mean) && read_raw(file, this->built) &&
+            read_raw(file, this->created) &&
+            read_raw(file, this->s_inv_covar) &&
+            read_raw(file, this->s_condition) &&
+            read_raw(file, this->s_current_partial_sum) &&
+            read_raw(file, this->s_current_count) &&
+            read_raw(file, this->s_current_window_id) &&
+#if NDT_DECAY_FORGETTING
+            read_raw(file, this->s_origin) &&
+            read_raw(file, this->s_decayed_sum) &&
+            read_raw(file, this->s_current_partial_sq_sum) &&
+            read_raw(file, this->s_decayed_sq_sum) &&
+            read_raw(file, this->s_decayed_weight) &&
+            read_raw(file, this->s_last_time);
+#else
+            read_raw(file, this->s_partial_sums) &&
+            read_raw(file, this->s_partial_covars) &&
+            read_raw(file, this->s_partial_counts) &&
+            read_raw(file, this->s_global_sum) &&
+            read_raw(file, this->s_global_covar_sum) &&
+            read_raw(file, this->s_global_count);
+#endif
+
+  // The record may be corrupted (e.g. truncated by a crash): the window
+  // position indexes the points buffers, and they can't hold more points
+  // than the bytes left in the file
+  long position = ftell(file), end = -1;
+
+  if (ok && position >= 0 && 0 == fseek(file, 0, SEEK_END)) {
+    end = ftell(file);
+    ok = 0 == fseek(file, position, SEEK_SET);
+  }
+
+  ok = ok && end >= position &&
+       this->s_current_window_id < NDT_POINTS_BUFFERS;
+  auto left = ok ? static_cast<size_t>(end - position) : 0;
+
+  for (auto &points : this->points) {
+    uint32_t size = 0;
+
+    ok = ok && read_raw(file, size) && size <= left / sizeof(Vector2d);
+    points.resize(ok ? size : 0);
+    ok = ok && (size == fread(points.data(), sizeof(Vector2d), size, file));
+    left -= ok ? size * sizeof(Vector2d) : 0;
+  }
+
+  if (!ok)
+    this->release();
+
+  return ok;
+}
 
+void NDTCell::s_calc_covar_inverse(const Matrix2d &covar) {
   EigenSolver<Matrix2d> eigenval_solver(covar);
   Vector2d eigenvals = eigenval_solver.pseudoEigenvalueMatrix().diagonal();
   double large_val, small_val;
 
   large_val = eigenvals[eigenvals[0] > eigenvals[1] ? 0 : 1];
   small_val = eigenvals[eigenvals[0] < eigenvals[1] ? 0 : 1];
+  this->s_condition = large_val > 0. ? small_val / large_val : 0.;
 
   if (small_val < .001 * large_val)
     large_val = .001 * large_val *
@@ -1,6 +1,10 @@
 #include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/beamtable.h"
 #include "ndtpso_slam/core.h"
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <eigen3/Eigen/Eigenvalues>
 #include <utility>
 
 #ifdef OPENCV_FOUND
@@ -15,6 +19,9 @@
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 #endif
 
+#define SPILL_FILE_MAGIC 0x4e445446 // "NDTF"
+#define SPILL_FILE_VERSION 1
+
 NDTFrame::NDTFrame(Vector3d trans, unsigned short width, unsigned short height,
                    double cell_side, bool calculate_cells_params,
                    NDTPSOConfig config
@@ -23,14 +30,16 @@ NDTFrame::NDTFrame(Vector3d trans, unsigned short width, unsigned short height,
                    double occupancy_grid_cell_size
 #endif
                    )
-    : s_trans(std::move(trans)), s_config(std::move(config)), width(width),
-      height(height), cell_side(cell_side) {
+    : s_trans(std::move(trans)), s_config(std::move(config)),
+      s_quadtree(this->s_config.quadTree, this->s_config.culling),
+      width(width), height(height), cell_side(cell_side) {
   this->built = false;
   this->widthNumOfCells = uint16_t(ceil(width / cell_side));
   this->heightNumOfCells = uint16_t(ceil(height / cell_side));
   this->numOfCells = widthNumOfCells * heightNumOfCells;
   this->cells =
       vector<NDTCell>(this->numOfCells, NDTCell(calculate_cells_params));
+  this->s_dirty_flags = vector<uint8_t>(this->numOfCells, 0);
 
 #if BUILD_OCCUPANCY_GRID
   // Initializing the occupancy grid,
@@ -69,21 +78,86 @@ NDTFrame::NDTFrame(Vector3d trans, unsigned short width, unsigned short height,
 
   this->s_y_min = -height / 2.;
   this->s_y_max = height / 2.;
+
+  if (this->s_config.dynamicFilter.enabled) {
+    this->s_hits = vector<uint16_t>(this->numOfCells, 0);
+    this->s_misses = vector<uint16_t>(this->numOfCells, 0);
+  }
+
+  if (this->s_config.eviction.max_age > 0.)
+    this->s_last_seen = vector<double>(this->numOfCells, 0.);
+
+  if (!this->s_config.eviction.spill_file.empty() &&
+      !this->s_open_spill_file())
+    fprintf(stderr,
+            "Can't open the map spill file \"%s\", evicted cells will be "
+            "discarded\n",
+            this->s_config.eviction.spill_file.c_str());
 }
 
+NDTFrame::NDTFrame(unsigned short width, unsigned short height,
+                   double cell_side, NDTPSOConfig config)
+    : s_config(std::move(config)), s_quadtree(this->s_config.quadTree),
+      s_read_only(true), width(width), height(height), cell_side(cell_side) {
+  // The attached view only has the grid's distributions
+  this->s_config.quadTree.enabled = false;
+  this->built = false;
+  this->widthNumOfCells = uint16_t(ceil(width / cell_side));
+  this->heightNumOfCells = uint16_t(ceil(height / cell_side));
+  this->numOfCells = widthNumOfCells * heightNumOfCells;
+  this->s_x_min = -width / 2.;
+  this->s_x_max = width / 2.;
+  this->s_y_min = -height / 2.;
+  this->s_y_max = height / 2.;
+}
+
+void NDTFrame::attach(const int32_t *match_index,
+                      const MatchCell *match_cells) {
+  this->s_match_index_view = match_index;
+  this->s_match_cells_view = match_cells;
+  this->built = true;
+}
+
+NDTFrame::~NDTFrame() {
+  if (this->s_spill_file)
+    fclose(this->s_spill_file);
+}
+
+// Only the modified cells are built (the others are unchanged), they are
+// independent, so each thread builds a single block of contiguous cells
+// (sorted indices), only the ends of the blocks may share cache lines
 void NDTFrame::build() {
+  // Nothing to build, the view is set by 'attach'
+  if (this->s_read_only)
+    return;
+
+  std::sort(this->s_dirty.begin(), this->s_dirty.end());
+
+  auto count = static_cast<int>(this->s_dirty.size());
+  int n_threads = threads_count(this->s_config.psoConfig.num_threads);
+  bool parallel = count >= NDT_PARALLEL_BUILD_MIN_CELLS && n_threads > 1;
+
+#pragma omp parallel for num_threads(n_threads) if (parallel) schedule(static)
+  for (int i = 0; i < count; ++i) {
+    auto &cell = this->cells[this->s_dirty[static_cast<size_t>(i)]];
+
+    if (cell.created) {
+#if NDT_DECAY_FORGETTING
+      cell.build(this->s_time, this->s_config.decay.half_life);
+#else
+      cell.build();
+#endif
+    }
+  }
+
 #if BUILD_OCCUPANCY_GRID
   auto og_cells_per_cell = static_cast<uint32_t>(
       floor(this->cell_side / this->s_occupancy_grid.cell_size));
-#endif
 
-  for (unsigned int i = 0; i < this->numOfCells; ++i) {
+  for (auto i : this->s_dirty) {
     auto current_cell = &this->cells[i];
 
     if (current_cell->created) {
-      current_cell->build();
-
-#if BUILD_OCCUPANCY_GRID
       if (this->s_occupancy_grid.cell_size > 0.) {
         uint32_t cell_x_ind = i % this->widthNumOfCells,
                  cell_y_ind = i / this->heightNumOfCells;
@@ -128,13 +202,110 @@ void NDTFrame::build() {
           }
         }
       }
-#endif
     }
   }
+#endif
+
+#if NDT_DECAY_FORGETTING
+  // The weights of all the cells decayed (see numOfPoints)
+  if (this->s_config.culling.min_points > 0. ||
+      this->s_config.culling.full_points > 0.)
+    this->s_rebuild_match_cells = true;
+#endif
+
+  if (this->s_rebuild_match_cells) {
+    this->s_build_match_cells();
+  } else {
+    for (auto i : this->s_dirty)
+      this->s_update_match_cell(i);
+
+    this->s_match_index_view = this->s_match_index.data();
+    this->s_match_cells_view = this->matchCells.data();
+  }
+
+  for (auto i : this->s_dirty)
+    this->s_dirty_flags[i] = 0;
+  this->s_dirty.clear();
+
+  if (this->s_config.quadTree.enabled)
+    this->s_quadtree.update(this->cells, this->widthNumOfCells, this->cell_side,
+                            this->s_x_min, this->s_y_min);
 
   this->built = true;
 }
 
+// The matching distribution of the cell 'index', false if it's not built or
+// culled
+bool NDTFrame::s_match_cell(unsigned int index, MatchCell &match) const {
+  auto &culling = this->s_config.culling;
+  auto &cell = this->cells[index];
+
+  if (!cell.built)
+    return false;
+
+  double points = this->numOfPoints(index);
+
+  if (points < culling.min_points || cell.condition() < culling.min_condition)
+    return false;
+
+  match.mean = cell.mean;
+  match.inv_covar = cell.inverseCovariance();
+  match.weight = (culling.full_points > 0.)
+                     ? std::min(1., points / culling.full_points)
+                     : 1.;
+
+  return true;
+}
+
+void NDTFrame::s_build_match_cells() {
+  MatchCell match;
+
+  this->s_match_index.assign(this->numOfCells, -1);
+  this->s_match_cell_index.clear();
+  this->matchCells.clear();
+
+  for (unsigned int i = 0; i < this->numOfCells; ++i) {
+    if (!this->s_match_cell(i, match))
+      continue;
+
+    this->s_match_index[i] = static_cast<int32_t>(this->matchCells.size());
+    this->s_match_cell_index.push_back(i);
+    this->matchCells.push_back(match);
+  }
+
+  this->s_match_index_view = this->s_match_index.data();
+  this->s_match_cells_view = this->matchCells.data();
+  this->s_rebuild_match_cells = false;
+}
+
+// Patch the matching view for the cell 'index' only: its entry is updated,
+// added at the end, or replaced by the last one (the order of 'matchCells'
+// doesn't matter, the cells are found through 'matchIndex')
+void NDTFrame::s_update_match_cell(unsigned int index) {
+  MatchCell match;
+  int32_t position = this->s_match_index[index];
+
+  if (this->s_match_cell(index, match)) {
+    if (-1 == position) {
+      this->s_match_index[index] =
+          static_cast<int32_t>(this->matchCells.size());
+      this->s_match_cell_index.push_back(index);
+      this->matchCells.push_back(match);
+    } else {
+      this->matchCells[static_cast<size_t>(position)] = match;
+    }
+  } else if (-1 != position) {
+    auto moved = this->s_match_cell_index.back();
+
+    this->matchCells[static_cast<size_t>(position)] = this->matchCells.back();
+    this->s_match_cell_index[static_cast<size_t>(position)] = moved;
+    this->s_match_index[moved] = position;
+    this->s_match_index[index] = -1;
+    this->matchCells.pop_back();
+    this->s_match_cell_index.pop_back();
+  }
+}
+
 void NDTFrame::transform(Vector3d trans) {
   if (!trans.isZero(1e-6)) {
     vector<NDTCell> *old_cells = &this->cells;
@@ -154,17 +325,54 @@ void NDTFrame::transform(Vector3d trans) {
     }
 
     delete old_cells;
+    this->s_rebuild_match_cells = true;
     this->built = false;
   }
 }
 
 // Initialize the cell from laser data according to the device sensibility and
-// the minimum angle
+// the minimum angle.
+// When the 'time_increment' between beams and the sensor 'velocity' (vx, vy
+// and omega, in the sensor frame) are given, the motion distortion is removed:
+// all the points are expressed in the sensor frame at the first beam
 void NDTFrame::loadLaser(vector<float> const &laser_data,
                          float const &min_angle, float const &angle_increment,
-                         float const &max_range) {
+                         float const &max_range, float time_increment,
+                         const Vector3d &velocity) {
+  this->loadLaser(laser_data.data(), laser_data.size(), 1, min_angle,
+                  angle_increment, max_range, time_increment, velocity);
+}
+
+void NDTFrame::loadLaser(const float *ranges, size_t count, size_t stride,
+                         float min_angle, float angle_increment,
+                         float max_range, float time_increment,
+                         const Vector3d &velocity) {
   this->built = false;
-  auto n = static_cast<unsigned int>(laser_data.size());
+  auto n = static_cast<unsigned int>(count);
+
+  if (0 == n)
+    return;
+
+  // The points of the whole scan are computed at once, using the cached
+  // cosines/sines of the beams' angles
+  const BeamTable &beams = BeamTable::get(n, min_angle, angle_increment);
+  Map<const ArrayXf, 0, InnerStride<>> laser_data(
+      ranges, n, InnerStride<>(static_cast<Index>(stride)));
+  ArrayXd xs = laser_data.cast<double>() * beams.cosines,
+          ys = laser_data.cast<double>() * beams.sines;
+
+  if ((time_increment != 0.f) && !velocity.isZero(1e-9)) {
+    // The rotation during a scan is small enough to use a Taylor expansion of
+    // its sin/cos
+    ArrayXd t = ArrayXd::LinSpaced(n, 0., (n - 1) * double(time_increment)),
+            rot = velocity.z() * t, rot2 = rot.square(),
+            cos_rot = 1. - rot2 / 2. + rot2.square() / 24.,
+            sin_rot = rot * (1. - rot2 / 6.);
+
+    ArrayXd deskewed_x = cos_rot * xs - sin_rot * ys + velocity.x() * t;
+    ys = sin_rot * xs + cos_rot * ys + velocity.y() * t;
+    xs = std::move(deskewed_x);
+  }
 
 #if TRANSFORM_POINTS_AT_LOAD
   // Define a function 'f' to do transformation if needed
@@ -174,24 +382,20 @@ void NDTFrame::loadLaser(vector<float> const &laser_data,
     trans_func = &transform_point;
 #endif
 
-  float theta;
 #if PREFER_FRONTAL_POINTS
   float delta_theta = 0.f;
 #endif
 
-  // For each element in the laser vector, get his index (i) and it's
-  // corresponding (theta)
-  // according to the sensibility and the minimum angle
+  // Keep the points within the valid range
   for (unsigned int i = 0; i < n; ++i) {
     if ((laser_data[i] < max_range) &&
         (laser_data[i] > this->s_config.laserIgnoreEpsilon)) {
-      theta = index_to_angle(i, angle_increment, min_angle);
 #if PREFER_FRONTAL_POINTS
-      delta_theta += sinf(theta);
+      delta_theta += static_cast<float>(beams.sines[i]);
 
       if (fabsf(delta_theta) > .5f) {
 #endif
-        Vector2d point = laser_to_point(laser_data[i], theta);
+        Vector2d point(xs[i], ys[i]);
 
 #if TRANSFORM_POINTS_AT_LOAD
         if (trans_func)
@@ -206,18 +410,463 @@ void NDTFrame::loadLaser(vector<float> const &laser_data,
   }
 }
 
+// Stable LSD radix sort of 'order' by 'keys' (11 bits per pass, as many
+// passes as needed for 'max_key'), the points of a cell keep the scan order
+static void radix_sort(const vector<uint32_t> &keys, vector<uint32_t> &order,
+                       uint32_t max_key) {
+  const unsigned int bits = 11, buckets = 1u << bits;
+  vector<uint32_t> sorted(order.size());
+  uint32_t counts[buckets];
+
+  for (unsigned int shift = 0; shift < 32 && (max_key >> shift) > 0;
+       shift += bits) {
+    std::fill(counts, counts + buckets, 0u);
+
+    for (auto i : order)
+      ++counts[(keys[i] >> shift) & (buckets - 1)];
+
+    uint32_t offset = 0;
+    for (auto &count : counts) {
+      uint32_t bucket_size = count;
+      count = offset;
+      offset += bucket_size;
+    }
+
+    for (auto i : order)
+      sorted[counts[(keys[i] >> shift) & (buckets - 1)]++] = i;
+
+    order.swap(sorted);
+  }
+}
+
+// The points are transformed in parallel, then sorted by cell, and each
+// thread inserts the points of its own cells: no locks, and the points of a
+// cell are added in the scan order whatever the number of threads
 void NDTFrame::update(Vector3d trans, NDTFrame *const new_frame) {
-  this->built =
-      false; // Set 'built' flag to false to rebuild the cell if needed
+  bool filter_dynamic = this->s_config.dynamicFilter.enabled,
+       track_age = !this->s_last_seen.empty();
+
+  if (!this->s_config.timeInSeconds)
+    this->s_time += 1.;
+
+#if NDT_DECAY_FORGETTING
+  // The weights of all the cells decayed (see numOfPoints), even without new
+  // points
+  if (this->s_config.culling.min_points > 0. ||
+      this->s_config.culling.full_points > 0.)
+    this->built = false;
+#endif
 
+  vector<const Vector2d *> scan_points;
   for (auto &new_frame_cell : new_frame->cells) {
     if (new_frame_cell.created) {
-      for (auto &point : new_frame_cell.points[0]) {
-        Vector2d pt = transform_point(point, trans);
-        this->addPoint(pt);
+      for (auto &point : new_frame_cell.points[0])
+        scan_points.push_back(&point);
+    }
+  }
+
+  auto count = static_cast<int>(scan_points.size());
+  int n_threads = threads_count(this->s_config.psoConfig.num_threads);
+  bool parallel = count >= NDT_PARALLEL_UPDATE_MIN_POINTS && n_threads > 1;
+  vector<Vector2d> points(scan_points.size());
+  vector<uint32_t> keys(scan_points.size());
+  const auto outside = static_cast<uint32_t>(-1);
+
+#pragma omp parallel for num_threads(n_threads) if (parallel) schedule(static)
+  for (int i = 0; i < count; ++i) {
+    points[i] = transform_point(*scan_points[i], trans);
+    int cell_index =
+        this->getCellIndex(points[i], this->widthNumOfCells, this->cell_side);
+
+    // Points falling in the free space are classified with the counters of
+    // the previous scans, before tracing the current one
+    bool skip = (-1 == cell_index) ||
+                (filter_dynamic && this->isDynamic(cell_index));
+    keys[i] = skip ? outside : static_cast<uint32_t>(cell_index);
+  }
+
+  vector<uint32_t> order;
+  order.reserve(scan_points.size());
+  for (uint32_t i = 0; i < scan_points.size(); ++i) {
+    if (outside != keys[i])
+      order.push_back(i);
+  }
+
+  radix_sort(keys, order, this->numOfCells - 1);
+
+  // Start of the points of each cell in 'order', and the per cell bookkeeping
+  // (serial, it may read the spill file)
+  vector<uint32_t> runs;
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    if (0 != i && keys[order[i]] == keys[order[i - 1]])
+      continue;
+
+    auto index = keys[order[i]];
+    runs.push_back(i);
+    this->markDirty(index);
+
+    // A spilled cell is seen again before the next eviction pass
+    if (!this->s_spilled.empty() && !this->cells[index].created &&
+        0 != this->s_spilled.erase(index))
+      this->s_restore_cell(index);
+
+    if (track_age)
+      this->s_last_seen[index] = this->s_time;
+  }
+  runs.push_back(static_cast<uint32_t>(order.size()));
+
+  auto num_runs = static_cast<int>(runs.size()) - 1;
+
+#pragma omp parallel for num_threads(n_threads) if (parallel) schedule(static)
+  for (int run = 0; run < num_runs; ++run) {
+    auto &cell = this->cells[keys[order[runs[run]]]];
+
+    for (uint32_t i = runs[run]; i < runs[run + 1]; ++i)
+      cell.addPoint(points[order[i]]);
+  }
+
+  if (!order.empty())
+    this->built =
+        false; // Set 'built' flag to false to rebuild the cell if needed
+
+  if (filter_dynamic) {
+    Vector2d origin = trans.head<2>();
+
+    for (auto &new_frame_cell : new_frame->cells) {
+      if (new_frame_cell.created) {
+        for (auto &point : new_frame_cell.points[0])
+          this->s_trace_free_space(origin, transform_point(point, trans));
       }
     }
   }
+
+  auto &eviction = this->s_config.eviction;
+
+  if ((eviction.max_age > 0. || eviction.max_distance > 0.) &&
+      0 == (++this->s_updates % std::max(1u, eviction.period)))
+    this->evictStale(trans.head<2>());
+}
+
+unsigned int NDTFrame::evictStale(const Vector2d &position) {
+  auto &conf = this->s_config.eviction;
+  double max_distance2 = conf.max_distance * conf.max_distance;
+  unsigned int evicted = 0;
+
+  for (unsigned int i = 0; i < this->numOfCells; ++i) {
+    auto &cell = this->cells[i];
+
+    if (!cell.created)
+      continue;
+
+    bool too_far = (conf.max_distance > 0.) &&
+                   ((this->s_cell_center(i) - position).squaredNorm() >
+                    max_distance2),
+         too_old = !this->s_last_seen.empty() &&
+                   (this->s_time - this->s_last_seen[i] > conf.max_age);
+
+    if (too_far || too_old) {
+      // Only the cells left behind are loaded back, the stale ones (not seen
+      // while being around) are kept on disk for the persistent map
+      if (this->s_spill_file)
+        this->s_spill_cell(i, too_far && !too_old);
+
+      cell.release();
+      this->markDirty(i); // Removed from the matching view by the next build
+
+      if (!this->s_hits.empty())
+        this->s_hits[i] = this->s_misses[i] = 0;
+
+      ++evicted;
+    }
+  }
+
+  // Load back the spilled cells the robot is close to again
+  if (conf.max_distance > 0.) {
+    for (auto spilled = this->s_spilled.begin();
+         spilled != this->s_spilled.end();) {
+      if ((this->s_cell_center(*spilled) - position).squaredNorm() <=
+          max_distance2) {
+        this->s_restore_cell(*spilled);
+        spilled = this->s_spilled.erase(spilled);
+      } else {
+        ++spilled;
+      }
+    }
+  }
+
+  if (this->s_spill_file &&
+      this->s_spill_end > NDT_SPILL_COMPACT_MIN_SIZE &&
+      this->s_spill_end > 2 * this->s_spill_live_size &&
+      !this->s_compact_spill_file())
+    fprintf(stderr, "Can't compact the map spill file \"%s\"\n",
+            this->s_config.eviction.spill_file.c_str());
+
+  if (evicted)
+    this->built = false;
+
+  return evicted;
+}
+
+Vector2d NDTFrame::s_cell_center(unsigned int index) const {
+  return Vector2d(
+      (index % this->widthNumOfCells + .5) * this->cell_side - this->width / 2.,
+      (index / this->widthNumOfCells + .5) * this->cell_side -
+          this->height / 2.);
+}
+
+NDTFrame::SpillFileHeader NDTFrame::s_spill_file_header() const {
+  SpillFileHeader header;
+  header.magic = SPILL_FILE_MAGIC;
+  header.version = SPILL_FILE_VERSION;
+  header.decay = NDT_DECAY_FORGETTING ? 1 : 0;
+  header.buffers = NDT_POINTS_BUFFERS;
+  header.width = this->width;
+  header.height = this->height;
+  header.cell_side = this->cell_side;
+
+  return header;
+}
+
+// The spill file is a header, then a log of (cell index, restorable, cell
+// state) records, kept between runs: the last record of each cell is its live
+// one, and indexed when the file is opened (a truncated last record is
+// overwritten). A file of another build or map geometry is not used
+bool NDTFrame::s_open_spill_file() {
+  auto filename = this->s_config.eviction.spill_file.c_str();
+  this->s_spill_file = fopen(filename, "r+b");
+
+  if (!this->s_spill_file && ENOENT == errno)
+    this->s_spill_file = fopen(filename, "w+b");
+
+  if (!this->s_spill_file)
+    return false;
+
+  SpillFileHeader expected = this->s_spill_file_header(), file_header;
+  bool ok =
+      1 == fread(&file_header, sizeof(file_header), 1, this->s_spill_file);
+
+  // A new (empty) file
+  if (!ok && 0 == fseek(this->s_spill_file, 0, SEEK_END) &&
+      0 == ftell(this->s_spill_file)) {
+    file_header = expected;
+    ok = 1 == fwrite(&file_header, sizeof(file_header), 1,
+                     this->s_spill_file) &&
+         0 == fflush(this->s_spill_file);
+  }
+
+  if (!ok || expected.magic != file_header.magic ||
+      expected.version != file_header.version ||
+      expected.decay != file_header.decay ||
+      expected.buffers != file_header.buffers ||
+      expected.width != file_header.width ||
+      expected.height != file_header.height ||
+      expected.cell_side != file_header.cell_side) {
+    if (ok)
+      fprintf(stderr,
+              "The map spill file \"%s\" comes from another build or map "
+              "geometry\n",
+              filename);
+    fclose(this->s_spill_file);
+    this->s_spill_file = nullptr;
+    return false;
+  }
+
+  this->s_spill_end = sizeof(SpillFileHeader);
+
+  NDTCell cell(false);
+  uint32_t header[2];
+
+  while (2 == fread(header, sizeof(uint32_t), 2, this->s_spill_file) &&
+         header[0] < this->numOfCells && cell.load(this->s_spill_file)) {
+    long end = ftell(this->s_spill_file);
+    auto &record = this->s_spill_records[header[0]];
+
+    this->s_spill_live_size += end - this->s_spill_end - record.size;
+    record = {this->s_spill_end, end - this->s_spill_end};
+    this->s_spill_end = end;
+
+    if (header[1])
+      this->s_spilled.insert(header[0]);
+    else
+      this->s_spilled.erase(header[0]);
+  }
+
+  return true;
+}
+
+bool NDTFrame::s_spill_cell(unsigned int index, bool restorable) {
+  long offset = this->s_spill_end;
+  uint32_t header[2] = {index, restorable ? 1u : 0u};
+
+  if (0 != fseek(this->s_spill_file, offset, SEEK_SET) ||
+      2 != fwrite(header, sizeof(uint32_t), 2, this->s_spill_file) ||
+      !this->cells[index].save(this->s_spill_file))
+    return false;
+
+  // Supersedes the previous record of the cell
+  auto &record = this->s_spill_records[index];
+  this->s_spill_end = ftell(this->s_spill_file);
+  this->s_spill_live_size += this->s_spill_end - offset - record.size;
+  record = {offset, this->s_spill_end - offset};
+
+  if (restorable)
+    this->s_spilled.insert(index);
+  else
+    this->s_spilled.erase(index);
+
+  return true;
+}
+
+// The record stays live once loaded back: it's the last known state of the
+// cell for the next runs until it's spilled again
+bool NDTFrame::s_restore_cell(unsigned int index) {
+  auto record = this->s_spill_records.find(index);
+  uint32_t header[2];
+
+  // Already recreated by new points, the spilled state is outdated
+  if (this->cells[index].created || this->s_spill_records.end() == record)
+    return false;
+
+  if (0 != fseek(this->s_spill_file, record->second.offset, SEEK_SET) ||
+      2 != fread(header, sizeof(uint32_t), 2, this->s_spill_file) ||
+      header[0] != index || !this->cells[index].load(this->s_spill_file))
+    return false;
+
+  if (!this->s_last_seen.empty())
+    this->s_last_seen[index] = this->s_time;
+
+  this->markDirty(index);
+  this->built = false;
+
+  return true;
+}
+
+// Copies the live records, in the log order, to a new file replacing the
+// spill file
+bool NDTFrame::s_compact_spill_file() {
+  auto &filename = this->s_config.eviction.spill_file;
+  std::string compacted_name = filename + ".tmp";
+  FILE *compacted = fopen(compacted_name.c_str(), "w+b");
+
+  if (!compacted)
+    return false;
+
+  vector<std::pair<long, unsigned int>> order;
+  order.reserve(this->s_spill_records.size());
+  for (auto &record : this->s_spill_records)
+    order.emplace_back(record.second.offset, record.first);
+  std::sort(order.begin(), order.end());
+
+  vector<long> offsets;
+  vector<char> buffer;
+  SpillFileHeader header = this->s_spill_file_header();
+  long end = sizeof(header);
+  bool ok = 1 == fwrite(&header, sizeof(header), 1, compacted);
+
+  offsets.reserve(order.size());
+  for (auto &entry : order) {
+    auto size = this->s_spill_records[entry.second].size;
+    buffer.resize(static_cast<size_t>(size));
+    ok = ok && 0 == fseek(this->s_spill_file, entry.first, SEEK_SET) &&
+         1 == fread(buffer.data(), buffer.size(), 1, this->s_spill_file) &&
+         1 == fwrite(buffer.data(), buffer.size(), 1, compacted);
+
+    if (!ok)
+      break;
+
+    offsets.push_back(end);
+    end += size;
+  }
+
+  if (!ok || 0 != fflush(compacted) ||
+      0 != rename(compacted_name.c_str(), filename.c_str())) {
+    fclose(compacted);
+    remove(compacted_name.c_str());
+    return false;
+  }
+
+  for (size_t i = 0; i < order.size(); ++i)
+    this->s_spill_records[order[i].second].offset = offsets[i];
+
+  fclose(this->s_spill_file);
+  this->s_spill_file = compacted;
+  this->s_spill_end = end;
+  this->s_spill_live_size = end - static_cast<long>(sizeof(header));
+
+  return true;
+}
+
+// A cell is dynamic when it has mostly been seen as free space
+bool NDTFrame::isDynamic(int cell_index) const {
+  if (-1 == cell_index || this->s_misses.empty())
+    return false;
+
+  auto index = static_cast<size_t>(cell_index);
+  auto &conf = this->s_config.dynamicFilter;
+
+  return (this->s_misses[index] >= conf.min_misses) &&
+         (this->s_misses[index] > conf.free_ratio * this->s_hits[index]);
+}
+
+// Count an observation of a cell (free or occupied), both counts are halved
+// once 'window' is reached, so their ratio follows the recent observations (a
+// parked car leaving, a free space becoming occupied)
+static inline void count_observation(uint16_t &count, uint16_t &other,
+                                     unsigned int window) {
+  ++count;
+
+  if (static_cast<unsigned int>(count) + other >= window) {
+    count /= 2;
+    other /= 2;
+  }
+}
+
+// Walk the cells crossed by the beam from 'origin' to 'end' (Amanatides & Woo
+// traversal), they are counted as free, and the end cell as occupied
+void NDTFrame::s_trace_free_space(const Vector2d &origin,
+                                  const Vector2d &end) {
+  auto window = std::min(this->s_config.dynamicFilter.window,
+                         static_cast<unsigned int>(UINT16_MAX));
+  double ox = (origin.x() + this->width / 2.) / this->cell_side,
+         oy = (origin.y() + this->height / 2.) / this->cell_side,
+         ex = (end.x() + this->width / 2.) / this->cell_side,
+         ey = (end.y() + this->height / 2.) / this->cell_side, dx = ex - ox,
+         dy = ey - oy;
+  auto cx = static_cast<int>(floor(ox)), cy = static_cast<int>(floor(oy));
+  auto end_cx = static_cast<int>(floor(ex)),
+       end_cy = static_cast<int>(floor(ey));
+  int step_x = dx > 0. ? 1 : -1, step_y = dy > 0. ? 1 : -1;
+  double t_delta_x = dx != 0. ? fabs(1. / dx) : INFINITY,
+         t_delta_y = dy != 0. ? fabs(1. / dy) : INFINITY,
+         t_max_x = dx != 0. ? (dx > 0. ? cx + 1 - ox : ox - cx) * t_delta_x
+                            : INFINITY,
+         t_max_y = dy != 0. ? (dy > 0. ? cy + 1 - oy : oy - cy) * t_delta_y
+                            : INFINITY;
+  int steps = abs(end_cx - cx) + abs(end_cy - cy);
+
+  for (int i = 0; i < steps; ++i) {
+    if (cx >= 0 && cx < this->widthNumOfCells && cy >= 0 &&
+        cy < this->heightNumOfCells) {
+      auto index = static_cast<size_t>(cx + this->widthNumOfCells * cy);
+      count_observation(this->s_misses[index], this->s_hits[index], window);
+    }
+
+    if (t_max_x < t_max_y) {
+      t_max_x += t_delta_x;
+      cx += step_x;
+    } else {
+      t_max_y += t_delta_y;
+      cy += step_y;
+    }
+  }
+
+  int end_index =
+      this->getCellIndex(end, this->widthNumOfCells, this->cell_side);
+
+  if (-1 != end_index) {
+    auto index = static_cast<size_t>(end_index);
+    count_observation(this->s_hits[index], this->s_misses[index], window);
+  }
 }
 
 void NDTFrame::addPose(double timestamp, const Vector3d &pose,
@@ -233,6 +882,19 @@ void NDTFrame::resetCells() {
   auto n = static_cast<unsigned int>(this->cells.size());
   for (unsigned int i = 0; i < n; ++i)
     this->cells[i].reset();
+
+  // The per cell state of the filters is reset with the cells
+  std::fill(this->s_hits.begin(), this->s_hits.end(), 0);
+  std::fill(this->s_misses.begin(), this->s_misses.end(), 0);
+  std::fill(this->s_last_seen.begin(), this->s_last_seen.end(), this->s_time);
+  this->s_spilled.clear();
+
+  for (auto i : this->s_dirty)
+    this->s_dirty_flags[i] = 0;
+  this->s_dirty.clear();
+
+  this->s_rebuild_match_cells = true;
+  this->built = false;
 }
 
 // Add the given point 'pt' to it's corresponding cell
@@ -245,6 +907,7 @@ void NDTFrame::addPoint(Vector2d &point) {
   if (-1 != cell_index) {
     // And then, append the point to its cell points list
     this->cells[static_cast<size_t>(cell_index)].addPoint(point);
+    this->markDirty(static_cast<unsigned int>(cell_index));
 
     this->built =
         false; // Set 'built' flag to false to rebuild the cell if needed
@@ -278,8 +941,46 @@ int NDTFrame::getCellIndex(Vector2d point, int grid_width, double cell_side) {
   return -1;
 }
 
+// Run the configured optimizer with the given loss
+template <typename Loss>
+static Vector3d optimize(const NDTPSOConfig &config, Vector3d initial_guess,
+                         NDTFrame *ref_frame, const NDTFrame *const new_frame,
+                         const Array3d &deviation, OptimizationInfo *info) {
+  switch (config.optimizer) {
+  case Optimizer::CMAES:
+    return cmaes_optimization<Loss>(std::move(initial_guess), ref_frame,
+                                    new_frame, deviation, config.cmaesConfig,
+                                    info);
+  case Optimizer::DE:
+    return de_optimization<Loss>(std::move(initial_guess), ref_frame,
+                                 new_frame, deviation, config.deConfig, info);
+  default:
+    return pso_optimization<Loss>(std::move(initial_guess), ref_frame,
+                                  new_frame, deviation, config.psoConfig, info);
+  }
+}
+
+template <typename Loss>
+static Vector3d optimize_gated(const NDTPSOConfig &config,
+                               Vector3d initial_guess, NDTFrame *ref_frame,
+                               const NDTFrame *const new_frame,
+                               const Array3d &deviation,
+                               OptimizationInfo *info) {
+  return config.outlierGating
+             ? optimize<GatedLoss<Loss>>(config, std::move(initial_guess),
+                                         ref_frame, new_frame, deviation, info)
+             : optimize<Loss>(config, std::move(initial_guess), ref_frame,
+                              new_frame, deviation, info);
+}
+
+// When 'covariance' is given, it is estimated from the inverse of the NDT
+// score Hessian at the optimum, or from the spread of the final population
+// when the Hessian isn't positive definite (one extra cost evaluation).
+// The 'quality' uses the same evaluation, the degeneracy is measured on the
+// translation only, as a featureless corridor lets the pose slide along it
 Vector3d NDTFrame::align(Vector3d initial_guess,
-                         const NDTFrame *const new_frame) {
+                         const NDTFrame *const new_frame,
+                         Matrix3d *covariance, MatchQuality *quality) {
   // Used to UNIFORMLY distribute the initial particles
   Vector3d deviation = this->s_iter < 2
                            ? Vector3d(.1, .1, 3.1415E-3)
@@ -287,8 +988,59 @@ Vector3d NDTFrame::align(Vector3d initial_guess,
 
   ++this->s_iter;
 
-  auto pose = pso_optimization(std::move(initial_guess), this, new_frame,
-                               std::move(deviation));
+  Vector3d pose;
+  OptimizationInfo info;
+
+  // The loss is a template parameter, select it once per scan
+  switch (this->s_config.loss) {
+  case NDTLoss::Huber:
+    pose = optimize_gated<HuberLoss>(this->s_config, std::move(initial_guess),
+                                     this, new_frame, deviation, &info);
+    break;
+  case NDTLoss::Cauchy:
+    pose = optimize_gated<CauchyLoss>(this->s_config, std::move(initial_guess),
+                                      this, new_frame, deviation, &info);
+    break;
+  default:
+    pose = optimize_gated<GaussianLoss>(this->s_config,
+                                        std::move(initial_guess), this,
+                                        new_frame, deviation, &info);
+  }
+
+  ScoreDerivatives derivatives;
+
+  if (covariance || quality)
+    derivatives = score_derivatives(pose, this, new_frame);
+
+  if (quality) {
+    SelfAdjointEigenSolver<Matrix2d> solver(
+        derivatives.hessian.topLeftCorner<2, 2>());
+    Vector2d eigenvals = solver.eigenvalues();
+    auto points = static_cast<double>(std::max(1u, derivatives.points));
+    auto &thresholds = this->s_config.qualityConfig;
+
+    quality->score = -derivatives.cost / points;
+    quality->inlier_ratio = derivatives.inliers / points;
+    quality->degeneracy =
+        eigenvals[1] > 0. ? std::max(0., eigenvals[0]) / eigenvals[1] : 0.;
+    quality->good = (quality->score >= thresholds.min_score) &&
+                    (quality->inlier_ratio >= thresholds.min_inlier_ratio) &&
+                    (quality->degeneracy >= thresholds.min_degeneracy);
+  }
+
+  if (covariance) {
+    SelfAdjointEigenSolver<Matrix3d> solver(derivatives.hessian);
+    Vector3d eigenvals = solver.eigenvalues();
+
+    if ((eigenvals[0] > 0.) && (eigenvals[0] > 1E-6 * eigenvals[2]))
+      *covariance = solver.eigenvectors() *
+                    eigenvals.cwiseInverse().asDiagonal() *
+                    solver.eigenvectors().transpose();
+    else
+      *covariance = info.spread;
+
+    *covariance *= this->s_config.covarianceScale;
+  }
 
 #if TRANSFORM_POSE_AFTER_ALIGN
   pose -= this->s_trans;
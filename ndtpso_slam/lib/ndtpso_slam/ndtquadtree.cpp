@@ -0,0 +1,202 @@
+#include "ndtpso_slam/ndtquadtree.h"
+#include <eigen3/Eigen/Eigenvalues>
+
+NDTQuadTree::NDTQuadTree(QuadTreeConfig config, CullingConfig culling)
+    : s_config(config), s_culling(culling) {}
+
+void NDTQuadTree::update(const vector<NDTCell> &cells, unsigned int grid_width,
+                         double cell_side, double x_min, double y_min) {
+  if (this->s_roots.size() != cells.size() ||
+      this->s_grid_width != grid_width || this->s_cell_side != cell_side) {
+    this->s_grid_width = grid_width;
+    this->s_cell_side = cell_side;
+    this->s_nodes.clear();
+    this->s_roots.assign(cells.size(), -1);
+    this->s_sizes.assign(cells.size(), 0);
+    this->s_counts.assign(cells.size(), 0);
+    this->s_means.assign(cells.size(), Vector2d::Zero());
+    this->s_garbage = 0;
+  }
+
+  this->s_x_min = x_min;
+  this->s_y_min = y_min;
+
+  vector<Vector2d> points;
+
+  for (size_t i = 0; i < cells.size(); ++i) {
+    auto &cell = cells[i];
+    size_t count = 0;
+
+    if (cell.created) {
+      for (auto &cell_points : cell.points)
+        count += cell_points.size();
+    }
+
+    // A cell with the same points count and mean is considered unchanged
+    if (count == this->s_counts[i] &&
+        (0 == count || cell.mean == this->s_means[i]))
+      continue;
+
+    this->s_garbage += static_cast<size_t>(this->s_sizes[i]);
+    this->s_counts[i] = count;
+    this->s_means[i] = cell.mean;
+    this->s_roots[i] = -1;
+    this->s_sizes[i] = 0;
+
+    if (0 == count)
+      continue;
+
+    points.clear();
+    for (auto &cell_points : cell.points)
+      points.insert(points.end(), cell_points.begin(), cell_points.end());
+
+    auto root = this->s_nodes.size();
+    this->s_nodes.emplace_back();
+    this->s_build_node(
+        root, points,
+        Vector2d(x_min + (i % grid_width) * cell_side,
+                 y_min + (i / grid_width) * cell_side),
+        cell_side);
+    this->s_roots[i] = static_cast<int32_t>(root);
+    this->s_sizes[i] = static_cast<int32_t>(this->s_nodes.size() - root);
+  }
+
+  if (this->s_garbage > this->s_nodes.size() / 2)
+    this->s_compact();
+}
+
+double NDTQuadTree::s_build_node(size_t node, vector<Vector2d> &points,
+                                 const Vector2d &corner, double size) {
+  auto count = points.size();
+
+  if (count < 3)
+    return 0.;
+
+  Vector2d mean = Vector2d::Zero();
+  for (auto &point : points)
+    mean += point;
+  mean /= count;
+
+  Matrix2d covar = Matrix2d::Zero();
+  for (auto &point : points)
+    covar += (point - mean) * (point - mean).transpose();
+  covar /= count;
+
+  SelfAdjointEigenSolver<Matrix2d> solver(covar);
+  Vector2d eigenvals = solver.eigenvalues(); // Increasing order
+  double thickness = sqrt(std::max(0., eigenvals[0]));
+
+  // Same regularization of the flat distributions as the grid cells
+  double determinant = (eigenvals[0] < .001 * eigenvals[1])
+                           ? .001 * eigenvals[1] * eigenvals[1]
+                           : covar.determinant();
+
+  // Culled and weighted as the grid cells (see NDTFrame::build)
+  double condition =
+      eigenvals[1] > 0. ? std::max(0., eigenvals[0]) / eigenvals[1] : 0.;
+  double weight = (this->s_culling.full_points > 0.)
+                      ? std::min(1., count / this->s_culling.full_points)
+                      : 1.;
+
+  if (count < this->s_culling.min_points ||
+      condition < this->s_culling.min_condition)
+    weight = 0.;
+
+  {
+    auto &current = this->s_nodes[node];
+    current.mean = mean;
+    current.inv_covar << covar(1, 1) / determinant,
+        -covar(0, 1) / determinant, -covar(1, 0) / determinant,
+        covar(0, 0) / determinant;
+    current.weight = weight;
+    current.built = true;
+  }
+
+  bool bad_fit = thickness > this->s_config.max_thickness;
+
+  if (size / 2. < this->s_config.min_cell_side ||
+      (!bad_fit && count <= this->s_config.max_points))
+    return thickness;
+
+  // Split, the children are appended to the nodes (so the reference to the
+  // current node is not kept)
+  auto first_child = this->s_nodes.size();
+  double half = size / 2.;
+  vector<Vector2d> children_points[4];
+
+  for (auto &point : points) {
+    int child = (point.x() >= corner.x() + half) +
+                2 * (point.y() >= corner.y() + half);
+    children_points[child].push_back(point);
+  }
+
+  this->s_nodes.resize(first_child + 4);
+  this->s_nodes[node].first_child = static_cast<int32_t>(first_child);
+
+  double max_child_thickness = 0.;
+  bool all_leaves = true;
+
+  for (int child = 0; child < 4; ++child) {
+    max_child_thickness = std::max(
+        max_child_thickness,
+        this->s_build_node(first_child + child, children_points[child],
+                           corner + half * Vector2d(child % 2, child / 2),
+                           half));
+    all_leaves = all_leaves &&
+                 this->s_nodes[first_child + child].built &&
+                 (-1 == this->s_nodes[first_child + child].first_child);
+  }
+
+  // Uniform (split only for its number of points), and the children don't
+  // fit better, they are merged back
+  if (!bad_fit && all_leaves && max_child_thickness > .5 * thickness) {
+    this->s_nodes.resize(first_child);
+    this->s_nodes[node].first_child = -1;
+  }
+
+  return thickness;
+}
+
+// Move the subtrees to the start of the array, dropping the replaced ones
+void NDTQuadTree::s_compact() {
+  vector<Node> nodes;
+  nodes.reserve(this->s_nodes.size() - this->s_garbage);
+
+  for (size_t i = 0; i < this->s_roots.size(); ++i) {
+    if (-1 == this->s_roots[i])
+      continue;
+
+    auto offset = static_cast<int32_t>(nodes.size()) - this->s_roots[i];
+
+    for (int32_t j = 0; j < this->s_sizes[i]; ++j) {
+      nodes.push_back(this->s_nodes[static_cast<size_t>(this->s_roots[i] + j)]);
+
+      if (-1 != nodes.back().first_child)
+        nodes.back().first_child += offset;
+    }
+
+    this->s_roots[i] += offset;
+  }
+
+  this->s_nodes.swap(nodes);
+  this->s_garbage = 0;
+}
+
+size_t NDTQuadTree::numOfLeaves() const {
+  size_t leaves = 0;
+
+  for (size_t i = 0; i < this->s_roots.size(); ++i) {
+    for (int32_t j = 0; j < this->s_sizes[i]; ++j) {
+      auto &node = this->s_nodes[static_cast<size_t>(this->s_roots[i] + j)];
+      leaves += node.built && (-1 == node.first_child);
+    }
+  }
+
+  return leaves;
+}
+
+size_t NDTQuadTree::memoryUsage() const {
+  return this->s_nodes.capacity() * sizeof(Node) +
+         this->s_roots.size() * (2 * sizeof(int32_t) + sizeof(size_t) +
+                                 sizeof(Vector2d));
+}
@@ -0,0 +1,162 @@
+#include "ndtpso_slam/realtime.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+bool parse_cpu_list(const std::string &text, vector<int> &cpus) {
+  std::istringstream ranges(text);
+  std::string range;
+
+  cpus.clear();
+
+  while (std::getline(ranges, range, ',')) {
+    char *end;
+    long first = strtol(range.c_str(), &end, 10), last = first;
+
+    if (end == range.c_str())
+      return false;
+
+    if ('-' == *end) {
+      const char *start = end + 1;
+      last = strtol(start, &end, 10);
+
+      if (end == start)
+        return false;
+    }
+
+    if (*end || first < 0 || last < first || last >= CPU_SETSIZE)
+      return false;
+
+    for (long cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(static_cast<int>(cpu));
+  }
+
+  return !cpus.empty();
+}
+
+bool set_thread_scheduling(const std::string &policy, int priority) {
+  int id;
+
+  if ("other" == policy) {
+    id = SCHED_OTHER;
+    priority = 0;
+  } else if ("fifo" == policy) {
+    id = SCHED_FIFO;
+  } else if ("rr" == policy) {
+    id = SCHED_RR;
+  } else {
+    errno = EINVAL;
+    return false;
+  }
+
+  sched_param param;
+  param.sched_priority = priority;
+
+  // Returns the error instead of setting errno
+  int error = pthread_setschedparam(pthread_self(), id, &param);
+  errno = error;
+
+  return 0 == error;
+}
+
+bool set_thread_affinity(const vector<int> &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  for (auto cpu : cpus)
+    CPU_SET(cpu, &set);
+
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  errno = error;
+
+  return 0 == error;
+}
+
+vector<std::string> apply_realtime(const RealTimeConfig &config,
+                                   int n_threads) {
+  vector<std::string> failures;
+  vector<int> ingestion_cpus, worker_cpus;
+
+  auto failed = [&failures](const std::string &what) {
+    failures.push_back(what + ": " + strerror(errno));
+  };
+
+  std::string policy = config.policy;
+
+  if ("other" != policy && "fifo" != policy && "rr" != policy) {
+    failures.push_back("Unknown scheduling policy \"" + policy + "\"");
+    policy = "other";
+  }
+
+  if (!config.ingestion_cpus.empty() &&
+      !parse_cpu_list(config.ingestion_cpus, ingestion_cpus))
+    failures.push_back("Bad ingestion CPU list \"" + config.ingestion_cpus +
+                       "\"");
+
+  if (!config.worker_cpus.empty() &&
+      !parse_cpu_list(config.worker_cpus, worker_cpus))
+    failures.push_back("Bad worker CPU list \"" + config.worker_cpus + "\"");
+
+  // The workers are pinned first, the ones created by this team inherit the
+  // current settings of the calling thread
+  if (n_threads > 1 && (!worker_cpus.empty() || "other" != policy)) {
+#pragma omp parallel num_threads(n_threads)
+    {
+      int worker = omp_get_thread_num() - 1;
+
+      if (worker >= 0) {
+        bool scheduled = "other" == policy ||
+                         set_thread_scheduling(policy, config.priority);
+        int scheduling_error = errno;
+        bool pinned =
+            worker_cpus.empty() ||
+            set_thread_affinity(
+                {worker_cpus[static_cast<size_t>(worker) %
+                             worker_cpus.size()]});
+        int affinity_error = errno;
+
+#pragma omp critical
+        {
+          if (!scheduled) {
+            errno = scheduling_error;
+            failed("Scheduling of the worker " + std::to_string(worker + 1));
+          }
+
+          if (!pinned) {
+            errno = affinity_error;
+            failed("Affinity of the worker " + std::to_string(worker + 1));
+          }
+        }
+      }
+    }
+  }
+
+  if ("other" != policy && !set_thread_scheduling(policy, config.priority))
+    failed("Scheduling of the ingestion thread");
+
+  if (!ingestion_cpus.empty() && !set_thread_affinity(ingestion_cpus))
+    failed("Affinity of the ingestion thread");
+
+  if (config.lock_memory) {
+    // Unprivileged, the allocations above RLIMIT_MEMLOCK would fail once the
+    // future pages are locked: only the current ones (the maps) are, then
+    rlimit limit;
+    bool future = 0 == geteuid() || (0 == getrlimit(RLIMIT_MEMLOCK, &limit) &&
+                                     RLIM_INFINITY == limit.rlim_cur);
+
+    if (0 != mlockall(MCL_CURRENT | (future ? MCL_FUTURE : 0)))
+      failed("Memory locking");
+    else if (!future)
+      failures.push_back("Memory locking: limited RLIMIT_MEMLOCK, the pages "
+                         "allocated later aren't locked");
+  }
+
+  return failures;
+}
@@ -0,0 +1,95 @@
+#include "ndtpso_slam/scanlog.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+bool load_scan_log(const char *filename, vector<ScanRecord> &records) {
+  std::ifstream log_file(filename);
+
+  if (!log_file) {
+    printf("%s: Cannot open file \"%s\"\n", __func__, filename);
+    return false;
+  }
+
+  std::string line;
+
+  while (std::getline(log_file, line)) {
+    if (line.empty() || '#' == line[0])
+      continue;
+
+    const char *ptr = line.c_str();
+    char *end;
+    double header[5];
+    bool valid = true;
+
+    for (auto &field : header) {
+      field = strtod(ptr, &end);
+      valid = valid && (end != ptr);
+      ptr = (',' == *end) ? end + 1 : end;
+    }
+
+    if (!valid)
+      continue;
+
+    ScanRecord record;
+    record.timestamp = header[0];
+    record.angle_min = static_cast<float>(header[1]);
+    record.angle_increment = static_cast<float>(header[2]);
+    record.range_max = static_cast<float>(header[3]);
+    record.time_increment = static_cast<float>(header[4]);
+
+    while (*ptr) {
+      float range = strtof(ptr, &end);
+
+      if (end == ptr)
+        break;
+
+      record.ranges.push_back(range);
+      ptr = (',' == *end) ? end + 1 : end;
+    }
+
+    records.push_back(std::move(record));
+  }
+
+  return !records.empty();
+}
+
+bool load_pose_log(const char *filename, vector<PoseRecord> &records) {
+  std::ifstream log_file(filename);
+
+  if (!log_file) {
+    printf("%s: Cannot open file \"%s\"\n", __func__, filename);
+    return false;
+  }
+
+  std::string line;
+
+  while (std::getline(log_file, line)) {
+    if (line.empty() || '#' == line[0])
+      continue;
+
+    const char *ptr = line.c_str();
+    char *end;
+    double fields[4];
+    bool valid = true;
+
+    for (auto &field : fields) {
+      field = strtod(ptr, &end);
+      valid = valid && (end != ptr);
+      ptr = (',' == *end) ? end + 1 : end;
+    }
+
+    if (!valid)
+      continue;
+
+    PoseRecord record;
+    record.timestamp = fields[0];
+    record.x = fields[1];
+    record.y = fields[2];
+    record.theta = fields[3];
+    records.push_back(record);
+  }
+
+  return !records.empty();
+}
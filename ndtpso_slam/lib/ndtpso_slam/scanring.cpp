@@ -0,0 +1,268 @@
+#include "ndtpso_slam/scanring.h"
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SCAN_RING_MAGIC 0x4e445452 // "NDTR"
+#define SCAN_RING_VERSION 1
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "The scan ring needs lock-free atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int),
+              "The futex word must be a 32 bits integer");
+
+// Shared (not process private) futex, the consumers are other processes
+static inline long futex(std::atomic<uint32_t> *word, int op, uint32_t value,
+                         const timespec *timeout = nullptr) {
+  return syscall(SYS_futex, reinterpret_cast<int *>(word), op,
+                 static_cast<int>(value), timeout, nullptr, 0);
+}
+
+ScanRing::ScanRing(const std::string &name, size_t max_ranges, size_t slots)
+    : s_name(name), s_producer(true) {
+  slots = std::max(size_t(2), slots);
+  size_t slot_size =
+      s_align(sizeof(Scan)) + s_align(max_ranges * sizeof(float));
+
+  this->s_size = s_align(sizeof(Header)) + slots * slot_size;
+
+  // Truncating a ring would pull the memory from under the consumers still
+  // mapping it (and sleeping on its futex), they reopen the new one
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+  if (-1 == fd) {
+    perror("Can't create the scan ring");
+    return;
+  }
+
+  struct stat info;
+  void *memory = MAP_FAILED;
+
+  if (0 == fstat(fd, &info) &&
+      0 == ftruncate(fd, static_cast<off_t>(this->s_size)))
+    memory = mmap(nullptr, this->s_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+
+  close(fd);
+
+  if (MAP_FAILED == memory) {
+    perror("Can't map the scan ring");
+    shm_unlink(name.c_str());
+    return;
+  }
+
+  // The segment is zero filled, the consumers ignore it until the magic is
+  // set
+  auto header = static_cast<Header *>(memory);
+  header->version = SCAN_RING_VERSION;
+  header->slots = static_cast<uint32_t>(slots);
+  header->max_ranges = static_cast<uint32_t>(max_ranges);
+  header->slot_size = slot_size;
+  new (&header->head) std::atomic<uint64_t>(0);
+  new (&header->writing) std::atomic<uint64_t>(0);
+  new (&header->notify) std::atomic<uint32_t>(0);
+  new (&header->waiters) std::atomic<uint32_t>(0);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = SCAN_RING_MAGIC;
+
+  this->s_header = header;
+  this->s_device = info.st_dev;
+  this->s_inode = info.st_ino;
+}
+
+ScanRing::ScanRing(const std::string &name) : s_name(name), s_producer(false) {
+  this->s_attach();
+}
+
+bool ScanRing::s_attach() {
+  // Read-write, the consumers update the futex word and the waiters count
+  int fd = shm_open(this->s_name.c_str(), O_RDWR, 0);
+
+  if (-1 == fd) {
+    // Only reported once, the producer may be restarting
+    if (!this->s_header)
+      perror("Can't open the scan ring");
+    return false;
+  }
+
+  struct stat info;
+  size_t size = 0;
+  void *memory = MAP_FAILED;
+
+  if (0 == fstat(fd, &info) &&
+      (!this->s_header || info.st_dev != this->s_device ||
+       info.st_ino != this->s_inode) &&
+      static_cast<size_t>(info.st_size) >= sizeof(Header)) {
+    size = static_cast<size_t>(info.st_size);
+    memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+
+  close(fd);
+
+  if (MAP_FAILED == memory) {
+    if (!this->s_header)
+      fprintf(stderr, "Can't map the scan ring \"%s\"\n",
+              this->s_name.c_str());
+    return false;
+  }
+
+  auto header = static_cast<Header *>(memory);
+  // The header is complete once the magic is seen (see the constructor)
+  bool ready = SCAN_RING_MAGIC == header->magic;
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  if (!ready || SCAN_RING_VERSION != header->version ||
+      s_align(sizeof(Header)) + header->slots * header->slot_size > size) {
+    if (!this->s_header)
+      fprintf(stderr, "The scan ring \"%s\" isn't ready\n",
+              this->s_name.c_str());
+    munmap(memory, size);
+    return false;
+  }
+
+  if (this->s_header)
+    munmap(this->s_header, this->s_size);
+
+  this->s_header = header;
+  this->s_size = size;
+  this->s_device = info.st_dev;
+  this->s_inode = info.st_ino;
+  // Only the scans published from now on
+  this->s_last = header->head.load(std::memory_order_acquire);
+
+  return true;
+}
+
+bool ScanRing::s_isMapped() const {
+  int fd = shm_open(this->s_name.c_str(), O_RDONLY, 0);
+
+  if (-1 == fd)
+    return false;
+
+  struct stat info;
+  bool mapped = 0 == fstat(fd, &info) && info.st_dev == this->s_device &&
+                info.st_ino == this->s_inode;
+  close(fd);
+
+  return mapped;
+}
+
+ScanRing::~ScanRing() {
+  if (!this->s_header)
+    return;
+
+  munmap(this->s_header, this->s_size);
+
+  // The consumers keep their mapping until they detach, the name may already
+  // be another producer's
+  if (this->s_producer && this->s_isMapped())
+    shm_unlink(this->s_name.c_str());
+}
+
+uint64_t ScanRing::publish(const Scan &scan, const float *ranges) {
+  if (!this->s_producer || !this->s_header)
+    return 0;
+
+  auto header = this->s_header;
+  uint64_t sequence = header->head.load(std::memory_order_relaxed) + 1;
+
+  // Announce the slot reuse before writing it (see 'valid')
+  header->writing.store(sequence, std::memory_order_relaxed);
+  // Full fence, the new ranges must not be seen before 'writing' is
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  char *memory = this->s_slot(sequence);
+  Scan slot_scan = scan;
+  slot_scan.count = std::min(scan.count, header->max_ranges);
+
+  *reinterpret_cast<Scan *>(memory) = slot_scan;
+  memcpy(memory + s_align(sizeof(Scan)), ranges,
+         slot_scan.count * sizeof(float));
+
+  header->head.store(sequence, std::memory_order_release);
+
+  // No system call when nobody sleeps
+  header->notify.fetch_add(1);
+  if (header->waiters.load() > 0)
+    futex(&header->notify, FUTEX_WAKE, INT_MAX);
+
+  return sequence;
+}
+
+uint64_t ScanRing::wait(int timeout_ms, const Scan *&scan,
+                        const float *&ranges) {
+  if (this->s_producer || !this->s_header)
+    return 0;
+
+  auto header = this->s_header;
+  timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    ++deadline.tv_sec;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  uint64_t head = header->head.load(std::memory_order_acquire);
+
+  while (head == this->s_last) {
+    header->waiters.fetch_add(1);
+    uint32_t notify = header->notify.load();
+    head = header->head.load(std::memory_order_acquire);
+
+    // The futex waits only if no scan came since 'notify' was read
+    if (head == this->s_last) {
+      timespec now, remaining;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+      remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (remaining.tv_nsec < 0) {
+        --remaining.tv_sec;
+        remaining.tv_nsec += 1000000000L;
+      }
+
+      if (remaining.tv_sec < 0) {
+        header->waiters.fetch_sub(1);
+        return 0;
+      }
+
+      futex(&header->notify, FUTEX_WAIT, notify, &remaining);
+      head = header->head.load(std::memory_order_acquire);
+    }
+
+    header->waiters.fetch_sub(1);
+  }
+
+  const char *memory = this->s_slot(head);
+  scan = reinterpret_cast<const Scan *>(memory);
+  ranges = reinterpret_cast<const float *>(memory + s_align(sizeof(Scan)));
+  this->s_last = head;
+
+  return head;
+}
+
+bool ScanRing::valid(uint64_t sequence) const {
+  if (!this->s_header || 0 == sequence)
+    return false;
+
+  // Orders the reads of the slot before the check
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  return this->s_header->writing.load(std::memory_order_relaxed) <
+         sequence + this->s_header->slots;
+}
+
+bool ScanRing::reopen() {
+  return !this->s_producer && this->s_header && this->s_attach();
+}
@@ -0,0 +1,237 @@
+#include "ndtpso_slam/shadowmatcher.h"
+#include "ndtpso_slam/core.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+
+bool ShadowMatcher::canChange(const std::string &parameter) {
+  static const char *const names[] = {"cell_side", "frame_size", "quadtree",
+                                      "quality_blend"};
+  static const char *const prefixes[] = {"quadtree_", "cull_", "dynamic_",
+                                         "stationary_"};
+
+  for (auto name : names) {
+    if (parameter == name)
+      return false;
+  }
+
+  for (auto prefix : prefixes) {
+    if (0 == parameter.compare(0, strlen(prefix), prefix))
+      return false;
+  }
+
+  return true;
+}
+
+ShadowMatcher::ShadowMatcher(ShadowConfig config)
+    : s_config(std::move(config)) {
+  auto &conf = this->s_config.matcher;
+
+  this->s_scan = new NDTFrame(Vector3d::Zero(), conf.frame_size,
+                              conf.frame_size, conf.frame_size, false);
+
+  if (!this->s_config.log_file.empty()) {
+    this->s_log = fopen(this->s_config.log_file.c_str(), "w");
+
+    if (this->s_log)
+      fprintf(this->s_log,
+              "timestamp,production_x,production_y,production_theta,"
+              "shadow_x,shadow_y,shadow_theta,translation,rotation,"
+              "production_cost,shadow_cost,production_ms,shadow_ms,"
+              "production_good,shadow_good\n");
+    else
+      fprintf(stderr, "Can't open the shadow log \"%s\"\n",
+              this->s_config.log_file.c_str());
+  }
+
+  this->s_thread = std::thread(&ShadowMatcher::s_run, this);
+}
+
+ShadowMatcher::~ShadowMatcher() {
+  {
+    std::lock_guard<std::mutex> lock(this->s_mutex);
+    this->s_stop = true;
+  }
+  this->s_wake.notify_one();
+  this->s_thread.join();
+
+  if (this->s_log)
+    fclose(this->s_log);
+
+  delete this->s_map;
+  delete this->s_scan;
+}
+
+bool ShadowMatcher::capture(Matcher &production, const ScanView &scan) {
+  {
+    std::lock_guard<std::mutex> lock(this->s_mutex);
+
+    if (State::Idle != this->s_state) {
+      ++this->s_stats.skipped;
+      return false;
+    }
+  }
+
+  // Idle, the shadow thread doesn't use the inputs
+  if (!production.snapshot(this->s_snapshot))
+    return false;
+
+  this->s_ranges.resize(scan.count);
+  for (size_t i = 0; i < scan.count; ++i)
+    this->s_ranges[i] = scan.ranges[i * scan.stride];
+
+  this->s_view = scan;
+  this->s_view.ranges = this->s_ranges.data();
+  this->s_view.stride = 1;
+
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+  this->s_state = State::Captured;
+
+  return true;
+}
+
+void ShadowMatcher::submit(const MatchResult &production,
+                           double production_ms) {
+  {
+    std::lock_guard<std::mutex> lock(this->s_mutex);
+
+    if (State::Captured != this->s_state)
+      return;
+
+    this->s_production = production;
+    this->s_production_ms = production_ms;
+    this->s_state = State::Pending;
+  }
+
+  this->s_wake.notify_one();
+}
+
+void ShadowMatcher::cancel() {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  if (State::Captured == this->s_state)
+    this->s_state = State::Idle;
+}
+
+void ShadowMatcher::setSensorTransform(const Vector3d &trans) {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  this->s_scan->setTrans(trans);
+}
+
+ShadowMatcher::Stats ShadowMatcher::stats() {
+  std::lock_guard<std::mutex> lock(this->s_mutex);
+
+  return this->s_stats;
+}
+
+void ShadowMatcher::s_run() {
+  // The niceness is per thread on Linux (and inherited by the optimizers'
+  // threads started from this one)
+  setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)),
+              this->s_config.nice);
+
+  std::unique_lock<std::mutex> lock(this->s_mutex);
+
+  for (;;) {
+    this->s_wake.wait(lock, [this]() {
+      return this->s_stop || State::Pending == this->s_state;
+    });
+
+    if (this->s_stop)
+      return;
+
+    lock.unlock();
+    Comparison comparison;
+    this->s_match(comparison);
+    lock.lock();
+
+    auto &stats = this->s_stats;
+    ++stats.matched;
+    stats.production_bad += comparison.production_good ? 0 : 1;
+    stats.shadow_bad += comparison.shadow_good ? 0 : 1;
+    stats.translation_sum += comparison.translation;
+    stats.rotation_sum += comparison.rotation;
+    stats.max_translation =
+        std::max(stats.max_translation, comparison.translation);
+    stats.max_rotation = std::max(stats.max_rotation, comparison.rotation);
+    stats.cost_gain_sum += comparison.production_cost - comparison.shadow_cost;
+    stats.production_ms_sum += comparison.production_ms;
+    stats.shadow_ms_sum += comparison.shadow_ms;
+
+    this->s_state = State::Idle;
+  }
+}
+
+void ShadowMatcher::s_match(Comparison &comparison) {
+  auto start = std::chrono::high_resolution_clock::now();
+  auto &snapshot = this->s_snapshot;
+
+  // The geometry of the production map is fixed, the frame is only created
+  // once
+  if (!this->s_map || this->s_map->width != snapshot.width ||
+      this->s_map->height != snapshot.height ||
+      this->s_map->cell_side != snapshot.cell_side) {
+    delete this->s_map;
+    this->s_map = new NDTFrame(snapshot.width, snapshot.height,
+                               snapshot.cell_side, this->s_config.matcher.ndt);
+  }
+
+  // Same search as the production match (the shadow skips scans, its own
+  // motions would be larger)
+  this->s_map->attach(snapshot.match_index.data(),
+                      snapshot.match_cells.data());
+  this->s_map->setSearch(snapshot.align_count, snapshot.last_motion);
+
+  this->s_scan->resetCells();
+  this->s_scan->loadLaser(
+      this->s_view.ranges, this->s_view.count, 1, this->s_view.angle_min,
+      this->s_view.angle_increment, this->s_view.range_max,
+      this->s_view.time_increment,
+      this->s_config.matcher.deskew ? snapshot.velocity : Vector3d::Zero());
+
+  Vector3d origin(snapshot.origin.x(), snapshot.origin.y(), 0.);
+  MatchQuality quality;
+  // The raw match, without the motion prediction of the bad ones
+  Vector3d pose = this->s_map->align(snapshot.pose - origin, this->s_scan,
+                                     nullptr, &quality) +
+                  origin;
+
+  auto finish = std::chrono::high_resolution_clock::now();
+  auto &production = this->s_production;
+
+  comparison.timestamp = this->s_view.timestamp;
+  comparison.production_pose = production.pose;
+  comparison.shadow_pose = pose;
+
+  Vector3d difference = pose - production.pose;
+  comparison.translation = difference.head<2>().norm();
+  comparison.rotation = fabs(atan2(sin(difference.z()), cos(difference.z())));
+  comparison.production_cost =
+      cost_function(production.pose - origin, this->s_map, this->s_scan);
+  comparison.shadow_cost = cost_function(pose - origin, this->s_map,
+                                         this->s_scan);
+  comparison.production_ms = this->s_production_ms;
+  comparison.shadow_ms =
+      std::chrono::duration<double, std::milli>(finish - start).count();
+  comparison.production_good = production.quality.good;
+  comparison.shadow_good = quality.good;
+
+  if (this->s_log) {
+    fprintf(this->s_log,
+            "%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.4f,%.4f,%.3f,"
+            "%.3f,%d,%d\n",
+            comparison.timestamp, production.pose.x(), production.pose.y(),
+            production.pose.z(), pose.x(), pose.y(), pose.z(),
+            comparison.translation, comparison.rotation,
+            comparison.production_cost, comparison.shadow_cost,
+            comparison.production_ms, comparison.shadow_ms,
+            comparison.production_good, comparison.shadow_good);
+    fflush(this->s_log);
+  }
+}
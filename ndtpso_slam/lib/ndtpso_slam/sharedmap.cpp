@@ -0,0 +1,254 @@
+#include "ndtpso_slam/sharedmap.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHARED_MAP_MAGIC 0x4e445453 // "NDTS"
+#define SHARED_MAP_VERSION 1
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "The shared map needs lock-free 64 bits atomics");
+
+SharedMap::SharedMap(const std::string &name, const NDTFrame *map)
+    : s_name(name), s_owner(true) {
+  size_t num_cells = map->numOfCells,
+         cells_offset = s_align(sizeof(Slot)) +
+                        s_align(num_cells * sizeof(int32_t)),
+         slot_size = cells_offset + s_align(num_cells * sizeof(MatchCell));
+
+  this->s_size = s_align(sizeof(Header)) + SHARED_MAP_SLOTS * slot_size;
+
+  // Truncating a segment would pull the memory from under the readers still
+  // mapping it, they keep the old one until they switch to the new one
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+  if (-1 == fd) {
+    perror("Can't create the shared map");
+    return;
+  }
+
+  struct stat info;
+  void *memory = MAP_FAILED;
+
+  if (0 == fstat(fd, &info) &&
+      0 == ftruncate(fd, static_cast<off_t>(this->s_size)))
+    memory = mmap(nullptr, this->s_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+
+  close(fd);
+
+  if (MAP_FAILED == memory) {
+    perror("Can't map the shared map");
+    shm_unlink(name.c_str());
+    return;
+  }
+
+  // The segment is zero filled, the readers ignore it until the magic is set
+  auto header = static_cast<Header *>(memory);
+  header->version = SHARED_MAP_VERSION;
+  header->match_cell_size = sizeof(MatchCell);
+  header->slots = SHARED_MAP_SLOTS;
+  header->width = map->width;
+  header->height = map->height;
+  header->num_cells = map->numOfCells;
+  header->cell_side = map->cell_side;
+  header->slot_size = slot_size;
+  header->cells_offset = cells_offset;
+  new (&header->epoch) std::atomic<uint64_t>(0);
+  new (&header->writing) std::atomic<uint64_t>(0);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = SHARED_MAP_MAGIC;
+
+  this->s_header = header;
+  this->s_device = info.st_dev;
+  this->s_inode = info.st_ino;
+}
+
+SharedMap::SharedMap(const std::string &name, NDTPSOConfig config)
+    : s_name(name), s_owner(false) {
+  if (!this->s_attach())
+    return;
+
+  this->s_frame =
+      new NDTFrame(this->s_header->width, this->s_header->height,
+                   this->s_header->cell_side, std::move(config));
+}
+
+bool SharedMap::s_attach() {
+  int fd = shm_open(this->s_name.c_str(), O_RDONLY, 0);
+
+  if (-1 == fd) {
+    // Only reported once, the owner may be restarting
+    if (!this->s_header)
+      perror("Can't open the shared map");
+    return false;
+  }
+
+  struct stat info;
+  size_t size = 0;
+  void *memory = MAP_FAILED;
+
+  if (0 == fstat(fd, &info) &&
+      (!this->s_header || info.st_dev != this->s_device ||
+       info.st_ino != this->s_inode) &&
+      static_cast<size_t>(info.st_size) >= sizeof(Header)) {
+    size = static_cast<size_t>(info.st_size);
+    memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+
+  close(fd);
+
+  if (MAP_FAILED == memory) {
+    if (!this->s_header)
+      fprintf(stderr, "Can't map the shared map \"%s\"\n",
+              this->s_name.c_str());
+    return false;
+  }
+
+  auto header = static_cast<Header *>(memory);
+  // Pairs with the release fence before the magic is set, the rest of the
+  // header is read after it
+  bool ready = SHARED_MAP_MAGIC == header->magic;
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  if (!ready || SHARED_MAP_VERSION != header->version ||
+      sizeof(MatchCell) != header->match_cell_size ||
+      s_align(sizeof(Header)) + header->slots * header->slot_size > size) {
+    if (!this->s_header)
+      fprintf(stderr,
+              "The shared map \"%s\" isn't ready or comes from another "
+              "build\n",
+              this->s_name.c_str());
+    munmap(memory, size);
+    return false;
+  }
+
+  // The frame of the reader keeps the geometry of the first segment
+  if (this->s_frame &&
+      (header->width != this->s_header->width ||
+       header->height != this->s_header->height ||
+       header->cell_side != this->s_header->cell_side)) {
+    fprintf(stderr,
+            "The new shared map \"%s\" has another geometry, ignored\n",
+            this->s_name.c_str());
+    munmap(memory, size);
+    return false;
+  }
+
+  if (this->s_header)
+    munmap(this->s_header, this->s_size);
+
+  this->s_header = header;
+  this->s_size = size;
+  this->s_device = info.st_dev;
+  this->s_inode = info.st_ino;
+  this->s_epoch = 0;
+
+  return true;
+}
+
+SharedMap::~SharedMap() {
+  delete this->s_frame;
+
+  if (!this->s_header)
+    return;
+
+  munmap(this->s_header, this->s_size);
+
+  // The readers keep their mapping until they detach, the name may already
+  // be another owner's
+  if (this->s_owner && this->s_isMapped())
+    shm_unlink(this->s_name.c_str());
+}
+
+bool SharedMap::s_isMapped() const {
+  int fd = shm_open(this->s_name.c_str(), O_RDONLY, 0);
+
+  if (-1 == fd)
+    return false;
+
+  struct stat info;
+  bool mapped = 0 == fstat(fd, &info) && info.st_dev == this->s_device &&
+                info.st_ino == this->s_inode;
+  close(fd);
+
+  return mapped;
+}
+
+uint64_t SharedMap::publish(NDTFrame *map, const Vector2d &origin) {
+  if (!this->s_owner || !this->s_header ||
+      map->numOfCells != this->s_header->num_cells)
+    return 0;
+
+  if (!map->built)
+    map->build();
+
+  auto header = this->s_header;
+  uint64_t epoch = header->epoch.load(std::memory_order_relaxed) + 1;
+
+  // Announce the slot reuse before writing it (the readers of the snapshot
+  // 'epoch - slots' check this after reading)
+  header->writing.store(epoch, std::memory_order_relaxed);
+  // Ordered before the writes of the slot (a release fence would only order
+  // the writes before it)
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  char *memory = this->s_slot(epoch);
+  auto slot = reinterpret_cast<Slot *>(memory);
+  auto num_match_cells = static_cast<uint32_t>(map->matchCells.size());
+
+  slot->origin_x = origin.x();
+  slot->origin_y = origin.y();
+  slot->num_match_cells = num_match_cells;
+  memcpy(memory + s_align(sizeof(Slot)), map->matchIndex(),
+         header->num_cells * sizeof(int32_t));
+  memcpy(memory + header->cells_offset, map->matchCells.data(),
+         num_match_cells * sizeof(MatchCell));
+
+  header->epoch.store(epoch, std::memory_order_release);
+
+  return epoch;
+}
+
+uint64_t SharedMap::acquire() {
+  if (this->s_owner || !this->s_header)
+    return 0;
+
+  uint64_t epoch = this->s_header->epoch.load(std::memory_order_acquire);
+
+  // No new snapshot: the owner may have been restarted on a new segment
+  if (epoch == this->s_epoch && this->s_attach())
+    epoch = this->s_header->epoch.load(std::memory_order_acquire);
+
+  this->s_epoch = epoch;
+
+  if (0 == epoch)
+    return 0;
+
+  const char *memory = this->s_slot(epoch);
+  auto slot = reinterpret_cast<const Slot *>(memory);
+
+  this->s_origin = Vector2d(slot->origin_x, slot->origin_y);
+  this->s_frame->attach(
+      reinterpret_cast<const int32_t *>(memory + s_align(sizeof(Slot))),
+      reinterpret_cast<const MatchCell *>(memory +
+                                          this->s_header->cells_offset));
+
+  return epoch;
+}
+
+bool SharedMap::valid(uint64_t epoch) const {
+  if (!this->s_header || 0 == epoch)
+    return false;
+
+  // Orders the reads of the snapshot before the check
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  return this->s_header->writing.load(std::memory_order_relaxed) <
+         epoch + this->s_header->slots;
+}
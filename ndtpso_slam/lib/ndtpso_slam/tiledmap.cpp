@@ -0,0 +1,466 @@
+#include "ndtpso_slam/tiledmap.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sys/stat.h>
+
+// The view is moved when the robot is farther than this ratio of its size
+// from the center, the laser range should fit in the remaining half-size
+#define TILED_MAP_RECENTER_RATIO .25
+
+static inline int floor_div(int a, int b) {
+  return (a >= 0) ? (a / b) : -((-a + b - 1) / b);
+}
+
+TiledMap::TiledMap(std::string directory, double tile_size, size_t cache_size)
+    : s_directory(std::move(directory)), s_tile_size(tile_size),
+      s_cache_size(std::max(size_t(1), cache_size)) {
+  mkdir(this->s_directory.c_str(), 0755); // May already exist
+  this->s_io_thread = std::thread(&TiledMap::s_io_loop, this);
+}
+
+TiledMap::~TiledMap() {
+  {
+    std::lock_guard<std::mutex> lock(this->s_mutex);
+
+    // The modified tiles are written before stopping, not the pending loads
+    for (auto &cached : this->s_cache) {
+      if (cached.second.dirty)
+        this->s_jobs.push_back(Job{JobType::Write, cached.first,
+                                   cached.second.tile, cached.second.partial});
+    }
+
+    this->s_stop = true;
+  }
+
+  this->s_jobs_cond.notify_one();
+  this->s_io_thread.join();
+}
+
+bool TiledMap::follow(NDTFrame *view, const Vector3d &pose,
+                      const Vector3d &motion) {
+  Vector2d position = pose.head<2>();
+  bool moved = false;
+
+  if (!this->s_initialized) {
+    this->s_tile_cells = std::max(
+        1, static_cast<int>(lround(this->s_tile_size / view->cell_side)));
+    this->s_tile_size = this->s_tile_cells * view->cell_side;
+    this->s_origin =
+        (position / this->s_tile_size).array().round() * this->s_tile_size;
+    this->s_initialized = moved = true;
+
+    // The view and the prefetched tiles must fit in the cache
+    size_t min_cache_size = 2 * this->s_view_tiles(view, this->s_origin).size();
+
+    if (this->s_cache_size < min_cache_size) {
+      fprintf(stderr, "Tiled map cache too small, using %lu tiles\n",
+              static_cast<unsigned long>(min_cache_size));
+      std::lock_guard<std::mutex> lock(this->s_mutex);
+      this->s_cache_size = min_cache_size;
+    }
+  } else if ((position - this->s_origin).lpNorm<Infinity>() >
+             TILED_MAP_RECENTER_RATIO * view->width) {
+    // The whole view goes back to the tiles, then it's filled again around
+    // its new center, mostly from the tiles just exported (already in memory)
+    this->s_export(view);
+    view->resetCells();
+    this->s_imported.clear();
+    this->s_origin =
+        (position / this->s_tile_size).array().round() * this->s_tile_size;
+    moved = true;
+  }
+
+  // The view after the next move, if the robot keeps its direction
+  Vector2d ahead = this->s_origin;
+
+  if (!motion.head<2>().isZero(1e-6))
+    ahead = ((position + motion.head<2>().normalized() *
+                            (TILED_MAP_RECENTER_RATIO * view->width)) /
+             this->s_tile_size)
+                .array()
+                .round() *
+            this->s_tile_size;
+
+  {
+    std::lock_guard<std::mutex> lock(this->s_mutex);
+
+    for (auto &key : this->s_view_tiles(view, this->s_origin))
+      this->s_request(key);
+
+    if (ahead != this->s_origin) {
+      for (auto &key : this->s_view_tiles(view, ahead))
+        this->s_request(key);
+    }
+  }
+
+  this->s_jobs_cond.notify_one();
+  this->sync(view);
+
+  return moved;
+}
+
+void TiledMap::sync(NDTFrame *view) {
+  if (!this->s_initialized)
+    return;
+
+  Vector2i base = this->s_view_base(view, this->s_origin);
+  vector<std::pair<TileKey, TilePtr>> ready;
+
+  {
+    std::lock_guard<std::mutex> lock(this->s_mutex);
+
+    for (auto &key : this->s_view_tiles(view, this->s_origin)) {
+      if (this->s_imported.count(key))
+        continue;
+
+      auto cached = this->s_cache.find(key);
+
+      if (this->s_cache.end() != cached && !cached->second.partial) {
+        this->s_touch(cached->second);
+        ready.emplace_back(key, cached->second.tile);
+      }
+    }
+  }
+
+  // Complete tiles are never modified in place, they can be read unlocked
+  for (auto &tile : ready) {
+    for (auto &tile_cell : *tile.second) {
+      int x = tile.first.x * this->s_tile_cells +
+              static_cast<int>(tile_cell.first) % this->s_tile_cells - base.x(),
+          y = tile.first.y * this->s_tile_cells +
+              static_cast<int>(tile_cell.first) / this->s_tile_cells - base.y();
+
+      if (x < 0 || y < 0 || x >= view->widthNumOfCells ||
+          y >= view->heightNumOfCells)
+        continue;
+
+      auto index = static_cast<unsigned int>(y * view->widthNumOfCells + x);
+      auto &cell = view->cells[index];
+
+      // Cells created before the tile was loaded are newer, they are kept
+      if (!cell.created) {
+        cell = tile_cell.second;
+        cell.translate(-this->s_origin);
+        view->markDirty(index);
+      }
+    }
+
+    this->s_imported.insert(tile.first);
+  }
+
+  if (!ready.empty())
+    view->built = false;
+}
+
+void TiledMap::flush(const NDTFrame *view) {
+  if (this->s_initialized)
+    this->s_export(view);
+
+  std::unique_lock<std::mutex> lock(this->s_mutex);
+
+  for (auto &cached : this->s_cache) {
+    if (cached.second.dirty) {
+      this->s_jobs.push_back(Job{JobType::Write, cached.first,
+                                 cached.second.tile, cached.second.partial});
+      cached.second.dirty = false;
+    }
+  }
+
+  this->s_jobs_cond.notify_one();
+  this->s_idle_cond.wait(
+      lock, [this] { return this->s_jobs.empty() && !this->s_busy; });
+}
+
+// Copy the created cells of the view to the cache, the tiles of the view not
+// loaded yet are partial, they are completed with the ones on disk later
+void TiledMap::s_export(const NDTFrame *view) {
+  Vector2i base = this->s_view_base(view, this->s_origin);
+  std::unordered_map<TileKey, TilePtr, TileKeyHash> tiles;
+
+  // The imported tiles are replaced, even if their cells were all released
+  for (auto &key : this->s_imported)
+    tiles[key] = std::make_shared<Tile>();
+
+  for (unsigned int i = 0; i < view->numOfCells; ++i) {
+    if (!view->cells[i].created)
+      continue;
+
+    uint32_t index_in_tile;
+    Vector2i world_cell =
+        base + Vector2i(static_cast<int>(i % view->widthNumOfCells),
+                        static_cast<int>(i / view->widthNumOfCells));
+    auto &tile = tiles[this->s_tile_of(world_cell, index_in_tile)];
+
+    if (!tile)
+      tile = std::make_shared<Tile>();
+
+    tile->emplace_back(index_in_tile, view->cells[i]);
+    tile->back().second.translate(this->s_origin);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(this->s_mutex);
+
+    for (auto &tile : tiles) {
+      bool partial = !this->s_imported.count(tile.first);
+
+      if (partial) {
+        auto cached = this->s_cache.find(tile.first);
+
+        if (this->s_cache.end() != cached) {
+          s_merge_tiles(*tile.second, Tile(*cached->second.tile));
+          partial = cached->second.partial;
+        }
+      }
+
+      this->s_insert(tile.first, tile.second, true, partial);
+
+      if (partial && this->s_pending.insert(tile.first).second)
+        this->s_jobs.push_back(Job{JobType::Load, tile.first, nullptr, false});
+    }
+  }
+
+  this->s_jobs_cond.notify_one();
+}
+
+void TiledMap::s_io_loop() {
+  std::unique_lock<std::mutex> lock(this->s_mutex);
+
+  while (true) {
+    this->s_jobs_cond.wait(
+        lock, [this] { return this->s_stop || !this->s_jobs.empty(); });
+
+    if (this->s_jobs.empty())
+      break; // Stopped, and nothing left to write
+
+    Job job = std::move(this->s_jobs.front());
+    this->s_jobs.pop_front();
+
+    if (JobType::Load == job.type) {
+      if (this->s_stop) {
+        this->s_pending.erase(job.key);
+        continue;
+      }
+
+      // The tile is being written back, it's loaded after that
+      if (this->s_queuedWrite(job.key)) {
+        this->s_jobs.push_back(std::move(job));
+        continue;
+      }
+    }
+
+    this->s_busy = true;
+    lock.unlock();
+
+    Tile tile;
+
+    if (JobType::Load == job.type) {
+      this->s_read_tile(job.key, tile);
+    } else {
+      if (job.partial) {
+        Tile merged(*job.tile);
+        this->s_read_tile(job.key, tile);
+        s_merge_tiles(merged, std::move(tile));
+        this->s_write_tile(job.key, merged);
+      } else {
+        this->s_write_tile(job.key, *job.tile);
+      }
+    }
+
+    lock.lock();
+
+    if (JobType::Load == job.type) {
+      auto cached = this->s_cache.find(job.key);
+
+      if (this->s_cache.end() == cached && this->s_queuedWrite(job.key)) {
+        // Evicted (and queued for writing) while it was read, the file is
+        // stale: read again once written
+        this->s_jobs.push_back(std::move(job));
+      } else {
+        this->s_pending.erase(job.key);
+
+        if (this->s_cache.end() == cached) {
+          this->s_insert(job.key, std::make_shared<Tile>(std::move(tile)),
+                         false, false);
+        } else if (cached->second.partial) {
+          auto merged = std::make_shared<Tile>(*cached->second.tile);
+          s_merge_tiles(*merged, std::move(tile));
+          cached->second.tile = merged;
+          cached->second.partial = false;
+        }
+      }
+    }
+
+    this->s_busy = false;
+
+    if (this->s_jobs.empty())
+      this->s_idle_cond.notify_all();
+  }
+
+  this->s_idle_cond.notify_all();
+}
+
+std::string TiledMap::s_tile_path(const TileKey &key) const {
+  return this->s_directory + "/" + std::to_string(key.x) + "_" +
+         std::to_string(key.y) + ".tile";
+}
+
+// A tile file is the number of cells, then the (index, cell) pairs
+bool TiledMap::s_read_tile(const TileKey &key, Tile &tile) const {
+  FILE *file = fopen(this->s_tile_path(key).c_str(), "rb");
+
+  if (!file)
+    return false; // Never seen, empty
+
+  uint32_t count = 0;
+  bool ok = 1 == fread(&count, sizeof(count), 1, file);
+
+  tile.clear();
+  tile.reserve(count);
+
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    tile.emplace_back(0, NDTCell());
+    ok = (1 == fread(&tile.back().first, sizeof(uint32_t), 1, file)) &&
+         tile.back().second.load(file) &&
+         tile.back().first <
+             uint32_t(this->s_tile_cells * this->s_tile_cells);
+  }
+
+  fclose(file);
+
+  if (!ok) {
+    fprintf(stderr, "Corrupted map tile \"%s\", ignored\n",
+            this->s_tile_path(key).c_str());
+    tile.clear();
+  }
+
+  return ok;
+}
+
+// Written to a temporary file first, a crash never leaves a truncated tile
+bool TiledMap::s_write_tile(const TileKey &key, const Tile &tile) const {
+  std::string path = this->s_tile_path(key), tmp_path = path + ".tmp";
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+
+  if (!file) {
+    fprintf(stderr, "Can't write the map tile \"%s\"\n", path.c_str());
+    return false;
+  }
+
+  auto count = static_cast<uint32_t>(tile.size());
+  bool ok = 1 == fwrite(&count, sizeof(count), 1, file);
+
+  for (auto &tile_cell : tile)
+    ok = ok && (1 == fwrite(&tile_cell.first, sizeof(uint32_t), 1, file)) &&
+         tile_cell.second.save(file);
+
+  ok = (0 == fclose(file)) && ok;
+
+  return ok && (0 == rename(tmp_path.c_str(), path.c_str()));
+}
+
+// Add the cells of 'old_tile' missing from 'tile'
+void TiledMap::s_merge_tiles(Tile &tile, Tile &&old_tile) {
+  std::unordered_set<uint32_t> indices;
+
+  for (auto &tile_cell : tile)
+    indices.insert(tile_cell.first);
+
+  for (auto &tile_cell : old_tile) {
+    if (!indices.count(tile_cell.first))
+      tile.push_back(std::move(tile_cell));
+  }
+}
+
+bool TiledMap::s_queuedWrite(const TileKey &key) const {
+  return std::any_of(
+      this->s_jobs.begin(), this->s_jobs.end(), [&key](const Job &job) {
+        return JobType::Write == job.type && job.key == key;
+      });
+}
+
+void TiledMap::s_request(const TileKey &key) {
+  auto cached = this->s_cache.find(key);
+
+  if (this->s_cache.end() != cached) {
+    this->s_touch(cached->second);
+  } else if (this->s_pending.insert(key).second) {
+    this->s_jobs.push_back(Job{JobType::Load, key, nullptr, false});
+  }
+}
+
+// Add or replace a tile, the least recently used ones are dropped (written
+// back if modified) to keep the cache size
+void TiledMap::s_insert(const TileKey &key, TilePtr tile, bool dirty,
+                        bool partial) {
+  auto cached = this->s_cache.find(key);
+
+  if (this->s_cache.end() != cached) {
+    cached->second.tile = std::move(tile);
+    cached->second.dirty = cached->second.dirty || dirty;
+    cached->second.partial = partial;
+    this->s_touch(cached->second);
+    return;
+  }
+
+  this->s_lru.push_front(key);
+  this->s_cache[key] = CacheEntry{std::move(tile), dirty, partial,
+                                  this->s_lru.begin()};
+
+  while (this->s_cache.size() > this->s_cache_size) {
+    TileKey last = this->s_lru.back();
+    auto &entry = this->s_cache[last];
+
+    if (entry.dirty)
+      this->s_jobs.push_back(
+          Job{JobType::Write, last, entry.tile, entry.partial});
+
+    this->s_cache.erase(last);
+    this->s_lru.pop_back();
+  }
+}
+
+void TiledMap::s_touch(CacheEntry &entry) {
+  this->s_lru.splice(this->s_lru.begin(), this->s_lru, entry.lru);
+}
+
+Vector2i TiledMap::s_view_base(const NDTFrame *view,
+                               const Vector2d &origin) const {
+  return Vector2i(
+      static_cast<int>(
+          lround((origin.x() - view->width / 2.) / view->cell_side)),
+      static_cast<int>(
+          lround((origin.y() - view->height / 2.) / view->cell_side)));
+}
+
+vector<TiledMap::TileKey>
+TiledMap::s_view_tiles(const NDTFrame *view, const Vector2d &origin) const {
+  Vector2i base = this->s_view_base(view, origin);
+  vector<TileKey> keys;
+  int min_x = floor_div(base.x(), this->s_tile_cells),
+      min_y = floor_div(base.y(), this->s_tile_cells),
+      max_x =
+          floor_div(base.x() + view->widthNumOfCells - 1, this->s_tile_cells),
+      max_y =
+          floor_div(base.y() + view->heightNumOfCells - 1, this->s_tile_cells);
+
+  for (int y = min_y; y <= max_y; ++y) {
+    for (int x = min_x; x <= max_x; ++x)
+      keys.push_back(TileKey{x, y});
+  }
+
+  return keys;
+}
+
+TiledMap::TileKey TiledMap::s_tile_of(const Vector2i &world_cell,
+                                      uint32_t &index_in_tile) const {
+  TileKey key{floor_div(world_cell.x(), this->s_tile_cells),
+              floor_div(world_cell.y(), this->s_tile_cells)};
+
+  index_in_tile = static_cast<uint32_t>(
+      (world_cell.y() - key.y * this->s_tile_cells) * this->s_tile_cells +
+      (world_cell.x() - key.x * this->s_tile_cells));
+
+  return key;
+}
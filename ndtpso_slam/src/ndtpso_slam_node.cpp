@@ -1,7 +1,14 @@
 #include "geometry_msgs/PoseStamped.h"
+#include "geometry_msgs/PoseWithCovarianceStamped.h"
 #include "nav_msgs/Odometry.h"
+#include "ndtpso_slam/core.h"
+#include "ndtpso_slam/evaluation.h"
+#include "ndtpso_slam/matcher.h"
 #include "ndtpso_slam/ndtcell.h"
 #include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/realtime.h"
+#include "ndtpso_slam/scanring.h"
+#include "ndtpso_slam/shadowmatcher.h"
 #include "ros/ros.h"
 #include <chrono>
 #include <cstdio>
@@ -13,7 +20,9 @@
 #include <message_filters/sync_policies/approximate_time.h>
 #include <message_filters/time_synchronizer.h>
 #include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <tf/transform_listener.h>
 #include <tf/transform_broadcaster.h>
 
@@ -32,6 +41,11 @@
 #define DEFAULT_LIDAR_FRAME "laser"
 #define DEFAULT_OUTPUT_MAP_SIZE_M 25
 #define DEFAULT_RATE_HZ 30
+#define DEFAULT_OPTIMIZER "pso"
+#define DEFAULT_LOSS "gaussian"
+#define SCAN_RING_WAIT_MS 100 // Wake-up period to check for the shutdown
+#define DEFAULT_QUALITY_BLEND 0. // Weight of bad matches against the prediction
+#define SHADOW_REPORT_PERIOD_S 10.
 
 
 #if BUILD_OCCUPANCY_GRID
@@ -51,43 +65,44 @@ static std::mutex matcher_mutex;
 static std::chrono::time_point<std::chrono::high_resolution_clock> start_time,
     last_call_time;
 
-static int param_frame_size;
-static double param_cell_side;
-
-static bool first_iteration{true};
 static unsigned int number_of_iters{0};
-static Vector3d previous_pose{Vector3d::Zero()},
-    trans_estimate{Vector3d::Zero()}, initial_pose{Vector3d::Zero()},
-    current_pose{Vector3d::Zero()};
+static Vector3d current_pose{Vector3d::Zero()};
 
-static NDTFrame *current_frame;
-static NDTFrame *ref_frame;
+// Scan to map matching: the scan frame, the reference frame (own, view of a
+// tiled map or shared map) and the tracking state
+static Matcher *matcher{nullptr};
+// A/B test of an alternate configuration on the same scans, if enabled
+static ShadowMatcher *shadow{nullptr};
+// Scheduling of the thread matching the scans and of its OpenMP workers
+static RealTimeConfig realtime_conf;
+static int realtime_threads{1};
 
 #if SAVE_MAP_DATA_TO_FILE
 static NDTFrame *global_map;
 #endif
 
-static ros::Publisher pose_pub;
+static ros::Publisher pose_pub, pose_cov_pub;
 static geometry_msgs::PoseStamped current_pub_pose;
-
-
-// The odometry is used just for the initial pose to be easily compared with our
-// calculated pose
-void scan_mathcher(const sensor_msgs::LaserScanConstPtr &scan
-#if SYNC_WITH_LASER_TOPIC
-                   ,
-                   const sensor_msgs::LaserScanConstPtr &scan2
-#if __GNUC__ // __attribute__((unused)) is a GCC feature
-                   __attribute__((unused)) // scan2 is unused, it
-                                           // is present just for
-                                           // synchronization at
-                                           // calling time
-#endif
-#endif
-
+static geometry_msgs::PoseWithCovarianceStamped current_pub_pose_cov;
+
+
+// A laser scan to match, its ranges are read in place from a ROS message or a
+// scan ring slot
+struct ScanInput {
+  ros::Time stamp;
+  const float *ranges;
+  size_t count;
+  float angle_min, angle_max, angle_increment, range_min, range_max,
+      time_increment;
+  // Read from the scan ring: dropped if the producer reused its slot
+  const ScanRing *ring{nullptr};
+  uint64_t sequence{0};
+};
+
+static void match_scan(const ScanInput &scan
 #if SYNC_WITH_ODOM
-                   ,
-                   const nav_msgs::OdometryConstPtr &odom
+                       ,
+                       const nav_msgs::OdometryConstPtr &odom
 #endif
 ) {
 
@@ -98,8 +113,32 @@ void scan_mathcher(const sensor_msgs::LaserScanConstPtr &scan
   auto start = std::chrono::high_resolution_clock::now();
   last_call_time = start;
 
-  current_frame->loadLaser(scan->ranges, scan->angle_min, scan->angle_increment,
-                           scan->range_max);
+  // Read the ranges in place (message or scan ring)
+  ScanView view;
+  view.timestamp = scan.stamp.toSec();
+  view.ranges = scan.ranges;
+  view.count = scan.count;
+  view.angle_min = scan.angle_min;
+  view.angle_increment = scan.angle_increment;
+  view.range_max = scan.range_max;
+  view.time_increment = scan.time_increment;
+  matcher->loadScan(view);
+
+  // The shadow matcher copies the scan and the map before the match (if it
+  // isn't busy), its own time isn't counted in the matching time
+  auto shadow_start = std::chrono::high_resolution_clock::now();
+  bool shadowed = shadow && shadow->capture(*matcher, view);
+  auto shadow_time = std::chrono::high_resolution_clock::now() - shadow_start;
+
+  // The producer reused the slot while the ranges were read
+  if (scan.ring && !scan.ring->valid(scan.sequence)) {
+    ROS_WARN("Scan overwritten in the scan ring, dropped");
+    matcher->dropScan();
+    if (shadowed)
+      shadow->cancel();
+    matcher_mutex.unlock();
+    return;
+  }
 
 #if SYNC_WITH_ODOM
   double _, odom_orientation;
@@ -108,44 +147,62 @@ void scan_mathcher(const sensor_msgs::LaserScanConstPtr &scan
                                odom->pose.pose.orientation.z,
                                odom->pose.pose.orientation.w))
       .getRPY(_, _, odom_orientation);
+  Vector3d odom_pose(odom->pose.pose.position.x, odom->pose.pose.position.y,
+                     odom_orientation);
 #endif
 
-  if (first_iteration) {
+  MatchResult result;
+
+  if (!matcher->match(result
 #if SYNC_WITH_ODOM
-    current_pose << odom->pose.pose.position.x, odom->pose.pose.position.y,
-        odom_orientation;
-    previous_pose << odom->pose.pose.position.x, odom->pose.pose.position.y,
-        odom_orientation;
+                      ,
+                      &odom_pose
 #endif
-    current_pose = previous_pose;
-    start_time = std::chrono::high_resolution_clock::now();
-    ROS_INFO("Min/Max ranges: %.2f/%.2f", static_cast<double>(scan->range_min),
-             static_cast<double>(scan->range_max));
-    ROS_INFO("Min/Max angles: %.2f/%.2f", static_cast<double>(scan->angle_min),
-             static_cast<double>(scan->angle_max));
-  } else {
-    current_pose = ref_frame->align(previous_pose, current_frame);
+                      )) {
+    ROS_WARN_THROTTLE(1., "Waiting for the owner of the shared map");
+    if (shadowed)
+      shadow->cancel();
+    matcher_mutex.unlock();
+    return;
   }
 
-  previous_pose = current_pose;
-  ref_frame->update(current_pose, current_frame);
+  if (shadowed) {
+    shadow->submit(result, std::chrono::duration<double, std::milli>(
+                               std::chrono::high_resolution_clock::now() -
+                               start - shadow_time)
+                               .count());
+  }
+
+  current_pose = result.pose;
+
+  if (result.first) {
+    start_time = std::chrono::high_resolution_clock::now();
+    ROS_INFO("Min/Max ranges: %.2f/%.2f", static_cast<double>(scan.range_min),
+             static_cast<double>(scan.range_max));
+    ROS_INFO("Min/Max angles: %.2f/%.2f", static_cast<double>(scan.angle_min),
+             static_cast<double>(scan.angle_max));
+  } else if (!result.quality.good) {
+    ROS_WARN_THROTTLE(1., "Low match quality (score: %.2f, inliers: %.2f, "
+                          "degeneracy: %.3f), using the motion prediction",
+                      result.quality.score, result.quality.inlier_ratio,
+                      result.quality.degeneracy);
+  }
 
 #if SAVE_MAP_DATA_TO_FILE
-  if (iter_num == 0)
-    global_map->update(current_pose, current_frame);
+  if (iter_num == 0 && result.quality.good && !result.stationary)
+    global_map->update(current_pose, matcher->scan());
   iter_num = (iter_num + 1) % SAVE_DATA_TO_FILE_EACH_NUM_ITERS;
-  global_map->addPose(scan->header.stamp.toSec(), current_pose
+  global_map->addPose(scan.stamp.toSec(), current_pose
 #if SYNC_WITH_ODOM
                       ,
-                      Vector3d(odom->pose.pose.position.x,
-                               odom->pose.pose.position.y, odom_orientation)
+                      odom_pose
 #endif
   );
 #endif
 
   // Publish 'pose', using the same timestamp of the laserscan (or use
   // ros::Time::now() !!)
-  current_pub_pose.header.stamp = scan->header.stamp;
+  current_pub_pose.header.stamp = scan.stamp;
   current_pub_pose.header.frame_id =
       DEFAULT_PUBLISHED_POSE_FRAME_ID; // we can read it from config
   current_pub_pose.pose.position.x = current_pose.x();
@@ -157,14 +214,18 @@ void scan_mathcher(const sensor_msgs::LaserScanConstPtr &scan
   current_pub_pose.pose.orientation.y = q_ori.getY();
   current_pub_pose.pose.orientation.z = q_ori.getZ();
   current_pub_pose.pose.orientation.w = q_ori.getW();
-  
- 
-  // Reallocate the current_frame object, this is much faster than calling
-  // current_frame->resetCells()
-  delete current_frame;
-  current_frame = new NDTFrame(
-      initial_pose, static_cast<unsigned short>(param_frame_size),
-      static_cast<unsigned short>(param_frame_size), param_frame_size, false);
+
+  // The same pose with its covariance (x, y, z, roll, pitch, yaw), only the
+  // planar terms are estimated
+  current_pub_pose_cov.header = current_pub_pose.header;
+  current_pub_pose_cov.pose.pose = current_pub_pose.pose;
+  for (unsigned int i = 0; i < 3; ++i) {
+    for (unsigned int j = 0; j < 3; ++j) {
+      current_pub_pose_cov.pose.covariance[(i < 2 ? i : 5) * 6 +
+                                           (j < 2 ? j : 5)] =
+          result.covariance(i, j);
+    }
+  }
 
   auto finish = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double> elapsed = finish - start;
@@ -172,16 +233,112 @@ void scan_mathcher(const sensor_msgs::LaserScanConstPtr &scan
   ++number_of_iters;
   std::chrono::duration<double> current_rate = last_call_time - start_time;
 
-  if (!first_iteration) {
+  if (!result.first) {
     ROS_INFO("Average publish rate: %.2fHz, matching rate: %.2fHz",
              1. / (current_rate.count() / number_of_iters),
              1. / elapsed.count());
   }
 
-  first_iteration = false;
+  if (shadow) {
+    auto stats = shadow->stats();
+    double matched = std::max(1ul, stats.matched);
+
+    ROS_INFO_THROTTLE(
+        SHADOW_REPORT_PERIOD_S,
+        "Shadow: %lu matched, %lu skipped, pose difference %.3fm/%.4frad "
+        "(max %.3fm/%.4frad), cost gain %.3f, time %.2fms (production "
+        "%.2fms), bad matches %lu (production %lu)",
+        stats.matched, stats.skipped, stats.translation_sum / matched,
+        stats.rotation_sum / matched, stats.max_translation,
+        stats.max_rotation, stats.cost_gain_sum / matched,
+        stats.shadow_ms_sum / matched, stats.production_ms_sum / matched,
+        stats.shadow_bad, stats.production_bad);
+  }
+
   matcher_mutex.unlock();
 }
 
+// The odometry is used just for the initial pose to be easily compared with our
+// calculated pose
+void scan_mathcher(const sensor_msgs::LaserScanConstPtr &scan
+#if SYNC_WITH_LASER_TOPIC
+                   ,
+                   const sensor_msgs::LaserScanConstPtr &scan2
+#if __GNUC__ // __attribute__((unused)) is a GCC feature
+                   __attribute__((unused)) // scan2 is unused, it
+                                           // is present just for
+                                           // synchronization at
+                                           // calling time
+#endif
+#endif
+
+#if SYNC_WITH_ODOM
+                   ,
+                   const nav_msgs::OdometryConstPtr &odom
+#endif
+) {
+  ScanInput input;
+  input.stamp = scan->header.stamp;
+  input.ranges = scan->ranges.data();
+  input.count = scan->ranges.size();
+  input.angle_min = scan->angle_min;
+  input.angle_max = scan->angle_max;
+  input.angle_increment = scan->angle_increment;
+  input.range_min = scan->range_min;
+  input.range_max = scan->range_max;
+  input.time_increment = scan->time_increment;
+
+  match_scan(input
+#if SYNC_WITH_ODOM
+             ,
+             odom
+#endif
+  );
+}
+
+// Called by the thread matching the scans, before its first scan
+static void setup_realtime() {
+  for (auto &failure : apply_realtime(realtime_conf, realtime_threads))
+    ROS_WARN("Real-time setting not applied, %s", failure.c_str());
+}
+
+#if !(SYNC_WITH_ODOM || SYNC_WITH_LASER_TOPIC)
+// Consumer of the scan ring, used instead of the scan topic subscriber
+static void scan_ring_loop(ScanRing *ring) {
+  const ScanRing::Scan *scan;
+  const float *ranges;
+
+  setup_realtime();
+
+  while (ros::ok()) {
+    uint64_t sequence = ring->wait(SCAN_RING_WAIT_MS, scan, ranges);
+
+    // No scan for a while, the producer may have been restarted on a new
+    // ring (the futex of the old one is never woken up again)
+    if (0 == sequence) {
+      if (ring->reopen())
+        ROS_INFO("Switched to the new scan ring (restarted producer)");
+      continue;
+    }
+
+    ScanInput input;
+    input.stamp = ros::Time(scan->timestamp);
+    input.ranges = ranges;
+    input.count = std::min(static_cast<size_t>(scan->count), ring->maxRanges());
+    input.angle_min = scan->angle_min;
+    input.angle_max = scan->angle_max;
+    input.angle_increment = scan->angle_increment;
+    input.range_min = scan->range_min;
+    input.range_max = scan->range_max;
+    input.time_increment = scan->time_increment;
+    input.ring = ring;
+    input.sequence = sequence;
+
+    match_scan(input);
+  }
+}
+#endif
+
 int main(int argc, char **argv)
 
 {
@@ -208,9 +365,12 @@ int main(int argc, char **argv)
   NDTPSOConfig ndtpso_conf; // Initally, the object helds the default values
 
   // Read parameters
-  std::string param_scan_topic, param_lidar_frame;
+  std::string param_scan_topic, param_lidar_frame, param_optimizer, param_loss,
+      param_tile_store, param_shared_map, param_scan_ring;
 
-  int param_map_size, param_rate;
+  int param_map_size, param_rate, param_tile_cache_size, param_frame_size;
+  double param_tile_size, param_cell_side, param_quality_blend;
+  bool param_deskew, param_map_time_in_seconds, param_shared_map_reader;
 
   nh.param<std::string>("scan_topic", param_scan_topic, DEFAULT_SCAN_TOPIC);
 #if SYNC_WITH_ODOM
@@ -223,6 +383,108 @@ int main(int argc, char **argv)
   nh.param("iterations", ndtpso_conf.psoConfig.iterations, PSO_ITERATIONS);
   nh.param("population", ndtpso_conf.psoConfig.populationSize,
            PSO_POPULATION_SIZE);
+  nh.param("pso_w", ndtpso_conf.psoConfig.coeff.w, PSO_W);
+  nh.param("pso_c1", ndtpso_conf.psoConfig.coeff.c1, PSO_C1);
+  nh.param("pso_c2", ndtpso_conf.psoConfig.coeff.c2, PSO_C2);
+  nh.param("pso_w_dumping", ndtpso_conf.psoConfig.coeff.w_dumping,
+           PSO_W_DUMPING_COEF);
+  nh.param<std::string>("optimizer", param_optimizer, DEFAULT_OPTIMIZER);
+  nh.param("quality_min_score", ndtpso_conf.qualityConfig.min_score,
+           NDT_QUALITY_MIN_SCORE);
+  nh.param("quality_min_inliers", ndtpso_conf.qualityConfig.min_inlier_ratio,
+           NDT_QUALITY_MIN_INLIERS);
+  nh.param("quality_min_degeneracy", ndtpso_conf.qualityConfig.min_degeneracy,
+           NDT_QUALITY_MIN_DEGENERACY);
+  nh.param("quality_blend", param_quality_blend, DEFAULT_QUALITY_BLEND);
+  nh.param("deskew", param_deskew, false);
+  StationaryConfig stationary_conf;
+  nh.param("stationary_skip", stationary_conf.enabled, false);
+  nh.param("stationary_max_difference", stationary_conf.max_difference,
+           STATIONARY_MAX_DIFFERENCE);
+  nh.param("stationary_max_interval", stationary_conf.max_interval,
+           STATIONARY_MAX_INTERVAL_S);
+  nh.param("cmaes_iterations", ndtpso_conf.cmaesConfig.iterations,
+           CMAES_ITERATIONS);
+  nh.param("cmaes_population", ndtpso_conf.cmaesConfig.populationSize,
+           CMAES_POPULATION_SIZE);
+  nh.param("de_iterations", ndtpso_conf.deConfig.iterations, DE_ITERATIONS);
+  nh.param("de_population", ndtpso_conf.deConfig.populationSize,
+           DE_POPULATION_SIZE);
+  ndtpso_conf.cmaesConfig.num_threads = ndtpso_conf.deConfig.num_threads =
+      ndtpso_conf.psoConfig.num_threads;
+  realtime_threads = threads_count(ndtpso_conf.psoConfig.num_threads);
+
+  if ("cmaes" == param_optimizer) {
+    ndtpso_conf.optimizer = Optimizer::CMAES;
+  } else if ("de" == param_optimizer) {
+    ndtpso_conf.optimizer = Optimizer::DE;
+  } else if ("pso" != param_optimizer) {
+    ROS_WARN("Unknown optimizer \"%s\", using \"pso\"",
+             param_optimizer.c_str());
+    param_optimizer = "pso";
+  }
+
+  nh.param<std::string>("loss", param_loss, DEFAULT_LOSS);
+  nh.param("outlier_gating", ndtpso_conf.outlierGating, false);
+  nh.param("dynamic_filter", ndtpso_conf.dynamicFilter.enabled,
+           NDT_DYNAMIC_FILTER);
+  int param_dynamic_window;
+  nh.param("dynamic_window", param_dynamic_window, NDT_DYNAMIC_WINDOW);
+  ndtpso_conf.dynamicFilter.window =
+      static_cast<unsigned int>(std::max(2, param_dynamic_window));
+#if NDT_DECAY_FORGETTING
+  nh.param("decay_half_life", ndtpso_conf.decay.half_life,
+           NDT_DECAY_HALF_LIFE);
+#endif
+  nh.param("map_time_in_seconds", param_map_time_in_seconds, false);
+  ndtpso_conf.timeInSeconds = param_map_time_in_seconds;
+  nh.param("eviction_max_age", ndtpso_conf.eviction.max_age,
+           NDT_EVICTION_MAX_AGE);
+  nh.param("eviction_max_distance", ndtpso_conf.eviction.max_distance,
+           NDT_EVICTION_MAX_DISTANCE);
+  nh.param<std::string>("map_spill_file", ndtpso_conf.eviction.spill_file, "");
+  nh.param("cull_min_points", ndtpso_conf.culling.min_points,
+           static_cast<double>(NDT_CULL_MIN_POINTS));
+  nh.param("cull_min_condition", ndtpso_conf.culling.min_condition,
+           NDT_CULL_MIN_CONDITION);
+  nh.param("cull_full_points", ndtpso_conf.culling.full_points,
+           static_cast<double>(NDT_CULL_FULL_POINTS));
+  nh.param("quadtree", ndtpso_conf.quadTree.enabled, NDT_QUADTREE);
+  nh.param("quadtree_min_cell_side", ndtpso_conf.quadTree.min_cell_side,
+           NDT_QUADTREE_MIN_CELL_SIDE);
+  nh.param<std::string>("tile_store", param_tile_store, "");
+  nh.param("tile_size", param_tile_size, TILED_MAP_TILE_SIZE);
+  nh.param("tile_cache_size", param_tile_cache_size, TILED_MAP_CACHE_SIZE);
+  nh.param<std::string>("shared_map", param_shared_map, "");
+  nh.param<std::string>("scan_ring", param_scan_ring, "");
+  std::string param_shadow, param_shadow_log;
+  int param_shadow_nice, param_shadow_num_threads;
+  nh.param<std::string>("shadow", param_shadow, "");
+  nh.param<std::string>("shadow_log", param_shadow_log, "");
+  nh.param("shadow_nice", param_shadow_nice, SHADOW_NICE);
+  nh.param("shadow_num_threads", param_shadow_num_threads, SHADOW_NUM_THREADS);
+  nh.param("shared_map_reader", param_shared_map_reader, false);
+  // Pose of the scan frame in the map at start ("x y yaw"), a reader of a
+  // shared map starts at its pose in the owner's (see shared_map_frame)
+  std::string param_initial_pose, param_shared_map_frame;
+  nh.param<std::string>("initial_pose", param_initial_pose, "");
+  nh.param<std::string>("shared_map_frame", param_shared_map_frame, "");
+  nh.param<std::string>("rt_policy", realtime_conf.policy, "other");
+  nh.param("rt_priority", realtime_conf.priority, RT_PRIORITY);
+  nh.param<std::string>("ingestion_cpus", realtime_conf.ingestion_cpus, "");
+  nh.param<std::string>("worker_cpus", realtime_conf.worker_cpus, "");
+  nh.param("lock_memory", realtime_conf.lock_memory, false);
+  param_shared_map_reader =
+      param_shared_map_reader && !param_shared_map.empty();
+
+  if ("huber" == param_loss) {
+    ndtpso_conf.loss = NDTLoss::Huber;
+  } else if ("cauchy" == param_loss) {
+    ndtpso_conf.loss = NDTLoss::Cauchy;
+  } else if ("gaussian" != param_loss) {
+    ROS_WARN("Unknown loss \"%s\", using \"gaussian\"", param_loss.c_str());
+    param_loss = "gaussian";
+  }
   nh.param("rate", param_rate, DEFAULT_RATE_HZ);
   nh.param("cell_side", param_cell_side, DEFAULT_CELL_SIZE_M);
   nh.param<int>("frame_size", param_frame_size, DEFAULT_FRAME_SIZE_M);
@@ -250,15 +512,91 @@ int main(int argc, char **argv)
 
   ROS_INFO("rate:= %dHz", param_rate);
 
-  ROS_INFO("Config [PSO Number of Iterations: %d]",
-           ndtpso_conf.psoConfig.iterations);
-  ROS_INFO("Config [PSO Population Size: %d]",
-           ndtpso_conf.psoConfig.populationSize);
+  ROS_INFO("Config [Optimizer: %s]", param_optimizer.c_str());
+  if (Optimizer::CMAES == ndtpso_conf.optimizer) {
+    ROS_INFO("Config [CMA-ES Number of Iterations: %d]",
+             ndtpso_conf.cmaesConfig.iterations);
+    ROS_INFO("Config [CMA-ES Population Size: %d]",
+             ndtpso_conf.cmaesConfig.populationSize);
+  } else if (Optimizer::DE == ndtpso_conf.optimizer) {
+    ROS_INFO("Config [DE Number of Iterations: %d]",
+             ndtpso_conf.deConfig.iterations);
+    ROS_INFO("Config [DE Population Size: %d]",
+             ndtpso_conf.deConfig.populationSize);
+  } else {
+    ROS_INFO("Config [PSO Number of Iterations: %d]",
+             ndtpso_conf.psoConfig.iterations);
+    ROS_INFO("Config [PSO Population Size: %d]",
+             ndtpso_conf.psoConfig.populationSize);
+    ROS_INFO("Config [PSO Coefficients (w/c1/c2/w dumping): "
+             "%.2f/%.2f/%.2f/%.2f]",
+             ndtpso_conf.psoConfig.coeff.w, ndtpso_conf.psoConfig.coeff.c1,
+             ndtpso_conf.psoConfig.coeff.c2,
+             ndtpso_conf.psoConfig.coeff.w_dumping);
+  }
   ROS_INFO("Config [PSO Threads: %d]", ndtpso_conf.psoConfig.num_threads);
+  ROS_INFO("Config [NDT Loss: %s%s]", param_loss.c_str(),
+           ndtpso_conf.outlierGating ? ", with outlier gating" : "");
+  ROS_INFO("Config [Dynamic Objects Filter: %s]",
+           ndtpso_conf.dynamicFilter.enabled ? "enabled" : "disabled");
+  ROS_INFO("Config [Motion Distortion Compensation: %s]",
+           param_deskew ? "enabled" : "disabled");
+  if (stationary_conf.enabled)
+    ROS_INFO("Config [Stationary Scans Skip: below %.3fm, at most %.1fs]",
+             stationary_conf.max_difference, stationary_conf.max_interval);
+  ROS_INFO("Config [Min Match Quality (score/inliers/degeneracy): "
+           "%.2f/%.2f/%.3f, blend: %.2f]",
+           ndtpso_conf.qualityConfig.min_score,
+           ndtpso_conf.qualityConfig.min_inlier_ratio,
+           ndtpso_conf.qualityConfig.min_degeneracy, param_quality_blend);
   ROS_INFO("Config [NDT Cell Size: %.2fm]", param_cell_side);
+  ROS_INFO("Config [NDT Cells Culling (min points/condition): %.0f/%g, full "
+           "weight from %.0f points]",
+           ndtpso_conf.culling.min_points, ndtpso_conf.culling.min_condition,
+           ndtpso_conf.culling.full_points);
+  if (ndtpso_conf.quadTree.enabled)
+    ROS_INFO("Config [NDT Quadtree Min Cell Size: %.2fm]",
+             ndtpso_conf.quadTree.min_cell_side);
   ROS_INFO("Config [NDT Frame Size: %dx%dm]", param_frame_size,
            param_frame_size);
+#if NDT_DECAY_FORGETTING
+  ROS_INFO("Config [NDT Decay Half-Life: %.2f%s]", ndtpso_conf.decay.half_life,
+           param_map_time_in_seconds ? "s" : " scans");
+#else
   ROS_INFO("Config [NDT Window Size: %d]", NDT_WINDOW_SIZE);
+#endif
+  ROS_INFO("Config [Stale Cells Eviction (age/distance): %.2f%s/%.2fm%s%s]",
+           ndtpso_conf.eviction.max_age,
+           param_map_time_in_seconds ? "s" : " scans",
+           ndtpso_conf.eviction.max_distance,
+           ndtpso_conf.eviction.spill_file.empty() ? "" : ", spilled to ",
+           ndtpso_conf.eviction.spill_file.c_str());
+  if (!param_tile_store.empty())
+    ROS_INFO("Config [Tiled Map: \"%s\", %.2fm tiles, %d cached]",
+             param_tile_store.c_str(), param_tile_size, param_tile_cache_size);
+  if (!param_shared_map.empty())
+    ROS_INFO("Config [Shared Map: \"%s\", %s]", param_shared_map.c_str(),
+             param_shared_map_reader ? "reader" : "owner");
+#if !(SYNC_WITH_ODOM || SYNC_WITH_LASER_TOPIC)
+  if (!param_scan_ring.empty())
+    ROS_INFO("Config [Scan Ring: \"%s\", instead of the scan topic]",
+             param_scan_ring.c_str());
+  if (!param_shadow.empty())
+    ROS_INFO("Config [Shadow Matcher: \"%s\", nice %d, %d threads%s%s]",
+             param_shadow.c_str(), param_shadow_nice,
+             param_shadow_num_threads,
+             param_shadow_log.empty() ? "" : ", log ",
+             param_shadow_log.c_str());
+#endif
+  if ("other" != realtime_conf.policy ||
+      !realtime_conf.ingestion_cpus.empty() ||
+      !realtime_conf.worker_cpus.empty() || realtime_conf.lock_memory)
+    ROS_INFO("Config [Real-time: %s %d, ingestion CPUs \"%s\", worker CPUs "
+             "\"%s\"%s]",
+             realtime_conf.policy.c_str(), realtime_conf.priority,
+             realtime_conf.ingestion_cpus.c_str(),
+             realtime_conf.worker_cpus.c_str(),
+             realtime_conf.lock_memory ? ", memory locked" : "");
   ROS_INFO("Config [Max Map Size: %dx%dm]", param_map_size, param_map_size);
 #if BUILD_OCCUPANCY_GRID
   ROS_INFO("Config [Occupancy Grid Cell Size: %.2fm]",
@@ -267,16 +605,82 @@ int main(int argc, char **argv)
 
   // The reference frame which will be used for all the matching operations,
   // It is the only frame which needs to be set to the correct cell and
-  // occupancy grid sizes
-  ref_frame = new NDTFrame(Vector3d::Zero(),
-                           static_cast<unsigned short>(param_frame_size),
-                           static_cast<unsigned short>(param_frame_size),
-                           param_cell_side, true, ndtpso_conf
+  // occupancy grid sizes (a reader uses the geometry of the shared map)
+  MatcherConfig matcher_conf;
+  matcher_conf.frame_size = static_cast<unsigned short>(param_frame_size);
+  matcher_conf.cell_side = param_cell_side;
 #if BUILD_OCCUPANCY_GRID
-                           ,
-                           param_occupancy_grid_cell_side
+  matcher_conf.occupancy_grid_cell_side = param_occupancy_grid_cell_side;
 #endif
-  );
+  matcher_conf.quality_blend = param_quality_blend;
+  matcher_conf.deskew = param_deskew;
+  matcher_conf.stationary = stationary_conf;
+  matcher_conf.tile_store = param_tile_store;
+  matcher_conf.tile_size = param_tile_size;
+  matcher_conf.tile_cache_size = static_cast<size_t>(param_tile_cache_size);
+  matcher_conf.shared_map = param_shared_map;
+  matcher_conf.shared_map_reader = param_shared_map_reader;
+  matcher_conf.ndt = ndtpso_conf;
+
+  if (param_shared_map_reader) {
+    ROS_INFO("Waiting for the shared map \"%s\"", param_shared_map.c_str());
+
+    while (ros::ok()) {
+      matcher = new Matcher(matcher_conf);
+
+      if (matcher->isReady())
+        break;
+
+      delete matcher;
+      matcher = nullptr;
+      ros::Duration(1.).sleep();
+    }
+
+    if (!matcher)
+      return 0;
+  } else {
+    matcher = new Matcher(matcher_conf);
+
+    if (!matcher->isReady()) {
+      ROS_WARN("Can't create the shared map \"%s\"", param_shared_map.c_str());
+      matcher_conf.shared_map.clear();
+      delete matcher;
+      matcher = new Matcher(matcher_conf);
+    }
+  }
+
+  if (!param_shadow.empty()) {
+    // The production configuration, with the changes listed in 'shadow'
+    // ("name=value ...", named as the node's parameters)
+    ShadowConfig shadow_conf;
+    shadow_conf.matcher = matcher_conf;
+    shadow_conf.matcher.ndt.psoConfig.num_threads =
+        shadow_conf.matcher.ndt.cmaesConfig.num_threads =
+            shadow_conf.matcher.ndt.deConfig.num_threads =
+                param_shadow_num_threads;
+    shadow_conf.nice = param_shadow_nice;
+    shadow_conf.log_file = param_shadow_log;
+
+    std::istringstream fields(param_shadow);
+    std::string field;
+
+    while (fields >> field) {
+      auto separator = field.find('=');
+
+      if (std::string::npos != separator &&
+          !ShadowMatcher::canChange(field.substr(0, separator)))
+        ROS_WARN("The shadow matches on the production map and tracking, "
+                 "\"%s\" can't change it, ignored",
+                 field.c_str());
+      else if (std::string::npos == separator ||
+               !set_matcher_parameter(shadow_conf.matcher,
+                                      field.substr(0, separator),
+                                      field.substr(separator + 1)))
+        ROS_WARN("Bad shadow parameter \"%s\", ignored", field.c_str());
+    }
+
+    shadow = new ShadowMatcher(shadow_conf);
+  }
 
 #if SAVE_MAP_DATA_TO_FILE
   global_map = new NDTFrame(
@@ -284,11 +688,9 @@ int main(int argc, char **argv)
       static_cast<unsigned short>(param_map_size), param_map_size, false);
 #endif
 
-  current_frame = new NDTFrame(
-      initial_pose, static_cast<unsigned short>(param_frame_size),
-      static_cast<unsigned short>(param_frame_size), param_cell_side, false);
-
   pose_pub = nh.advertise<geometry_msgs::PoseStamped>("pose", 1);
+  pose_cov_pub =
+      nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("pose_cov", 1);
 
 #if WAIT_FOR_TF
   tf::TransformListener tf_listener(ros::Duration(1));
@@ -308,10 +710,43 @@ int main(int argc, char **argv)
   ROS_INFO("tf = (%.5f, %.5f, %.5f)", initial_trans.x(), initial_trans.y(),
            initial_trans.z());
 
-  current_frame->setTrans(initial_trans);
+  matcher->setSensorTransform(initial_trans);
+  if (shadow)
+    shadow->setSensorTransform(initial_trans);
 #endif
 
-  previous_pose = current_pose = initial_pose = Vector3d::Zero();
+  Vector3d initial_pose = Vector3d::Zero();
+
+  if (!param_initial_pose.empty()) {
+    std::istringstream fields(param_initial_pose);
+
+    if (!(fields >> initial_pose.x() >> initial_pose.y() >> initial_pose.z())) {
+      ROS_WARN("Bad initial_pose \"%s\", ignored", param_initial_pose.c_str());
+      initial_pose = Vector3d::Zero();
+    }
+  }
+#if WAIT_FOR_TF
+  else if (param_shared_map_reader && !param_shared_map_frame.empty()) {
+    // The shared map is in the frame of the owner's scan frame at its start
+    // (e.g. "lidar_front"), the reader starts at the extrinsic between them
+    ROS_INFO("Waiting for tf \"%s\" -> \"%s\"",
+             param_shared_map_frame.c_str(), param_lidar_frame.c_str());
+    while (!tf_listener.waitForTransform(param_shared_map_frame,
+                                         param_lidar_frame, ros::Time(0),
+                                         ros::Duration(2)))
+      ;
+    tf_listener.lookupTransform(param_shared_map_frame, param_lidar_frame,
+                                ros::Time(0), transform);
+    initial_pose << transform.getOrigin().getX(), transform.getOrigin().getY(),
+        tf::getYaw(transform.getRotation());
+  }
+#endif
+  else if (param_shared_map_reader) {
+    ROS_WARN("The shared map reader starts at the owner's initial pose, set "
+             "shared_map_frame or initial_pose to its own");
+  }
+
+  matcher->setPose(initial_pose);
 
   ROS_INFO("Starting from initial pose (%.5f, %.5f, %.5f)", initial_pose.x(),
            initial_pose.y(), initial_pose.z());
@@ -359,9 +794,37 @@ int main(int argc, char **argv)
 #endif
                                     ));
 #else
-  ros::Subscriber laser_sub =
-      nh.subscribe<sensor_msgs::LaserScan>(param_scan_topic, 1, &scan_mathcher);
+  ros::Subscriber laser_sub;
+  ScanRing *scan_ring = nullptr;
+  std::thread scan_ring_thread;
+
+  if (param_scan_ring.empty()) {
+    laser_sub = nh.subscribe<sensor_msgs::LaserScan>(param_scan_topic, 1,
+                                                     &scan_mathcher);
+  } else {
+    ROS_INFO("Waiting for the scan ring \"%s\"", param_scan_ring.c_str());
+
+    while (ros::ok()) {
+      scan_ring = new ScanRing(param_scan_ring);
+
+      if (scan_ring->isOpen())
+        break;
+
+      delete scan_ring;
+      scan_ring = nullptr;
+      ros::Duration(1.).sleep();
+    }
+
+    if (scan_ring)
+      scan_ring_thread = std::thread(scan_ring_loop, scan_ring);
+  }
+#endif
+
+  // The scans are matched by the scan ring's thread, or by this one (spinOnce)
+#if !(SYNC_WITH_ODOM || SYNC_WITH_LASER_TOPIC)
+  if (!scan_ring)
 #endif
+    setup_realtime();
 
   ROS_INFO("NDTPSO node started successfuly");
 
@@ -374,15 +837,40 @@ int main(int argc, char **argv)
   
   while (ros::ok()) {
     ros::spinOnce();
-    pose_pub.publish(current_pub_pose);
-  transform_.setOrigin( tf::Vector3(current_pub_pose.pose.position.x,current_pub_pose.pose.position.y, 0.0) );
-  tf::Quaternion q_(current_pub_pose.pose.orientation.x,current_pub_pose.pose.orientation.y,current_pub_pose.pose.orientation.z,current_pub_pose.pose.orientation.w);
+    // Written by the scan ring's thread when there is one
+    matcher_mutex.lock();
+    geometry_msgs::PoseStamped pub_pose = current_pub_pose;
+    geometry_msgs::PoseWithCovarianceStamped pub_pose_cov =
+        current_pub_pose_cov;
+    matcher_mutex.unlock();
+    pose_pub.publish(pub_pose);
+    pose_cov_pub.publish(pub_pose_cov);
+  transform_.setOrigin( tf::Vector3(pub_pose.pose.position.x,pub_pose.pose.position.y, 0.0) );
+  tf::Quaternion q_(pub_pose.pose.orientation.x,pub_pose.pose.orientation.y,pub_pose.pose.orientation.z,pub_pose.pose.orientation.w);
   transform_.setRotation(q_);
     br.sendTransform(tf::StampedTransform(transform_, ros::Time::now(), "map", "laser"));
     loop_rate.sleep();
   }
 //////////////////
 
+#if !(SYNC_WITH_ODOM || SYNC_WITH_LASER_TOPIC)
+  if (scan_ring_thread.joinable())
+    scan_ring_thread.join();
+  delete scan_ring;
+#endif
+
+  if (!param_tile_store.empty())
+    cout << endl << "Writing the map tiles to " << param_tile_store << endl;
+
+  // Waits for the current shadow match, writes back the tiled map, detaches
+  // from the shared map
+  matcher_mutex.lock();
+  delete shadow;
+  shadow = nullptr;
+  delete matcher;
+  matcher = nullptr;
+  matcher_mutex.unlock();
+
   // current_pub_pose.header.stamp = scan->header.stamp;
   // current_pub_pose.header.frame_id =
   //     DEFAULT_PUBLISHED_POSE_FRAME_ID; // we can read it from config
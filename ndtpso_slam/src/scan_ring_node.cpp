@@ -0,0 +1,76 @@
+// Feeds a scan ring (see ScanRing) from a LaserScan topic, for the drivers
+// which can't write to the ring themselves. Run it next to the driver (e.g.
+// in the same machine, ideally as part of the driver's process), the matcher
+// node reads the ring with its `scan_ring` parameter
+#include "ndtpso_slam/scanring.h"
+#include "ros/ros.h"
+#include "sensor_msgs/LaserScan.h"
+#include <string>
+
+#define DEFAULT_SCAN_TOPIC "/scan"
+#define DEFAULT_SCAN_RING "/ndtpso_scans"
+
+static std::string param_scan_ring;
+static int param_max_ranges, param_slots;
+static ScanRing *scan_ring{nullptr};
+
+static void scan_callback(const sensor_msgs::LaserScanConstPtr &scan) {
+  // The ring's size is taken from the first scan, if not given
+  if (!scan_ring) {
+    size_t max_ranges = param_max_ranges > 0
+                            ? static_cast<size_t>(param_max_ranges)
+                            : scan->ranges.size();
+    scan_ring = new ScanRing(param_scan_ring, max_ranges,
+                             static_cast<size_t>(param_slots));
+
+    if (!scan_ring->isOpen()) {
+      ROS_ERROR("Can't create the scan ring \"%s\"", param_scan_ring.c_str());
+      ros::shutdown();
+      return;
+    }
+
+    ROS_INFO("Scan ring \"%s\" created, %lu ranges per scan",
+             param_scan_ring.c_str(), static_cast<unsigned long>(max_ranges));
+  }
+
+  if (scan->ranges.size() > scan_ring->maxRanges())
+    ROS_WARN_THROTTLE(1., "Scans of %lu ranges truncated to %lu",
+                      static_cast<unsigned long>(scan->ranges.size()),
+                      static_cast<unsigned long>(scan_ring->maxRanges()));
+
+  ScanRing::Scan header;
+  header.timestamp = scan->header.stamp.toSec();
+  header.angle_min = scan->angle_min;
+  header.angle_max = scan->angle_max;
+  header.angle_increment = scan->angle_increment;
+  header.range_min = scan->range_min;
+  header.range_max = scan->range_max;
+  header.time_increment = scan->time_increment;
+  header.count = static_cast<uint32_t>(scan->ranges.size());
+
+  scan_ring->publish(header, scan->ranges.data());
+}
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "ndtpso_scan_ring");
+  ros::NodeHandle nh("~");
+
+  std::string param_scan_topic;
+  nh.param<std::string>("scan_topic", param_scan_topic, DEFAULT_SCAN_TOPIC);
+  nh.param<std::string>("scan_ring", param_scan_ring, DEFAULT_SCAN_RING);
+  nh.param("max_ranges", param_max_ranges, 0);
+  nh.param("slots", param_slots, SCAN_RING_SLOTS);
+
+  ROS_INFO("scan_topic:= \"%s\"", param_scan_topic.c_str());
+  ROS_INFO("scan_ring:= \"%s\"", param_scan_ring.c_str());
+
+  ros::Subscriber scan_sub = nh.subscribe<sensor_msgs::LaserScan>(
+      param_scan_topic, 10, &scan_callback);
+
+  ros::spin();
+
+  // Removes the ring, the attached consumers keep their mapping
+  delete scan_ring;
+
+  return 0;
+}
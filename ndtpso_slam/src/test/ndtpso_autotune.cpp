@@ -0,0 +1,330 @@
+// Search the matcher parameters (PSO coefficients, budget, cell and frame
+// sizes, ...) for the best trade-offs between the accuracy and the CPU time
+// on recorded sessions with a reference trajectory: each candidate is
+// replayed on all the sessions (several replays at once, each on a single
+// thread), and the Pareto front of the trajectory error against the CPU time
+// per scan is printed as launch file parameters.
+// The sessions file is the one of ndtpso_slam_batch (the reference is
+// required), the search space file lists one parameter per line:
+//   name value1 value2 ...
+// A grid search tries all the combinations of the values, a random search
+// draws 'samples' candidates, uniformly between the smallest and the largest
+// value of each numerical parameter (rounded if the values are integers)
+#include "ndtpso_slam/evaluation.h"
+#include "ndtpso_slam/scanlog.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#define DEFAULT_SAMPLES 64
+#define DEFAULT_SEED 0
+
+typedef vector<std::pair<std::string, std::string>> Candidate;
+
+struct SearchParameter {
+  std::string name;
+  vector<std::string> values;
+  bool numerical{true}, integer{true};
+  double min{0.}, max{0.};
+};
+
+// The hand-picked defaults (see config.h) are within these ranges
+static const char *default_space[] = {
+    "pso_w .6 .8 1",          "pso_c1 1.5 2 2.5",      "pso_c2 1.5 2 2.5",
+    "pso_w_dumping .9 .95 1", "population 10 20 30",   "iterations 20 35 50",
+    "cell_side .25 .5 1",     "frame_size 50 100"};
+
+static bool parse_parameter(const std::string &line, SearchParameter &param) {
+  std::istringstream fields(line);
+
+  if (!(fields >> param.name) || '#' == param.name[0])
+    return false;
+
+  std::string value;
+
+  while (fields >> value) {
+    char *end;
+    double number = strtod(value.c_str(), &end);
+
+    if (*end) {
+      param.numerical = false;
+    } else {
+      param.integer = param.integer && number == floor(number);
+      param.min = param.values.empty() ? number : std::min(param.min, number);
+      param.max = param.values.empty() ? number : std::max(param.max, number);
+    }
+
+    param.values.push_back(value);
+  }
+
+  return !param.values.empty();
+}
+
+static bool load_space(const char *filename, vector<SearchParameter> &space) {
+  std::ifstream space_file(filename);
+
+  if (!space_file) {
+    printf("%s: Cannot open file \"%s\"\n", __func__, filename);
+    return false;
+  }
+
+  std::string line;
+  SearchParameter param;
+
+  while (std::getline(space_file, line)) {
+    if (parse_parameter(line, param))
+      space.push_back(param);
+    param = SearchParameter();
+  }
+
+  return !space.empty();
+}
+
+static std::string format_number(double value, bool integer) {
+  char text[32];
+  if (integer)
+    snprintf(text, sizeof(text), "%ld", lround(value));
+  else
+    snprintf(text, sizeof(text), "%.3g", value);
+
+  return text;
+}
+
+static void grid_candidates(const vector<SearchParameter> &space,
+                            vector<Candidate> &candidates) {
+  // Mixed radix counter over the values of the parameters
+  vector<size_t> digits(space.size(), 0);
+
+  for (;;) {
+    Candidate candidate;
+    for (size_t p = 0; p < space.size(); ++p)
+      candidate.emplace_back(space[p].name, space[p].values[digits[p]]);
+    candidates.push_back(std::move(candidate));
+
+    size_t p = 0;
+    for (; p < space.size(); ++p) {
+      if (++digits[p] < space[p].values.size())
+        break;
+      digits[p] = 0;
+    }
+
+    if (p == space.size())
+      return;
+  }
+}
+
+static void random_candidates(const vector<SearchParameter> &space,
+                              unsigned int samples, unsigned int seed,
+                              vector<Candidate> &candidates) {
+  std::mt19937 generator(seed);
+
+  for (unsigned int i = 0; i < samples; ++i) {
+    Candidate candidate;
+
+    for (auto &param : space) {
+      if (param.numerical) {
+        std::uniform_real_distribution<double> range(param.min, param.max);
+        candidate.emplace_back(param.name,
+                               format_number(range(generator), param.integer));
+      } else {
+        std::uniform_int_distribution<size_t> pick(0, param.values.size() - 1);
+        candidate.emplace_back(param.name, param.values[pick(generator)]);
+      }
+    }
+
+    candidates.push_back(std::move(candidate));
+  }
+}
+
+struct LoadedSession {
+  const Session *session;
+  vector<ScanRecord> scans;
+  vector<PoseRecord> reference;
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s sessions.txt [space.txt|-] [random|grid] [samples] "
+           "[parallel_jobs] [seed]\n",
+           argv[0]);
+    return 1;
+  }
+
+  bool grid = argc > 3 && 0 == strcmp(argv[3], "grid");
+  auto samples = static_cast<unsigned int>(
+      argc > 4 ? atoi(argv[4]) : DEFAULT_SAMPLES);
+  // All the cores by default, the replays are single threaded
+  int parallel_jobs =
+      argc > 5 ? atoi(argv[5])
+               : static_cast<int>(std::thread::hardware_concurrency());
+  auto seed =
+      static_cast<unsigned int>(argc > 6 ? atoi(argv[6]) : DEFAULT_SEED);
+
+  vector<Session> sessions;
+  if (!load_sessions(argv[1], sessions))
+    return 1;
+
+  vector<SearchParameter> space;
+
+  if (argc > 2 && 0 != strcmp(argv[2], "-")) {
+    if (!load_space(argv[2], space))
+      return 1;
+  } else {
+    for (auto line : default_space) {
+      SearchParameter param;
+      parse_parameter(line, param);
+      space.push_back(param);
+    }
+  }
+
+  // Checks the names and values once, for all the candidates
+  for (auto &param : space) {
+    MatcherConfig config;
+    for (auto &value : param.values) {
+      if (!set_matcher_parameter(config, param.name, value)) {
+        printf("Bad parameter \"%s=%s\"\n", param.name.c_str(),
+               value.c_str());
+        return 1;
+      }
+    }
+  }
+
+  vector<LoadedSession> loaded(sessions.size());
+
+  for (size_t s = 0; s < sessions.size(); ++s) {
+    auto &session = sessions[s];
+
+    if (!session.error.empty() || session.reference.empty()) {
+      printf("[%s] %s\n", session.name.c_str(),
+             session.error.empty() ? "no reference" : session.error.c_str());
+      return 1;
+    }
+
+    loaded[s].session = &session;
+    if (!load_scan_log(session.scans.c_str(), loaded[s].scans) ||
+        !load_pose_log(session.reference.c_str(), loaded[s].reference))
+      return 1;
+
+    std::sort(loaded[s].reference.begin(), loaded[s].reference.end(),
+              [](const PoseRecord &a, const PoseRecord &b) {
+                return a.timestamp < b.timestamp;
+              });
+  }
+
+  // The defaults are the first candidate, as a baseline
+  vector<Candidate> candidates(1);
+  if (grid)
+    grid_candidates(space, candidates);
+  else
+    random_candidates(space, samples, seed, candidates);
+
+  size_t tasks = candidates.size() * sessions.size();
+  parallel_jobs =
+      std::max(1, std::min(parallel_jobs, static_cast<int>(tasks)));
+  printf("%lu candidates (%s search), %lu sessions, %d replays at once\n",
+         candidates.size(), grid ? "grid" : "random", sessions.size(),
+         parallel_jobs);
+  fflush(stdout);
+
+  srand(seed);
+
+  // One result per candidate and session
+  vector<SessionResult> results(tasks);
+  std::atomic<size_t> next_task{0}, finished{0};
+  std::mutex print_mutex;
+
+  auto worker = [&]() {
+    for (size_t t = next_task++; t < tasks; t = next_task++) {
+      auto &candidate = candidates[t / sessions.size()];
+      auto &session = loaded[t % sessions.size()];
+
+      MatcherConfig config = session.session->config;
+      for (auto &param : candidate)
+        set_matcher_parameter(config, param.first, param.second);
+      config.ndt.psoConfig.num_threads = config.ndt.cmaesConfig.num_threads =
+          config.ndt.deConfig.num_threads = 1;
+
+      replay_session(session.scans, session.reference, config, results[t]);
+
+      std::lock_guard<std::mutex> lock(print_mutex);
+      fprintf(stderr, "\r%lu/%lu", static_cast<unsigned long>(++finished),
+              static_cast<unsigned long>(tasks));
+    }
+  };
+
+  vector<std::thread> workers;
+  for (int w = 0; w < parallel_jobs; ++w)
+    workers.emplace_back(worker);
+  for (auto &w : workers)
+    w.join();
+  fprintf(stderr, "\n");
+
+  // All the sessions of each candidate
+  vector<SessionResult> totals(candidates.size());
+  for (size_t t = 0; t < tasks; ++t)
+    totals[t / sessions.size()].merge(results[t]);
+
+  // A candidate is on the front if no other one is at least as good on both
+  // the error and the CPU time, and better on one of them
+  auto error = [&](size_t c) { return totals[c].transRMSE(); };
+  auto cpu = [&](size_t c) {
+    return 1000. * totals[c].cpu / std::max(1u, totals[c].scans);
+  };
+  vector<bool> front(candidates.size(), true);
+
+  for (size_t a = 0; a < candidates.size(); ++a) {
+    for (size_t b = 0; b < candidates.size() && front[a]; ++b) {
+      front[a] = !(error(b) <= error(a) && cpu(b) <= cpu(a) &&
+                   (error(b) < error(a) || cpu(b) < cpu(a)));
+    }
+  }
+
+  vector<size_t> order(candidates.size());
+  for (size_t c = 0; c < order.size(); ++c)
+    order[c] = c;
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return cpu(a) < cpu(b); });
+
+  printf("%1s %5s %10s %10s %6s %10s  %s\n", "", "#", "ate_m", "ate_rad",
+         "bad_%", "cpu_ms", "parameters");
+
+  for (auto c : order) {
+    printf("%1s %5lu %10.4f %10.5f %6.1f %10.3f ", front[c] ? "*" : "",
+           static_cast<unsigned long>(c), error(c), totals[c].rotRMSE(),
+           100. * totals[c].bad / std::max(1u, totals[c].scans), cpu(c));
+
+    if (candidates[c].empty())
+      printf(" (defaults)");
+    for (auto &param : candidates[c])
+      printf(" %s=%s", param.first.c_str(), param.second.c_str());
+    printf("\n");
+  }
+
+  // The front, from the cheapest to the most accurate
+  printf("\nPareto front (* above), as launch file parameters:\n");
+
+  for (auto c : order) {
+    if (!front[c])
+      continue;
+
+    printf("\n<!-- #%lu: %.4fm, %.3fms per scan -->\n",
+           static_cast<unsigned long>(c), error(c), cpu(c));
+    if (candidates[c].empty())
+      printf("<!-- defaults -->\n");
+    for (auto &param : candidates[c])
+      printf("<param name=\"%s\" value=\"%s\"/>\n", param.first.c_str(),
+             param.second.c_str());
+  }
+
+  return 0;
+}
@@ -0,0 +1,176 @@
+// Replay many recorded sessions (e.g. a nightly regression corpus) with the
+// Matcher, several jobs at once, and report the accuracy (against a reference
+// trajectory, if given) and the matching latency of each job and of the
+// whole batch. A jobs file lists one job per line:
+//   name scans.csv [reference.csv] [parameter=value ...]
+// the parameters have the names of the node's ones (see
+// 'set_matcher_parameter')
+#include "ndtpso_slam/evaluation.h"
+#include "ndtpso_slam/scanlog.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define DEFAULT_THREADS_PER_JOB 1
+
+typedef std::chrono::high_resolution_clock Clock;
+
+struct JobResult : SessionResult {
+  bool done{false};
+  std::string error;
+  double wall{0.};
+};
+
+static void run_job(const Session &job, int threads, JobResult &result) {
+  vector<ScanRecord> scans;
+  vector<PoseRecord> reference;
+
+  if (!load_scan_log(job.scans.c_str(), scans)) {
+    result.error = "can't load the scans";
+    return;
+  }
+
+  if (!job.reference.empty()) {
+    if (!load_pose_log(job.reference.c_str(), reference)) {
+      result.error = "can't load the reference";
+      return;
+    }
+
+    std::sort(reference.begin(), reference.end(),
+              [](const PoseRecord &a, const PoseRecord &b) {
+                return a.timestamp < b.timestamp;
+              });
+  }
+
+  MatcherConfig config = job.config;
+  config.ndt.psoConfig.num_threads = config.ndt.cmaesConfig.num_threads =
+      config.ndt.deConfig.num_threads = threads;
+
+  auto start = Clock::now();
+  replay_session(scans, reference, config, result);
+  result.wall = std::chrono::duration<double>(Clock::now() - start).count();
+  result.done = true;
+}
+
+static double percentile(vector<double> values, double ratio) {
+  if (values.empty())
+    return 0.;
+
+  auto index = static_cast<size_t>(ratio * (values.size() - 1));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+
+  return values[index];
+}
+
+static void print_row(const char *name, const JobResult &result) {
+  double mean = 0.;
+  for (auto latency : result.latencies)
+    mean += latency;
+  mean /= std::max<size_t>(1, result.latencies.size());
+
+  printf("%-16s %6u %6.1f", name, result.scans,
+         100. * result.bad / std::max(1u, result.scans));
+
+  if (result.evaluated > 0)
+    printf(" %10.4f %10.5f %10.4f", result.transRMSE(), result.rotRMSE(),
+           result.final_trans);
+  else
+    printf(" %10s %10s %10s", "-", "-", "-");
+
+  printf(" %8.2f %8.2f %8.2f %8.1f\n", mean,
+         percentile(result.latencies, .95),
+         result.latencies.empty()
+             ? 0.
+             : *std::max_element(result.latencies.begin(),
+                                 result.latencies.end()),
+         result.wall);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s jobs.txt [threads_per_job] [parallel_jobs]\n", argv[0]);
+    return 1;
+  }
+
+  int threads = std::max(1, argc > 2 ? atoi(argv[2])
+                                     : DEFAULT_THREADS_PER_JOB);
+  // All the cores by default
+  auto cores = static_cast<int>(
+      std::max(1u, std::thread::hardware_concurrency()));
+  int parallel_jobs =
+      std::max(1, argc > 3 ? atoi(argv[3]) : cores / threads);
+
+  vector<Session> jobs;
+  if (!load_sessions(argv[1], jobs))
+    return 1;
+
+  parallel_jobs = std::min(parallel_jobs, static_cast<int>(jobs.size()));
+  printf("%lu jobs, %d at once, %d threads per job\n", jobs.size(),
+         parallel_jobs, threads);
+  fflush(stdout);
+
+  vector<JobResult> results(jobs.size());
+  std::atomic<size_t> next_job{0};
+  std::mutex print_mutex;
+  auto batch_start = Clock::now();
+
+  // Each worker takes the next job until none is left
+  auto worker = [&]() {
+    for (size_t j = next_job++; j < jobs.size(); j = next_job++) {
+      if (jobs[j].error.empty())
+        run_job(jobs[j], threads, results[j]);
+      else
+        results[j].error = jobs[j].error;
+
+      std::lock_guard<std::mutex> lock(print_mutex);
+      fprintf(stderr, "[%s] %s\n", jobs[j].name.c_str(),
+              results[j].done ? "done" : results[j].error.c_str());
+    }
+  };
+
+  vector<std::thread> workers;
+  for (int w = 0; w < parallel_jobs; ++w)
+    workers.emplace_back(worker);
+  for (auto &w : workers)
+    w.join();
+
+  double batch_wall =
+      std::chrono::duration<double>(Clock::now() - batch_start).count();
+
+  printf("%-16s %6s %6s %10s %10s %10s %8s %8s %8s %8s\n", "job", "scans",
+         "bad_%", "ate_m", "ate_rad", "final_m", "mean_ms", "p95_ms",
+         "max_ms", "wall_s");
+
+  // The whole batch: the scans of all the jobs, and the errors weighted by
+  // the number of evaluated scans
+  JobResult total;
+  unsigned int failed = 0;
+
+  for (size_t j = 0; j < jobs.size(); ++j) {
+    auto &result = results[j];
+
+    if (!result.done) {
+      printf("%-16s %s\n", jobs[j].name.c_str(), result.error.c_str());
+      ++failed;
+      continue;
+    }
+
+    print_row(jobs[j].name.c_str(), result);
+
+    total.merge(result);
+  }
+
+  total.wall = batch_wall;
+  print_row("(all)", total);
+
+  if (failed > 0)
+    printf("%u failed jobs\n", failed);
+
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,685 @@
+// Differential tests of the optimized kernels against straightforward
+// reference implementations, on random inputs and, if given, on recorded
+// scans (scans.csv, see scan_export):
+// - laser conversion with the cached beam table (contiguous and strided)
+//   against laser_to_point, bit exact
+// - deskewing (Taylor expansion of the rotation) against the exact rotation,
+//   within the bound of the truncated terms
+// - transform_point against an Eigen rotation, within the rounding bound
+// - map update (radix sorted, parallel insertion) against inserting the
+//   points one by one, and parallel build against serial build, bit exact
+// - matching view patched with the dirty and evicted cells against building
+//   it from all the cells, bit exact
+// - cell distributions against a two-pass mean and covariance
+// - cost function (compact matching cells) against a loop on the cells, for
+//   all the losses, and the cost of score_derivatives
+// - with NDT_DECAY_FORGETTING (default build), the weight of the cells not
+//   observed anymore against its half-life decay
+// The parallel paths run with TEST_THREADS threads, even on a single core.
+// The exit status is the number of failed checks (0 if all passed).
+#include "ndtpso_slam/core.h"
+#include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/scanlog.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/Eigenvalues>
+#include <eigen3/Eigen/Geometry>
+#include <limits>
+#include <omp.h>
+#include <random>
+#include <string>
+
+#define TEST_SEED 42
+#define TEST_THREADS 4
+#define TEST_RANDOM_SCANS 8
+#define TEST_RANDOM_BEAMS 8192 // Above NDT_PARALLEL_UPDATE_MIN_POINTS
+#define TEST_RECORDED_SCANS 32 // Evenly spaced in the log
+#define TEST_POSES_PER_SCAN 8  // Cost evaluations around the scan's pose
+#define TEST_TRANSFORMS 100000
+#define TEST_MAX_REPORTED 5 // Mismatches printed per check
+#define MAP_SIZE_M 30
+#define MAP_CELL_SIZE_M .5
+#define SCAN_FRAME_SIZE_M 100
+
+using namespace Eigen;
+
+// Distance in units in the last place, the doubles are mapped to integers
+// in the same order (the negative ones are mirrored)
+static uint64_t ulp_distance(double a, double b) {
+  if (a == b || (std::isnan(a) && std::isnan(b)))
+    return 0;
+  if (std::isnan(a) || std::isnan(b))
+    return std::numeric_limits<uint64_t>::max();
+
+  int64_t ia, ib;
+  memcpy(&ia, &a, sizeof(a));
+  memcpy(&ib, &b, sizeof(b));
+  if (ia < 0)
+    ia = std::numeric_limits<int64_t>::min() - ia;
+  if (ib < 0)
+    ib = std::numeric_limits<int64_t>::min() - ib;
+
+  return ia > ib ? uint64_t(ia) - uint64_t(ib) : uint64_t(ib) - uint64_t(ia);
+}
+
+// The comparisons of a kernel against its reference, a value either within
+// 'max_ulps' of the reference or within 'bound' of it
+class Check {
+private:
+  std::string s_name;
+  unsigned long s_compared{0}, s_failed{0};
+  uint64_t s_worst_ulps{0};
+  double s_worst_ratio{0.}; // Largest error relative to its bound
+  bool s_tolerance{false};
+
+  void s_mismatch(const char *what, size_t index, double value,
+                  double reference) {
+    if (++this->s_failed <= TEST_MAX_REPORTED)
+      printf("  %s: scan %u, %s %lu: %.17g, reference %.17g\n",
+             this->s_name.c_str(), this->scan, what,
+             static_cast<unsigned long>(index), value, reference);
+  }
+
+public:
+  unsigned int scan{0}; // Reported with the mismatches
+
+  explicit Check(std::string name) : s_name(std::move(name)) {}
+
+  void ulps(double value, double reference, uint64_t max_ulps,
+            const char *what, size_t index = 0) {
+    uint64_t distance = ulp_distance(value, reference);
+
+    ++this->s_compared;
+    this->s_worst_ulps = std::max(this->s_worst_ulps, distance);
+    if (distance > max_ulps)
+      this->s_mismatch(what, index, value, reference);
+  }
+
+  inline void exact(double value, double reference, const char *what,
+                    size_t index = 0) {
+    this->ulps(value, reference, 0, what, index);
+  }
+
+  void near(double value, double reference, double bound, const char *what,
+            size_t index = 0) {
+    double error = fabs(value - reference);
+
+    ++this->s_compared;
+    this->s_tolerance = true;
+    if (bound > 0.)
+      this->s_worst_ratio = std::max(this->s_worst_ratio, error / bound);
+    if (!(error <= bound))
+      this->s_mismatch(what, index, value, reference);
+  }
+
+  // Print the result, a check comparing nothing fails
+  bool report() const {
+    bool passed = this->s_compared > 0 && 0 == this->s_failed;
+
+    printf("%s %-28s %9lu values", passed ? "PASS" : "FAIL",
+           this->s_name.c_str(), this->s_compared);
+    if (this->s_tolerance)
+      printf(", max error %.3g of the bound", this->s_worst_ratio);
+    else
+      printf(", max %lu ulp", static_cast<unsigned long>(this->s_worst_ulps));
+    if (this->s_failed > 0)
+      printf(", %lu mismatches", this->s_failed);
+    printf("\n");
+
+    return passed;
+  }
+};
+
+// A scan of a rectangular room with clutter, with some invalid ranges (no
+// return and out of range)
+static ScanRecord random_scan(std::mt19937 &generator) {
+  std::uniform_real_distribution<double> uniform(0., 1.);
+  std::normal_distribution<double> noise(0., .01);
+  ScanRecord scan;
+
+  scan.angle_min = float(-M_PI);
+  scan.angle_increment = float(2. * M_PI / TEST_RANDOM_BEAMS);
+  scan.range_max = 12.f;
+  scan.time_increment = float(.1 / TEST_RANDOM_BEAMS);
+  scan.ranges.resize(TEST_RANDOM_BEAMS);
+
+  double half_width = 4. + 5. * uniform(generator),
+         half_height = 4. + 5. * uniform(generator);
+
+  for (unsigned int i = 0; i < TEST_RANDOM_BEAMS; ++i) {
+    double theta = double(
+               index_to_angle(i, scan.angle_increment, scan.angle_min)),
+           c = fabs(cos(theta)), s = fabs(sin(theta));
+    double wall = std::min(c > 1e-9 ? half_width / c : HUGE_VAL,
+                           s > 1e-9 ? half_height / s : HUGE_VAL);
+    double draw = uniform(generator);
+
+    scan.ranges[i] = float(draw < .02   ? 0.
+                           : draw < .04 ? double(scan.range_max) + 1.
+                           : draw < .34 ? wall * uniform(generator)
+                                        : wall + noise(generator));
+  }
+
+  return scan;
+}
+
+// The points of a scan frame (a single cell)
+static const vector<Vector2d> &scan_points(const NDTFrame &scan_frame) {
+  return scan_frame.cells[0].points[0];
+}
+
+// The valid beams of 'scan', and their points with laser_to_point
+static void reference_points(const ScanRecord &scan,
+                             vector<unsigned int> &beams,
+                             vector<Vector2d> &points) {
+  for (unsigned int i = 0; i < scan.ranges.size(); ++i) {
+    float range = scan.ranges[i];
+
+    if (range < scan.range_max && range > LASER_IGNORE_EPSILON) {
+      beams.push_back(i);
+      points.push_back(laser_to_point(
+          range, index_to_angle(i, scan.angle_increment, scan.angle_min)));
+    }
+  }
+}
+
+static void check_beams(Check &contiguous, Check &strided,
+                        const ScanRecord &scan) {
+  NDTFrame frame(Vector3d::Zero(), SCAN_FRAME_SIZE_M, SCAN_FRAME_SIZE_M,
+                 SCAN_FRAME_SIZE_M, false),
+      strided_frame(Vector3d::Zero(), SCAN_FRAME_SIZE_M, SCAN_FRAME_SIZE_M,
+                    SCAN_FRAME_SIZE_M, false);
+  vector<unsigned int> beams;
+  vector<Vector2d> expected;
+
+  reference_points(scan, beams, expected);
+  frame.loadLaser(scan.ranges, scan.angle_min, scan.angle_increment,
+                  scan.range_max);
+
+  auto &points = scan_points(frame);
+  contiguous.exact(points.size(), expected.size(), "count");
+
+  for (size_t i = 0; i < std::min(points.size(), expected.size()); ++i) {
+    contiguous.exact(points[i].x(), expected[i].x(), "x", i);
+    contiguous.exact(points[i].y(), expected[i].y(), "y", i);
+  }
+
+  // Interleaved with other channels (NaN, never read)
+  const size_t stride = 3;
+  vector<float> buffer(scan.ranges.size() * stride,
+                       std::numeric_limits<float>::quiet_NaN());
+  for (size_t i = 0; i < scan.ranges.size(); ++i)
+    buffer[i * stride] = scan.ranges[i];
+
+  strided_frame.loadLaser(buffer.data(), scan.ranges.size(), stride,
+                          scan.angle_min, scan.angle_increment,
+                          scan.range_max);
+
+  auto &strided_points = scan_points(strided_frame);
+  strided.exact(strided_points.size(), points.size(), "count");
+
+  for (size_t i = 0; i < std::min(points.size(), strided_points.size());
+       ++i) {
+    strided.exact(strided_points[i].x(), points[i].x(), "x", i);
+    strided.exact(strided_points[i].y(), points[i].y(), "y", i);
+  }
+}
+
+static void check_deskew(Check &check, const ScanRecord &scan,
+                         const Vector3d &velocity) {
+  NDTFrame frame(Vector3d::Zero(), SCAN_FRAME_SIZE_M, SCAN_FRAME_SIZE_M,
+                 SCAN_FRAME_SIZE_M, false);
+  vector<unsigned int> beams;
+  vector<Vector2d> expected;
+
+  reference_points(scan, beams, expected);
+  frame.loadLaser(scan.ranges, scan.angle_min, scan.angle_increment,
+                  scan.range_max, scan.time_increment, velocity);
+
+  auto &points = scan_points(frame);
+  check.exact(points.size(), expected.size(), "count");
+
+  for (size_t i = 0; i < std::min(points.size(), expected.size()); ++i) {
+    double t = beams[i] * double(scan.time_increment),
+           rotation = velocity.z() * t, range = expected[i].norm();
+    Vector2d exact =
+        Rotation2Dd(rotation) * expected[i] + velocity.head<2>() * t;
+    // The first truncated terms of the Taylor expansion of sin and cos (the
+    // next ones are smaller), and some slack for the rounding
+    double bound = range * (pow(fabs(rotation), 5) / 120. +
+                            pow(rotation, 6) / 720.) +
+                   1e-12 * (1. + range);
+
+    check.near(points[i].x(), exact.x(), bound, "x", i);
+    check.near(points[i].y(), exact.y(), bound, "y", i);
+  }
+}
+
+static void check_transform(Check &check, std::mt19937 &generator) {
+  std::uniform_real_distribution<double> coordinate(-50., 50.),
+      angle(-M_PI, M_PI);
+  const double epsilon = std::numeric_limits<double>::epsilon();
+
+  for (size_t i = 0; i < TEST_TRANSFORMS; ++i) {
+    Vector2d point(coordinate(generator), coordinate(generator));
+    Vector3d trans(coordinate(generator), coordinate(generator),
+                   angle(generator));
+    Vector2d value = transform_point(point, trans),
+             reference = Rotation2Dd(trans.z()) * point + trans.head<2>();
+    // A few roundings of the magnitudes involved
+    double bound = 4. * epsilon *
+                   (point.cwiseAbs().sum() + trans.head<2>().cwiseAbs().sum());
+
+    check.near(value.x(), reference.x(), bound, "x", i);
+    check.near(value.y(), reference.y(), bound, "y", i);
+  }
+}
+
+// The matching distribution of the cell 'c', compared through the match
+// index (the order of the match cells depends on the builds history)
+static void compare_match_cells(Check &check, const MatchCell *cell,
+                                const MatchCell *expected, size_t c) {
+  check.exact(nullptr == cell, nullptr == expected, "culled", c);
+  if (!cell || !expected)
+    return;
+
+  for (Index k = 0; k < 2; ++k)
+    check.exact(cell->mean[k], expected->mean[k], "mean", c);
+  for (Index k = 0; k < 4; ++k)
+    check.exact(cell->inv_covar(k), expected->inv_covar(k),
+                "inverse covariance", c);
+  check.exact(cell->weight, expected->weight, "weight", c);
+}
+
+// The points of all the cells (all the windows) and the matching view
+static void compare_maps(Check &points_check, Check &build_check,
+                         const NDTFrame &map, const NDTFrame &reference) {
+  for (size_t c = 0; c < map.cells.size(); ++c) {
+    auto &cell = map.cells[c], &reference_cell = reference.cells[c];
+
+    for (size_t w = 0; w < NDT_POINTS_BUFFERS; ++w) {
+      auto &points = cell.points[w], &expected = reference_cell.points[w];
+
+      if (points.empty() && expected.empty())
+        continue;
+
+      points_check.exact(points.size(), expected.size(), "cell size", c);
+      for (size_t i = 0; i < std::min(points.size(), expected.size()); ++i) {
+        points_check.exact(points[i].x(), expected[i].x(), "x", c);
+        points_check.exact(points[i].y(), expected[i].y(), "y", c);
+      }
+    }
+
+    compare_match_cells(build_check, map.matchCell(static_cast<int>(c)),
+                        reference.matchCell(static_cast<int>(c)), c);
+  }
+
+  build_check.exact(map.matchCells.size(), reference.matchCells.size(),
+                    "match cells");
+}
+
+// The matching view patched by the incremental builds against building it
+// from all the cells, culled as in CullingConfig
+static void check_match_view(Check &check, NDTFrame &map,
+                             const CullingConfig &culling) {
+  size_t count = 0;
+
+  for (unsigned int c = 0; c < map.numOfCells; ++c) {
+    auto &cell = map.cells[c];
+    double points = map.numOfPoints(c);
+    MatchCell expected{cell.mean, cell.inverseCovariance(),
+                       (culling.full_points > 0.)
+                           ? std::min(1., points / culling.full_points)
+                           : 1.};
+    bool culled = !cell.built || points < culling.min_points ||
+                  cell.condition() < culling.min_condition;
+
+    compare_match_cells(check, map.matchCell(static_cast<int>(c)),
+                        culled ? nullptr : &expected, c);
+    count += culled ? 0 : 1;
+  }
+
+  check.exact(map.matchCells.size(), count, "match cells");
+}
+
+// The cells of a map built from a single scan, against the sample mean and
+// covariance of their points (regularized as in NDTCell)
+static void check_cells(Check &check, const NDTFrame &map) {
+  const double epsilon = std::numeric_limits<double>::epsilon();
+
+  for (size_t c = 0; c < map.cells.size(); ++c) {
+    auto &cell = map.cells[c];
+    auto &points = cell.points[0];
+
+    if (!cell.created || points.size() <= 2) {
+      check.exact(cell.built, false, "built", c);
+      continue;
+    }
+
+    check.exact(cell.built, true, "built", c);
+
+    Vector2d mean = Vector2d::Zero();
+    for (auto &point : points)
+      mean += point;
+    mean /= points.size();
+
+    Matrix2d covar = Matrix2d::Zero();
+    for (auto &point : points)
+      covar += (point - mean) * (point - mean).transpose();
+    covar /= points.size();
+
+    double bound = 4. * epsilon * points.size() * MAP_SIZE_M;
+    check.near(cell.mean.x(), mean.x(), bound, "mean x", c);
+    check.near(cell.mean.y(), mean.y(), bound, "mean y", c);
+
+    SelfAdjointEigenSolver<Matrix2d> solver(covar);
+    double small_val = solver.eigenvalues()[0],
+           large_val = solver.eigenvalues()[1],
+           condition = large_val > 0. ? small_val / large_val : 0.;
+
+    // Too close to the regularization threshold to tell the branch
+    if (fabs(condition - .001) < 1e-4)
+      continue;
+
+    double det = condition < .001 ? .001 * large_val * large_val
+                                  : covar.determinant();
+    Matrix2d inv_covar;
+    inv_covar << covar(1, 1) / det, -covar(0, 1) / det, -covar(1, 0) / det,
+        covar(0, 0) / det;
+
+    check.near(cell.condition(), condition, 1e-8, "condition", c);
+    for (Index k = 0; k < 4; ++k)
+      check.near(cell.inverseCovariance()(k), inv_covar(k),
+                 1e-8 * inv_covar.norm(), "inverse covariance", c);
+  }
+}
+
+// Reference of cost_function: a loop on the cells of the map (instead of the
+// compact matching view), culled as in CullingConfig
+template <typename Loss>
+static double reference_cost(const Vector3d &trans, NDTFrame &map,
+                             const NDTFrame &scan_frame,
+                             const CullingConfig &culling) {
+  const Loss loss;
+  double cost = 0.;
+
+  for (auto &scan_point : scan_points(scan_frame)) {
+    Vector2d point = transform_point(scan_point, trans);
+    int index = map.getCellIndex(point, map.widthNumOfCells, map.cell_side);
+    const NDTCell *cell =
+        (-1 == index) ? nullptr : &map.cells[static_cast<size_t>(index)];
+
+    double points =
+        cell ? map.numOfPoints(static_cast<unsigned int>(index)) : 0.;
+
+    if (!cell || !cell->built || points < culling.min_points ||
+        cell->condition() < culling.min_condition) {
+      if (Loss::penalize_no_cell)
+        cost += loss.noCell();
+      continue;
+    }
+
+    double weight = (culling.full_points > 0.)
+                        ? std::min(1., points / culling.full_points)
+                        : 1.;
+    Vector2d diff = point - cell->mean;
+    cost += weight * loss(diff.dot(cell->inverseCovariance() * diff));
+  }
+
+  return cost;
+}
+
+template <typename Loss>
+static void check_cost(Check &check, const Vector3d &trans, NDTFrame &map,
+                       const NDTFrame &scan_frame,
+                       const CullingConfig &culling, size_t index) {
+  // Each point adds at most 1 (or the no cell penalty), summed in the same
+  // order
+  double bound = 4. * std::numeric_limits<double>::epsilon() *
+                 scan_points(scan_frame).size() *
+                 std::max(1., fabs(NDT_NO_CELL_PENALTY));
+
+  check.near(cost_function<Loss>(trans, &map, &scan_frame),
+             reference_cost<Loss>(trans, map, scan_frame, culling), bound,
+             "pose", index);
+}
+
+struct KernelChecks {
+  Check beams{"beams"}, strided_beams{"beams (strided)"}, deskew{"deskew"},
+      update{"update (parallel)"}, build{"build (parallel)"},
+      match_view{"match view (incremental)"}, cells{"cell distributions"}, cost_gaussian{"cost (gaussian)"},
+      cost_huber{"cost (huber)"}, cost_cauchy{"cost (cauchy)"},
+      cost_gated{"cost (gated gaussian)"},
+      derivatives{"score_derivatives cost"};
+  unsigned int min_points{UINT32_MAX}, min_dirty_cells{UINT32_MAX};
+
+  vector<Check *> all() {
+    return {&this->beams,         &this->strided_beams, &this->deskew,
+            &this->update,        &this->build,         &this->match_view,
+            &this->cells,         &this->cost_gaussian, &this->cost_huber,
+            &this->cost_cauchy,   &this->cost_gated,    &this->derivatives};
+  }
+
+  // Print the results, returns the number of failed checks
+  unsigned int report() {
+    printf("Smallest scan: %u points on %u cells (parallel from %d points "
+           "and %d cells)\n",
+           this->min_points, this->min_dirty_cells,
+           NDT_PARALLEL_UPDATE_MIN_POINTS, NDT_PARALLEL_BUILD_MIN_CELLS);
+
+    unsigned int failed = 0;
+    for (auto check : this->all())
+      failed += check->report() ? 0 : 1;
+
+    return failed;
+  }
+};
+
+// All the checks on a sequence of scans, inserted in a map at random poses
+// (the map doesn't need to be consistent)
+static void check_scans(KernelChecks &checks, const vector<ScanRecord> &scans,
+                        std::mt19937 &generator) {
+  std::uniform_real_distribution<double> position(-1., 1.),
+      angle(-M_PI, M_PI), offset(-.2, .2), velocity(-2., 2.),
+      rotation_speed(-3., 3.);
+
+  NDTPSOConfig parallel_config, serial_config;
+  // Some culling, to check the weights of the matching view
+  parallel_config.culling.min_points = 5;
+  parallel_config.culling.min_condition = .01;
+  parallel_config.culling.full_points = 20;
+  // The far cells (the corners of the scans) are released and created again,
+  // they leave and enter the matching view
+  parallel_config.eviction.max_distance = 8.;
+  parallel_config.eviction.period = 1;
+  parallel_config.psoConfig.num_threads = TEST_THREADS;
+  serial_config = parallel_config;
+  serial_config.psoConfig.num_threads = 1;
+
+  NDTFrame map(Vector3d::Zero(), MAP_SIZE_M, MAP_SIZE_M, MAP_CELL_SIZE_M,
+               true, parallel_config),
+      reference(Vector3d::Zero(), MAP_SIZE_M, MAP_SIZE_M, MAP_CELL_SIZE_M,
+                true, serial_config);
+  NDTFrame scan_frame(Vector3d::Zero(), SCAN_FRAME_SIZE_M, SCAN_FRAME_SIZE_M,
+                      SCAN_FRAME_SIZE_M, false);
+
+  for (unsigned int s = 0; s < scans.size(); ++s) {
+    auto &scan = scans[s];
+
+    for (auto check : checks.all())
+      check->scan = s;
+
+    // Deskewing needs the time between the beams
+    ScanRecord timed = scan;
+    if (timed.time_increment <= 0.f)
+      timed.time_increment = float(.1 / scan.ranges.size());
+
+    check_beams(checks.beams, checks.strided_beams, scan);
+    check_deskew(checks.deskew, timed,
+                 Vector3d(velocity(generator), velocity(generator) / 4.,
+                          rotation_speed(generator)));
+
+    scan_frame.resetCells();
+    scan_frame.loadLaser(scan.ranges, scan.angle_min, scan.angle_increment,
+                         scan.range_max);
+
+    Vector3d pose(position(generator), position(generator), angle(generator));
+
+    // Radix sorted parallel insertion against one point at a time
+    map.update(pose, &scan_frame);
+
+    vector<bool> touched(reference.numOfCells, false);
+    unsigned int dirty_cells = 0;
+
+    for (auto &scan_point : scan_points(scan_frame)) {
+      Vector2d point = transform_point(scan_point, pose);
+      int index = reference.getCellIndex(point, reference.widthNumOfCells,
+                                         reference.cell_side);
+
+      if (-1 != index && !touched[static_cast<size_t>(index)]) {
+        touched[static_cast<size_t>(index)] = true;
+        ++dirty_cells;
+      }
+
+      reference.addPoint(point);
+    }
+    reference.evictStale(pose.head<2>());
+
+    checks.min_points = std::min(
+        checks.min_points,
+        static_cast<unsigned int>(scan_points(scan_frame).size()));
+    checks.min_dirty_cells = std::min(checks.min_dirty_cells, dirty_cells);
+
+    // The map clock advanced by 'update' (cells decay)
+    reference.setTime(s + 1.);
+
+    map.build();
+    reference.build();
+    compare_maps(checks.update, checks.build, map, reference);
+    check_match_view(checks.match_view, map, parallel_config.culling);
+
+    // The distributions of a single scan, all the points are in the first
+    // window
+    NDTFrame single(Vector3d::Zero(), MAP_SIZE_M, MAP_SIZE_M, MAP_CELL_SIZE_M,
+                    true, parallel_config);
+    single.update(pose, &scan_frame);
+    single.build();
+    check_cells(checks.cells, single);
+
+    // Matching around the scan's pose
+    auto &culling = parallel_config.culling;
+
+    for (size_t p = 0; p < TEST_POSES_PER_SCAN; ++p) {
+      Vector3d trans =
+          pose + Vector3d(offset(generator), offset(generator),
+                          offset(generator) / 2.);
+
+      check_cost<GaussianLoss>(checks.cost_gaussian, trans, map, scan_frame,
+                               culling, p);
+      check_cost<HuberLoss>(checks.cost_huber, trans, map, scan_frame,
+                            culling, p);
+      check_cost<CauchyLoss>(checks.cost_cauchy, trans, map, scan_frame,
+                             culling, p);
+      check_cost<GatedLoss<GaussianLoss>>(checks.cost_gated, trans, map,
+                                          scan_frame, culling, p);
+
+      double bound = 4. * std::numeric_limits<double>::epsilon() *
+                     scan_points(scan_frame).size();
+      checks.derivatives.near(
+          score_derivatives(trans, &map, &scan_frame).cost,
+          cost_function<GaussianLoss>(trans, &map, &scan_frame), bound,
+          "pose", p);
+    }
+  }
+}
+
+#if NDT_DECAY_FORGETTING
+// A cell observed once, then not anymore while the map is updated elsewhere:
+// its weight in the matching view must halve every half-life, without new
+// points to rebuild it
+static void check_decay(Check &check, std::mt19937 &generator) {
+  std::uniform_real_distribution<double> coordinate(1.05, 1.45);
+  const double half_life = 10., full_points = 1000., points = 100.;
+  NDTPSOConfig config;
+  config.decay.half_life = half_life;
+  config.culling.full_points = full_points;
+
+  NDTFrame map(Vector3d::Zero(), MAP_SIZE_M, MAP_SIZE_M, MAP_CELL_SIZE_M, true,
+               config);
+  Vector2d point, elsewhere(-10.2, -10.2);
+
+  for (int i = 0; i < points; ++i) {
+    point << coordinate(generator), coordinate(generator);
+    map.addPoint(point);
+  }
+
+  int index = map.getCellIndex(point, map.widthNumOfCells, map.cell_side);
+
+  for (unsigned int step = 0; step < 4; ++step) {
+    double time = step * half_life;
+    map.setTime(time);
+    if (step > 0)
+      map.addPoint(elsewhere);
+    map.build();
+
+    auto cell = map.matchCell(index);
+    double expected = exp2(-double(step)) * points / full_points;
+    check.near(cell ? cell->weight : 0., expected, 1e-15, "weight", step);
+  }
+}
+#endif
+
+int main(int argc, char **argv) {
+  // The parallel paths are limited to the available threads
+  omp_set_num_threads(TEST_THREADS);
+
+  std::mt19937 generator(TEST_SEED);
+  unsigned int failed = 0;
+
+  printf("Transforms (%d random points and poses)\n", TEST_TRANSFORMS);
+  Check transform("transform_point");
+  check_transform(transform, generator);
+  failed += transform.report() ? 0u : 1u;
+
+  vector<ScanRecord> random_scans;
+  for (unsigned int i = 0; i < TEST_RANDOM_SCANS; ++i)
+    random_scans.push_back(random_scan(generator));
+
+  printf("\nRandom inputs (%d scans of %d beams)\n", TEST_RANDOM_SCANS,
+         TEST_RANDOM_BEAMS);
+  KernelChecks random_checks;
+  check_scans(random_checks, random_scans, generator);
+  failed += random_checks.report();
+
+#if NDT_DECAY_FORGETTING
+  printf("\nDecay (half-life)\n");
+  Check decay("decay");
+  check_decay(decay, generator);
+  failed += decay.report() ? 0u : 1u;
+#endif
+
+  if (argc > 1) {
+    vector<ScanRecord> log, recorded;
+    if (!load_scan_log(argv[1], log))
+      return 1;
+
+    size_t step = std::max<size_t>(1, log.size() / TEST_RECORDED_SCANS);
+    for (size_t i = 0; i < log.size() && recorded.size() < TEST_RECORDED_SCANS;
+         i += step)
+      recorded.push_back(log[i]);
+
+    printf("\nRecorded inputs (%lu scans of \"%s\")\n", recorded.size(),
+           argv[1]);
+    KernelChecks recorded_checks;
+    check_scans(recorded_checks, recorded, generator);
+    failed += recorded_checks.report();
+  }
+
+  printf("\n%s\n", failed ? "FAILED" : "ALL PASSED");
+
+  return static_cast<int>(failed);
+}
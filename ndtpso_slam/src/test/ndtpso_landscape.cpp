@@ -0,0 +1,285 @@
+// Dump the cost landscape of a scan on its map, to see why an optimizer
+// converges slowly (flat, multimodal or discontinuous cost). The map is built
+// from the previous scans along a reference trajectory (a long PSO run, see
+// REF_*), then the cost of the scan is evaluated on a dense (x, y, theta)
+// grid centered on its reference pose. Output files:
+// - output.vol: the grid, a LandscapeHeader followed by the costs (float, x
+//   first, then y, then theta)
+// - output.swarm.csv: the positions evaluated by PSO (default config, started
+//   from the previous pose as in the node) at each iteration, if 'swarm'
+// - output.xy.png, output.xt.png, output.yt.png: the slices of the grid
+//   through the reference pose (blue is low), with the swarm projected on
+//   them (darker to lighter with the iterations), if built with OpenCV
+#include "ndtpso_slam/core.h"
+#include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/scanlog.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <eigen3/Eigen/Core>
+#include <string>
+
+#ifdef OPENCV_FOUND
+#include <opencv4/opencv2/opencv.hpp>
+#endif
+
+#define DEFAULT_STEPS 81
+#define DEFAULT_HALF_SIDE_M .5
+#define DEFAULT_HALF_ANGLE_RAD .2
+#define DEFAULT_CELL_SIZE_M .5
+#define DEFAULT_FRAME_SIZE_M 50
+#define REF_ITERATIONS 100
+#define REF_POPULATION_SIZE 60
+#define SLICE_PIXELS_PER_STEP 4
+#define LANDSCAPE_MAGIC 0x4e44544c // "NDTL"
+#define LANDSCAPE_VERSION 1
+
+using namespace Eigen;
+
+struct LandscapeHeader {
+  uint32_t magic, version;
+  uint32_t steps[3]; // Number of samples along x, y and theta
+  double center[3];  // Reference pose (the middle sample)
+  double step[3];    // Distance between two samples
+};
+
+#ifdef OPENCV_FOUND
+// A slice of the grid, 'u' and 'v' are the axes (0: x, 1: y, 2: theta) and
+// the third axis is fixed to its middle sample
+static void save_slice(const std::string &filename,
+                       const vector<float> &costs,
+                       const LandscapeHeader &header, unsigned int u,
+                       unsigned int v,
+                       const vector<vector<Vector3d>> &swarm) {
+  unsigned int w = 3 - u - v;
+  int width = static_cast<int>(header.steps[u]),
+      height = static_cast<int>(header.steps[v]);
+  cv::Mat values(height, width, CV_32F);
+
+  for (int j = 0; j < height; ++j) {
+    for (int i = 0; i < width; ++i) {
+      unsigned int index[3];
+      index[u] = static_cast<unsigned int>(i);
+      index[v] = static_cast<unsigned int>(j);
+      index[w] = header.steps[w] / 2;
+      values.at<float>(height - 1 - j, i) =
+          costs[(index[2] * header.steps[1] + index[1]) * header.steps[0] +
+                index[0]];
+    }
+  }
+
+  cv::Mat gray, image;
+  cv::normalize(values, gray, 0, 255, cv::NORM_MINMAX, CV_8U);
+  cv::applyColorMap(gray, image, cv::COLORMAP_JET);
+  cv::resize(image, image, cv::Size(), SLICE_PIXELS_PER_STEP,
+             SLICE_PIXELS_PER_STEP, cv::INTER_NEAREST);
+
+  // Pixel of a pose, projected on the slice
+  auto pixel = [&](const Vector3d &pose) {
+    double i = (pose[u] - header.center[u]) / header.step[u] +
+               header.steps[u] / 2,
+           j = (pose[v] - header.center[v]) / header.step[v] +
+               header.steps[v] / 2;
+    return cv::Point(static_cast<int>((i + .5) * SLICE_PIXELS_PER_STEP),
+                     static_cast<int>((height - j - .5) *
+                                      SLICE_PIXELS_PER_STEP));
+  };
+
+  for (size_t iteration = 0; iteration < swarm.size(); ++iteration) {
+    auto shade = static_cast<int>(
+        255. * (iteration + 1) / swarm.size());
+
+    for (auto &position : swarm[iteration])
+      cv::circle(image, pixel(position), 1, cv::Scalar(shade, shade, shade),
+                 -1);
+  }
+
+  cv::drawMarker(image,
+                 pixel(Vector3d(header.center[0], header.center[1],
+                                header.center[2])),
+                 cv::Scalar(255, 255, 255), cv::MARKER_CROSS,
+                 4 * SLICE_PIXELS_PER_STEP);
+  cv::imwrite(filename, image);
+}
+#endif
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    printf("Usage: %s scans.csv scan_index output [steps] [half_side] "
+           "[half_angle] [cell_side] [frame_size] [swarm]\n",
+           argv[0]);
+    return 1;
+  }
+
+  auto scan_index = static_cast<unsigned int>(atoi(argv[2]));
+  std::string output = argv[3];
+  // Odd, the middle sample is the reference pose
+  auto steps = static_cast<unsigned int>(
+                   std::max(3, argc > 4 ? atoi(argv[4]) : DEFAULT_STEPS)) |
+               1u;
+  double half_side = argc > 5 ? atof(argv[5]) : DEFAULT_HALF_SIDE_M;
+  double half_angle = argc > 6 ? atof(argv[6]) : DEFAULT_HALF_ANGLE_RAD;
+  double cell_side = argc > 7 ? atof(argv[7]) : DEFAULT_CELL_SIZE_M;
+  auto frame_size = static_cast<unsigned short>(
+      argc > 8 ? atoi(argv[8]) : DEFAULT_FRAME_SIZE_M);
+  bool with_swarm = argc > 9 ? 0 != atoi(argv[9]) : true;
+
+  vector<ScanRecord> scans;
+  if (!load_scan_log(argv[1], scans))
+    return 1;
+
+  if (scan_index < 1 || scan_index >= scans.size()) {
+    printf("The scan index must be in [1, %lu]\n", scans.size() - 1);
+    return 1;
+  }
+
+  srand(0);
+
+  // The map of the previous scans, and the scan's reference pose
+  NDTFrame ref_frame(Vector3d::Zero(), frame_size, frame_size, cell_side);
+  NDTFrame scan_frame(Vector3d::Zero(), frame_size, frame_size, frame_size,
+                      false);
+
+  PSOConfig ref_conf;
+  ref_conf.iterations = REF_ITERATIONS;
+  ref_conf.populationSize = REF_POPULATION_SIZE;
+
+  Vector3d pose = Vector3d::Zero(), pose_diff = Vector3d::Zero(), solution;
+  Array3d deviation;
+
+  for (unsigned int i = 0; i <= scan_index; ++i) {
+    scan_frame.resetCells();
+    scan_frame.loadLaser(scans[i].ranges, scans[i].angle_min,
+                         scans[i].angle_increment, scans[i].range_max);
+
+    if (0 == i) {
+      ref_frame.update(pose, &scan_frame);
+      continue;
+    }
+
+    deviation = i < 3 ? Array3d(.1, .1, 3.1415E-3)
+                      : (pose_diff * 2.).array().abs();
+    solution = pso_optimization(pose, &ref_frame, &scan_frame, deviation,
+                                ref_conf);
+
+    if (i < scan_index) {
+      pose_diff = solution - pose;
+      pose = solution;
+      ref_frame.update(pose, &scan_frame);
+    }
+  }
+
+  // The swarm of the node's PSO on this scan
+  vector<vector<Vector3d>> swarm;
+
+  if (with_swarm) {
+    OptimizationInfo info;
+    info.trace = &swarm;
+    Vector3d estimate = pso_optimization(pose, &ref_frame, &scan_frame,
+                                         deviation, PSOConfig(), &info);
+    Vector3d error = estimate - solution;
+    printf("PSO: %lu iterations, error %.4fm %.5frad, cost %.4f\n",
+           swarm.size() - 1, error.head<2>().norm(),
+           fabs(atan2(sin(error.z()), cos(error.z()))), info.cost);
+
+    FILE *swarm_file = fopen((output + ".swarm.csv").c_str(), "w");
+    if (swarm_file) {
+      fprintf(swarm_file, "iteration,particle,x,y,theta\n");
+      for (size_t it = 0; it < swarm.size(); ++it) {
+        for (size_t p = 0; p < swarm[it].size(); ++p)
+          fprintf(swarm_file, "%lu,%lu,%.6f,%.6f,%.6f\n", it, p,
+                  swarm[it][p].x(), swarm[it][p].y(), swarm[it][p].z());
+      }
+      fclose(swarm_file);
+    }
+  }
+
+  LandscapeHeader header;
+  header.magic = LANDSCAPE_MAGIC;
+  header.version = LANDSCAPE_VERSION;
+  for (unsigned int k = 0; k < 3; ++k) {
+    header.steps[k] = steps;
+    header.center[k] = solution[k];
+    header.step[k] = 2. * (k < 2 ? half_side : half_angle) / (steps - 1);
+  }
+
+  size_t samples = size_t(steps) * steps * steps;
+  vector<float> costs(samples);
+
+  // The first evaluation builds the map if needed, before the parallel loop
+  double center_cost = cost_function(solution, &ref_frame, &scan_frame);
+
+#pragma omp parallel for schedule(dynamic, 64)
+  for (size_t s = 0; s < samples; ++s) {
+    size_t index[3] = {s % steps, (s / steps) % steps, s / (size_t(steps) *
+                                                            steps)};
+    Vector3d trans;
+    for (unsigned int k = 0; k < 3; ++k)
+      trans[k] = header.center[k] +
+                 (static_cast<double>(index[k]) - steps / 2) * header.step[k];
+    costs[s] = static_cast<float>(cost_function(trans, &ref_frame,
+                                                &scan_frame));
+  }
+
+  FILE *volume = fopen((output + ".vol").c_str(), "wb");
+  if (!volume ||
+      1 != fwrite(&header, sizeof(header), 1, volume) ||
+      samples != fwrite(costs.data(), sizeof(float), samples, volume)) {
+    printf("Cannot write \"%s.vol\"\n", output.c_str());
+    return 1;
+  }
+  fclose(volume);
+
+  // Landscape summary: the range of the cost (a flat landscape has a small
+  // one) and its local minima (strictly lower than their 26 neighbours)
+  auto global = static_cast<size_t>(
+      std::min_element(costs.begin(), costs.end()) - costs.begin());
+  unsigned int local_minima = 0;
+
+  auto n = static_cast<long>(steps);
+
+  for (size_t s = 0; s < samples; ++s) {
+    long i = static_cast<long>(s) % n, j = (static_cast<long>(s) / n) % n,
+         k = static_cast<long>(s) / (n * n);
+    bool minimum =
+        i > 0 && j > 0 && k > 0 && i < n - 1 && j < n - 1 && k < n - 1;
+
+    for (long dk = -1; minimum && dk <= 1; ++dk)
+      for (long dj = -1; minimum && dj <= 1; ++dj)
+        for (long di = -1; minimum && di <= 1; ++di)
+          minimum = (0 == di && 0 == dj && 0 == dk) ||
+                    costs[s] < costs[static_cast<size_t>(
+                                   ((k + dk) * n + j + dj) * n + i + di)];
+
+    if (minimum)
+      ++local_minima;
+  }
+
+  Vector3d global_pose;
+  size_t global_index[3] = {global % steps, (global / steps) % steps,
+                            global / (size_t(steps) * steps)};
+  for (unsigned int k = 0; k < 3; ++k)
+    global_pose[k] = header.center[k] +
+                     (static_cast<double>(global_index[k]) - steps / 2) *
+                         header.step[k];
+
+  printf("Scan %u, %ux%ux%u grid of %.3fm/%.4frad around (%.4f, %.4f, "
+         "%.4f)\n",
+         scan_index, steps, steps, steps, header.step[0], header.step[2],
+         solution.x(), solution.y(), solution.z());
+  printf("Cost at the reference pose %.4f, range [%.4f, %.4f]\n", center_cost,
+         costs[global], *std::max_element(costs.begin(), costs.end()));
+  printf("Grid minimum at (%.4f, %.4f, %.4f), %u local minima\n",
+         global_pose.x(), global_pose.y(), global_pose.z(), local_minima);
+
+#ifdef OPENCV_FOUND
+  save_slice(output + ".xy.png", costs, header, 0, 1, swarm);
+  save_slice(output + ".xt.png", costs, header, 0, 2, swarm);
+  save_slice(output + ".yt.png", costs, header, 1, 2, swarm);
+#else
+  printf("No slice images (built without OpenCV)\n");
+#endif
+
+  return 0;
+}
@@ -0,0 +1,159 @@
+// Compare the map representations (fixed grids and adaptive quadtrees) on
+// recorded data: memory, number of distributions, and the error of the scan
+// to map matching. All the maps are built from the same reference trajectory
+// (a long PSO run on a fine grid, see REF_*), so only the map changes.
+#include "ndtpso_slam/core.h"
+#include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/scanlog.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <eigen3/Eigen/Core>
+
+#define DEFAULT_FRAME_SIZE_M 50
+#define DEFAULT_SCANS_STRIDE 5
+#define REF_CELL_SIZE_M .5
+#define REF_ITERATIONS 100
+#define REF_POPULATION_SIZE 60
+#define MATCH_ITERATIONS 50
+
+using namespace Eigen;
+
+struct MapSetup {
+  const char *name;
+  double cell_side;
+  bool quadtree;
+};
+
+static const MapSetup setups[] = {
+    {"grid", .25, false},    {"grid", .5, false},    {"grid", 1., false},
+    {"grid", 2., false},     {"quadtree", 1., true}, {"quadtree", 2., true},
+};
+static const unsigned int num_setups = sizeof(setups) / sizeof(setups[0]);
+
+static size_t map_memory(const NDTFrame &frame) {
+  size_t bytes = frame.cells.size() * sizeof(NDTCell);
+
+  for (auto &cell : frame.cells) {
+    for (auto &points : cell.points)
+      bytes += points.capacity() * sizeof(Vector2d);
+  }
+
+  if (frame.quadTree())
+    bytes += frame.quadTree()->memoryUsage();
+
+  return bytes;
+}
+
+static size_t num_distributions(const NDTFrame &frame) {
+  if (frame.quadTree())
+    return frame.quadTree()->numOfLeaves();
+
+  size_t count = 0;
+  for (auto &cell : frame.cells)
+    count += cell.built;
+
+  return count;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s scans.csv [frame_size] [stride]\n", argv[0]);
+    return 1;
+  }
+
+  auto frame_size = static_cast<unsigned short>(
+      argc > 2 ? atoi(argv[2]) : DEFAULT_FRAME_SIZE_M);
+  unsigned int stride = argc > 3 ? static_cast<unsigned int>(atoi(argv[3]))
+                                 : DEFAULT_SCANS_STRIDE;
+
+  vector<ScanRecord> scans;
+  if (!load_scan_log(argv[1], scans))
+    return 1;
+
+  printf("Loaded %lu scans, frame %dx%dm\n", scans.size(), frame_size,
+         frame_size);
+
+  NDTFrame scan_frame(Vector3d::Zero(), frame_size, frame_size, frame_size,
+                      false);
+
+  // Reference trajectory
+  srand(0);
+
+  vector<Vector3d> poses(scans.size(), Vector3d::Zero());
+  {
+    NDTFrame ref_frame(Vector3d::Zero(), frame_size, frame_size,
+                       REF_CELL_SIZE_M);
+    PSOConfig ref_conf;
+    ref_conf.iterations = REF_ITERATIONS;
+    ref_conf.populationSize = REF_POPULATION_SIZE;
+
+    for (unsigned int i = 0; i < scans.size(); ++i) {
+      scan_frame.resetCells();
+      scan_frame.loadLaser(scans[i].ranges, scans[i].angle_min,
+                           scans[i].angle_increment, scans[i].range_max);
+
+      if (i > 0) {
+        Vector3d pose_diff = i > 1 ? Vector3d(poses[i - 1] - poses[i - 2])
+                                   : Vector3d::Zero();
+        Array3d deviation = i < 3 ? Array3d(.1, .1, 3.1415E-3)
+                                  : (pose_diff * 2.).array().abs();
+        poses[i] = pso_optimization(poses[i - 1], &ref_frame, &scan_frame,
+                                    deviation, ref_conf);
+      }
+
+      ref_frame.update(poses[i], &scan_frame);
+    }
+  }
+
+  printf("%-9s %6s %10s %10s %12s %12s %10s\n", "map", "cell_m", "cells",
+         "memory_kb", "trans_err_m", "rot_err_rad", "time_ms");
+
+  PSOConfig match_conf;
+  match_conf.iterations = MATCH_ITERATIONS;
+
+  for (unsigned int s = 0; s < num_setups; ++s) {
+    NDTPSOConfig config;
+    config.quadTree.enabled = setups[s].quadtree;
+
+    NDTFrame map(Vector3d::Zero(), frame_size, frame_size, setups[s].cell_side,
+                 true, config);
+    double trans_error = 0., rot_error = 0., time = 0.;
+    unsigned int count = 0;
+
+    srand(0);
+
+    for (unsigned int i = 0; i < scans.size(); ++i) {
+      scan_frame.resetCells();
+      scan_frame.loadLaser(scans[i].ranges, scans[i].angle_min,
+                           scans[i].angle_increment, scans[i].range_max);
+
+      if (i > 2 && 0 == i % stride) {
+        Array3d deviation =
+            ((poses[i - 1] - poses[i - 2]) * 2.).array().abs();
+        auto start = std::chrono::high_resolution_clock::now();
+        Vector3d estimate = pso_optimization(poses[i - 1], &map, &scan_frame,
+                                             deviation, match_conf);
+        std::chrono::duration<double> elapsed =
+            std::chrono::high_resolution_clock::now() - start;
+
+        Vector3d error = estimate - poses[i];
+        trans_error += error.head<2>().norm();
+        rot_error += fabs(atan2(sin(error.z()), cos(error.z())));
+        time += elapsed.count();
+        ++count;
+      }
+
+      map.update(poses[i], &scan_frame);
+    }
+
+    map.build();
+
+    printf("%-9s %6.2f %10lu %10lu %12.5f %12.6f %10.3f\n", setups[s].name,
+           setups[s].cell_side, num_distributions(map), map_memory(map) / 1024,
+           trans_error / std::max(1u, count), rot_error / std::max(1u, count),
+           1000. * time / std::max(1u, count));
+  }
+
+  return 0;
+}
@@ -0,0 +1,147 @@
+// Compare the optimizers (PSO, CMA-ES and DE) on recorded data: for each
+// budget, report the number of cost evaluations against the pose error.
+// The reference trajectory is computed with a long PSO run (see REF_*)
+#include "ndtpso_slam/core.h"
+#include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/scanlog.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <eigen3/Eigen/Core>
+
+#define DEFAULT_CELL_SIZE_M .5
+#define DEFAULT_FRAME_SIZE_M 50
+#define DEFAULT_SCANS_STRIDE 5
+#define REF_ITERATIONS 100
+#define REF_POPULATION_SIZE 60
+
+using namespace Eigen;
+
+static const int budgets[] = {5, 10, 20, 30, 50};
+static const unsigned int num_budgets = sizeof(budgets) / sizeof(budgets[0]);
+static const char *optimizer_names[] = {"pso", "cmaes", "de"};
+
+struct BenchResult {
+  double evaluations{0.}, trans_error{0.}, rot_error{0.}, time{0.};
+  unsigned int count{0};
+};
+
+static Vector3d run_optimizer(unsigned int optimizer, int iterations,
+                              const Vector3d &initial_guess,
+                              NDTFrame *ref_frame, const NDTFrame *new_frame,
+                              const Array3d &deviation,
+                              OptimizationInfo *info) {
+  switch (optimizer) {
+  case 1: {
+    CMAESConfig conf;
+    conf.iterations = iterations;
+    return cmaes_optimization(initial_guess, ref_frame, new_frame, deviation,
+                              conf, info);
+  }
+  case 2: {
+    DEConfig conf;
+    conf.iterations = iterations;
+    return de_optimization(initial_guess, ref_frame, new_frame, deviation,
+                           conf, info);
+  }
+  default: {
+    PSOConfig conf;
+    conf.iterations = iterations;
+    return pso_optimization(initial_guess, ref_frame, new_frame, deviation,
+                            conf, info);
+  }
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s scans.csv [cell_side] [frame_size] [stride]\n", argv[0]);
+    return 1;
+  }
+
+  double cell_side = argc > 2 ? atof(argv[2]) : DEFAULT_CELL_SIZE_M;
+  auto frame_size = static_cast<unsigned short>(
+      argc > 3 ? atoi(argv[3]) : DEFAULT_FRAME_SIZE_M);
+  unsigned int stride = argc > 4 ? static_cast<unsigned int>(atoi(argv[4]))
+                                 : DEFAULT_SCANS_STRIDE;
+
+  vector<ScanRecord> scans;
+  if (!load_scan_log(argv[1], scans))
+    return 1;
+
+  printf("Loaded %lu scans, cell side %.2fm, frame %dx%dm\n", scans.size(),
+         cell_side, frame_size, frame_size);
+
+  srand(0);
+
+  NDTFrame ref_frame(Vector3d::Zero(), frame_size, frame_size, cell_side);
+  BenchResult results[3][num_budgets];
+
+  PSOConfig ref_conf;
+  ref_conf.iterations = REF_ITERATIONS;
+  ref_conf.populationSize = REF_POPULATION_SIZE;
+
+  Vector3d pose = Vector3d::Zero(), pose_diff = Vector3d::Zero();
+  NDTFrame scan_frame(Vector3d::Zero(), frame_size, frame_size, frame_size,
+                      false);
+
+  for (unsigned int i = 0; i < scans.size(); ++i) {
+    scan_frame.resetCells();
+    scan_frame.loadLaser(scans[i].ranges, scans[i].angle_min,
+                         scans[i].angle_increment, scans[i].range_max);
+
+    if (i > 0) {
+      Array3d deviation = i < 3 ? Array3d(.1, .1, 3.1415E-3)
+                                : (pose_diff * 2.).array().abs();
+
+      Vector3d ref_pose = pso_optimization(pose, &ref_frame, &scan_frame,
+                                           deviation, ref_conf);
+
+      if (i > 2 && 0 == i % stride) {
+        for (unsigned int o = 0; o < 3; ++o) {
+          for (unsigned int b = 0; b < num_budgets; ++b) {
+            OptimizationInfo info;
+            auto start = std::chrono::high_resolution_clock::now();
+            Vector3d estimate = run_optimizer(o, budgets[b], pose, &ref_frame,
+                                              &scan_frame, deviation, &info);
+            std::chrono::duration<double> elapsed =
+                std::chrono::high_resolution_clock::now() - start;
+
+            Vector3d error = estimate - ref_pose;
+            auto &result = results[o][b];
+            result.evaluations += info.evaluations;
+            result.trans_error += error.head<2>().norm();
+            result.rot_error +=
+                fabs(atan2(sin(error.z()), cos(error.z())));
+            result.time += elapsed.count();
+            ++result.count;
+          }
+        }
+      }
+
+      pose_diff = ref_pose - pose;
+      pose = ref_pose;
+    }
+
+    ref_frame.update(pose, &scan_frame);
+  }
+
+  printf("%-6s %6s %10s %12s %12s %10s\n", "optim", "iters", "evals",
+         "trans_err_m", "rot_err_rad", "time_ms");
+
+  for (unsigned int o = 0; o < 3; ++o) {
+    for (unsigned int b = 0; b < num_budgets; ++b) {
+      auto &result = results[o][b];
+      if (0 == result.count)
+        continue;
+
+      printf("%-6s %6d %10.0f %12.5f %12.6f %10.3f\n", optimizer_names[o],
+             budgets[b], result.evaluations / result.count,
+             result.trans_error / result.count,
+             result.rot_error / result.count,
+             1000. * result.time / result.count);
+    }
+  }
+
+  return 0;
+}
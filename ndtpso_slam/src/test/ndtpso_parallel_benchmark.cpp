@@ -0,0 +1,129 @@
+// Scaling of the map maintenance with the number of threads: the time to
+// insert the scans in the map (NDTFrame::update) and to build it (only the
+// modified cells, and all the cells), from 1 thread to all the cores. The
+// trajectory is computed once (see TRAJ_*), then replayed for each count
+#include "ndtpso_slam/core.h"
+#include "ndtpso_slam/ndtframe.h"
+#include "ndtpso_slam/scanlog.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <eigen3/Eigen/Core>
+#include <omp.h>
+
+#define DEFAULT_CELL_SIZE_M .25
+#define DEFAULT_FRAME_SIZE_M 50
+#define TRAJ_CELL_SIZE_M .5
+#define TRAJ_ITERATIONS 30
+#define FULL_BUILD_REPEATS 10
+
+using namespace Eigen;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double elapsed_ms(const Clock::time_point &start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s scans.csv [cell_side] [frame_size] [max_threads]\n",
+           argv[0]);
+    return 1;
+  }
+
+  double cell_side = argc > 2 ? atof(argv[2]) : DEFAULT_CELL_SIZE_M;
+  auto frame_size = static_cast<unsigned short>(
+      argc > 3 ? atoi(argv[3]) : DEFAULT_FRAME_SIZE_M);
+  int max_threads = argc > 4 ? atoi(argv[4]) : omp_get_num_procs();
+
+  vector<ScanRecord> scans;
+  if (!load_scan_log(argv[1], scans))
+    return 1;
+
+  printf("Loaded %lu scans, cell side %.2fm, frame %dx%dm\n", scans.size(),
+         cell_side, frame_size, frame_size);
+
+  vector<NDTFrame *> scan_frames;
+  for (auto &scan : scans) {
+    auto frame = new NDTFrame(Vector3d::Zero(), frame_size, frame_size,
+                              frame_size, false);
+    frame->loadLaser(scan.ranges, scan.angle_min, scan.angle_increment,
+                     scan.range_max);
+    scan_frames.push_back(frame);
+  }
+
+  // Trajectory
+  srand(0);
+
+  vector<Vector3d> poses(scans.size(), Vector3d::Zero());
+  {
+    NDTFrame traj_frame(Vector3d::Zero(), frame_size, frame_size,
+                        TRAJ_CELL_SIZE_M);
+    PSOConfig conf;
+    conf.iterations = TRAJ_ITERATIONS;
+
+    for (unsigned int i = 0; i < scans.size(); ++i) {
+      if (i > 0) {
+        Vector3d pose_diff = i > 1 ? Vector3d(poses[i - 1] - poses[i - 2])
+                                   : Vector3d::Zero();
+        Array3d deviation = i < 3 ? Array3d(.1, .1, 3.1415E-3)
+                                  : (pose_diff * 2.).array().abs();
+        poses[i] = pso_optimization(poses[i - 1], &traj_frame, scan_frames[i],
+                                    deviation, conf);
+      }
+
+      traj_frame.update(poses[i], scan_frames[i]);
+    }
+  }
+
+  printf("%7s %12s %12s %14s %8s\n", "threads", "update_ms", "build_ms",
+         "full_build_ms", "speedup");
+
+  double reference = 0.;
+
+  for (int threads = 1; threads <= std::max(1, max_threads); ++threads) {
+    NDTPSOConfig config;
+    config.psoConfig.num_threads = threads;
+
+    NDTFrame map(Vector3d::Zero(), frame_size, frame_size, cell_side, true,
+                 config);
+    double update_time = 0., build_time = 0., full_build_time = 0.;
+
+    for (unsigned int i = 0; i < scans.size(); ++i) {
+      auto start = Clock::now();
+      map.update(poses[i], scan_frames[i]);
+      update_time += elapsed_ms(start);
+
+      start = Clock::now();
+      map.build();
+      build_time += elapsed_ms(start);
+    }
+
+    // Rebuild of the whole map (e.g. after loading it)
+    for (unsigned int r = 0; r < FULL_BUILD_REPEATS; ++r) {
+      for (unsigned int c = 0; c < map.numOfCells; ++c) {
+        if (map.cells[c].created)
+          map.markDirty(c);
+      }
+
+      auto start = Clock::now();
+      map.build();
+      full_build_time += elapsed_ms(start);
+    }
+
+    double total = update_time + build_time;
+    if (1 == threads)
+      reference = total;
+
+    printf("%7d %12.3f %12.3f %14.3f %8.2f\n", threads,
+           update_time / scans.size(), build_time / scans.size(),
+           full_build_time / FULL_BUILD_REPEATS, reference / total);
+  }
+
+  for (auto frame : scan_frames)
+    delete frame;
+
+  return 0;
+}
@@ -0,0 +1,225 @@
+// Test of the tiled map (see TiledMap) through the matcher: a robot drives
+// along a simulated corridor, out and back, across several tile boundaries,
+// so the view is recentered many times and the tiles are written back and
+// loaded again. Each matched pose must stay close to the true pose, and its
+// motion close to the true motion (no jump when the view moves), as the
+// motion the next search is sized with (see NDTFrame::align).
+// The exit status is the number of failed checks (0 if all passed).
+#include "ndtpso_slam/matcher.h"
+#include "ndtpso_slam/scanlog.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <eigen3/Eigen/Core>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+#define TEST_SEED 42
+#define TEST_BEAMS 360
+#define TEST_RANGE_MAX_M 8.f // Below a quarter of the view
+#define TEST_RANGE_NOISE_M .01
+#define TEST_VIEW_SIZE_M 40 // Recentered 10m away from its center
+#define TEST_TILE_SIZE_M 5.
+#define TEST_CACHE_SIZE 4 // Tiles, raised to the view and its prefetch
+#define TEST_CORRIDOR_LENGTH_M 50.
+#define TEST_CORRIDOR_HALF_WIDTH_M 3.
+#define TEST_STEP_M .25
+#define TEST_MAX_ERROR_M .15
+#define TEST_MAX_MOTION_ERROR_M .1
+#define TEST_SCAN_PERIOD_S .1
+
+using namespace Eigen;
+
+struct Segment {
+  Vector2d a, b;
+};
+
+// Walls of a corridor along x, with boxes along both walls (irregularly
+// spaced, so the position along the corridor is observable)
+static vector<Segment> corridor(std::mt19937 &generator) {
+  std::uniform_real_distribution<double> uniform(0., 1.);
+  vector<Segment> walls;
+  double half = TEST_CORRIDOR_HALF_WIDTH_M;
+
+  walls.push_back({Vector2d(-10., -half), Vector2d(60., -half)});
+  walls.push_back({Vector2d(-10., half), Vector2d(60., half)});
+  walls.push_back({Vector2d(-10., -half), Vector2d(-10., half)});
+
+  for (double x = -8.; x < TEST_CORRIDOR_LENGTH_M;
+       x += 1.5 + uniform(generator)) {
+    double side = uniform(generator) < .5 ? -1. : 1.,
+           depth = .3 + .7 * uniform(generator),
+           length = .3 + .6 * uniform(generator);
+    Vector2d corner(x, side * half), inner(x, side * (half - depth)),
+        inner_end(x + length, side * (half - depth)),
+        end(x + length, side * half);
+
+    walls.push_back({corner, inner});
+    walls.push_back({inner, inner_end});
+    walls.push_back({inner_end, end});
+  }
+
+  return walls;
+}
+
+// Ray casting of the walls from 'pose'
+static ScanRecord simulate_scan(const vector<Segment> &walls,
+                                const Vector3d &pose,
+                                std::mt19937 &generator) {
+  std::normal_distribution<double> noise(0., TEST_RANGE_NOISE_M);
+  ScanRecord scan;
+
+  scan.angle_min = float(-M_PI);
+  scan.angle_increment = float(2. * M_PI / TEST_BEAMS);
+  scan.range_max = TEST_RANGE_MAX_M;
+  scan.ranges.resize(TEST_BEAMS);
+
+  for (unsigned int i = 0; i < TEST_BEAMS; ++i) {
+    double theta = pose.z() + double(scan.angle_min) +
+                   i * double(scan.angle_increment);
+    Vector2d origin = pose.head<2>(), direction(cos(theta), sin(theta));
+    double range = HUGE_VAL;
+
+    for (auto &wall : walls) {
+      Vector2d edge = wall.b - wall.a, offset = wall.a - origin;
+      double det = direction.x() * -edge.y() + edge.x() * direction.y();
+
+      if (fabs(det) < 1e-12)
+        continue;
+
+      double t = (offset.x() * -edge.y() + edge.x() * offset.y()) / det,
+             u = (direction.x() * offset.y() - direction.y() * offset.x()) /
+                 det;
+
+      if (t > 0. && u >= 0. && u <= 1.)
+        range = std::min(range, t);
+    }
+
+    scan.ranges[i] = range < double(scan.range_max)
+                         ? float(range + noise(generator))
+                         : scan.range_max + 1.f;
+  }
+
+  return scan;
+}
+
+int main() {
+  std::mt19937 generator(TEST_SEED);
+  srand(TEST_SEED);
+
+  char directory[] = "/tmp/ndtpso_tiledmap_test_XXXXXX";
+  if (!mkdtemp(directory)) {
+    printf("Cannot create a temporary directory\n");
+    return 1;
+  }
+
+  vector<Segment> walls = corridor(generator);
+
+  // Out to the end of the corridor and back
+  vector<Vector3d> truth;
+  for (double x = 0.; x <= TEST_CORRIDOR_LENGTH_M - 10.; x += TEST_STEP_M)
+    truth.emplace_back(x, .2 * sin(x / 5.), 0.);
+  for (size_t i = truth.size() - 1; i-- > 0;)
+    truth.push_back(truth[i]);
+
+  MatcherConfig config;
+  config.frame_size = TEST_VIEW_SIZE_M;
+  config.tile_store = directory;
+  config.tile_size = TEST_TILE_SIZE_M;
+  config.tile_cache_size = TEST_CACHE_SIZE;
+  // Every match is used, a lost one fails the test
+  config.ndt.qualityConfig.min_score = 0.;
+  config.ndt.qualityConfig.min_inlier_ratio = 0.;
+  config.ndt.qualityConfig.min_degeneracy = 0.;
+
+  unsigned int failed_poses = 0, failed_motions = 0, failed_searches = 0;
+  double max_error = 0., max_motion_error = 0., max_search_error = 0.;
+
+  {
+    Matcher matcher(config);
+    Vector3d previous = Vector3d::Zero();
+
+    for (size_t i = 0; i < truth.size(); ++i) {
+      ScanRecord scan = simulate_scan(walls, truth[i], generator);
+      ScanView view;
+      view.timestamp = i * TEST_SCAN_PERIOD_S;
+      view.ranges = scan.ranges.data();
+      view.count = scan.ranges.size();
+      view.angle_min = scan.angle_min;
+      view.angle_increment = scan.angle_increment;
+      view.range_max = scan.range_max;
+
+      MatchResult result;
+      matcher.process(view, result);
+
+      double error = (result.pose - truth[i]).head<2>().norm(),
+             motion_error =
+                 i > 0 ? ((result.pose - previous) - (truth[i] - truth[i - 1]))
+                             .head<2>()
+                             .norm()
+                       : 0.;
+      // The last motion of the view's frame, in its own (moving) frame
+      double search_error =
+          i > 1 ? (matcher.map()->lastMotion() - (truth[i] - truth[i - 1]))
+                      .head<2>()
+                      .norm()
+                : 0.;
+      max_error = std::max(max_error, error);
+      max_search_error = std::max(max_search_error, search_error);
+      max_motion_error = std::max(max_motion_error, motion_error);
+
+      if (error > TEST_MAX_ERROR_M && ++failed_poses <= 5)
+        printf("  scan %lu at x=%.2f: pose error %.3fm\n",
+               static_cast<unsigned long>(i), truth[i].x(), error);
+      if (motion_error > TEST_MAX_MOTION_ERROR_M && ++failed_motions <= 5)
+        printf("  scan %lu at x=%.2f: motion error %.3fm\n",
+               static_cast<unsigned long>(i), truth[i].x(), motion_error);
+      if (search_error > TEST_MAX_MOTION_ERROR_M && ++failed_searches <= 5)
+        printf("  scan %lu at x=%.2f: search motion error %.3fm\n",
+               static_cast<unsigned long>(i), truth[i].x(), search_error);
+
+      previous = result.pose;
+    }
+  } // Writes the tiles back
+
+  unsigned int failed = 0;
+
+  printf("%s %-28s %5lu scans, max error %.3fm\n",
+         failed_poses ? "FAIL" : "PASS", "tiled map poses",
+         static_cast<unsigned long>(truth.size()), max_error);
+  failed += failed_poses ? 1u : 0u;
+  printf("%s %-28s %5lu scans, max error %.3fm\n",
+         failed_motions ? "FAIL" : "PASS", "tiled map motions",
+         static_cast<unsigned long>(truth.size()), max_motion_error);
+  failed += failed_motions ? 1u : 0u;
+  printf("%s %-28s %5lu scans, max error %.3fm\n",
+         failed_searches ? "FAIL" : "PASS", "tiled map search motions",
+         static_cast<unsigned long>(truth.size()), max_search_error);
+  failed += failed_searches ? 1u : 0u;
+
+  // The tiles of the whole corridor were written back
+  std::string command = "ls " + std::string(directory) + "/*.tile | wc -l";
+  FILE *list = popen(command.c_str(), "r");
+  unsigned int tiles = 0;
+  if (list) {
+    if (1 != fscanf(list, "%u", &tiles))
+      tiles = 0;
+    pclose(list);
+  }
+  auto expected_tiles = static_cast<unsigned int>(
+      ceil((TEST_CORRIDOR_LENGTH_M - 10.) / TEST_TILE_SIZE_M));
+  bool written = tiles >= expected_tiles;
+  printf("%s %-28s %5u tiles\n", written ? "PASS" : "FAIL",
+         "tiled map stored", tiles);
+  failed += written ? 0u : 1u;
+
+  command = "rm -r " + std::string(directory);
+  if (0 != system(command.c_str()))
+    printf("Cannot remove \"%s\"\n", directory);
+
+  printf("\n%s\n", failed ? "FAILED" : "ALL PASSED");
+
+  return static_cast<int>(failed);
+}